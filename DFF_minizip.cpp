@@ -0,0 +1,872 @@
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <ff/ff.hpp>
+#include <ff/farm.hpp>
+#include <ff/all2all.hpp>
+using namespace ff;
+#include <ff/distributed/ff_batchbuffer.hpp>
+#include <utility.hpp>
+#include <blockpool.hpp>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// Distributed version of FF_minizip: the master process runs the L_Workers (they read, split and
+// write the files), the blocks are compressed/decompressed by the farms of the worker processes.
+// The blocks travel as raw bytes (a small header + the block) in batches written with writev,
+// over TCP or Unix sockets.
+
+struct FileStruct
+{
+  std::string filename;
+  size_t size;
+  // In this array the pointer of the blocks are stored
+  size_t *sizeOfBlocks;
+  unsigned char **arrayOfPointers;
+};
+
+// ------------ GLOBAL VARIBLES ---------------
+std::vector<FileStruct> FilesVector;
+bool compressing = false;
+bool success = true;
+BlockPool blockPool; // buffers of the compressed blocks received by the master
+// ------------ END GLOBAL VARIBLES ---------------
+
+// Kind of the messages in a batch, written in the chid field of the message
+enum : int
+{
+  MSG_EOS = 0,    // no more blocks
+  MSG_HEADER = 1, // BlockHeader of the next block
+  MSG_DATA = 2    // the block
+};
+// Header of a block on the wire, in big endian. The master uses seq to find the task of a result.
+struct BlockHeader
+{
+  uint64_t seq;     // id of the block in the master
+  uint64_t rawSize; // size of the block uncompressed
+  uint64_t status;  // result: 0 if ok
+};
+static const int DEFAULT_BATCH = 8;         // blocks in a batch
+static const int MAX_BATCH = 127;           // a block is 2 messages, 4 iovec each (UIO_MAXIOV)
+static const int CONNECT_RETRIES = 100;
+
+static inline bool addFileToVector(const char fname[], size_t size, const bool comp, std::vector<FileStruct> &FilesVector)
+{
+  const std::string infilename(fname);
+  if (!comp)
+  {
+    if (!ends_with(infilename, ".miniz"))
+      return true;
+  }
+  FilesVector.emplace_back(infilename, size);
+  return true;
+}
+
+static inline bool walkDirff(const char dname[], const bool comp, std::vector<FileStruct> &FilesVector)
+{
+  return walkFiles(dname, comp, [comp, &FilesVector](const std::string &name, const char *, const struct stat &statbuf)
+                   { return addFileToVector(name.c_str(), statbuf.st_size, comp, FilesVector); });
+}
+
+static inline void usage(const char *argv0)
+{
+  printf("--------------------\n");
+  printf("Usage: %s c|d|C|D file-or-directory L-Workers R-Workers [-n processes] [-l endpoint] [-b batch]\n", argv0);
+  printf("       %s w endpoint R-Workers\n", argv0);
+  printf("\nModes:\n");
+  printf("c - Compresses file infile to a zlib stream into outfile\n");
+  printf("d - Decompress a zlib stream from infile into outfile\n");
+  printf("w - Worker process, gets the blocks from the master at endpoint\n");
+  printf("\nOptions:\n");
+  printf("-n - Number of worker processes (default 2)\n");
+  printf("-l - Endpoint (host:port or path of a Unix socket) where the master waits for the workers\n");
+  printf("     started with mode w, without it the workers are started on this machine\n");
+  printf("-b - Blocks in a batch (default %d, max %d)\n", DEFAULT_BATCH, MAX_BATCH);
+  printf("--------------------\n");
+}
+
+// Descriptor of a block, the name of the file is in FilesVector[idFile].
+// Recycled through taskPool, so it must stay trivially copyable.
+struct Task_t
+{
+  unsigned char *ptr;              // input pointer
+  size_t size;                     // input size
+  unsigned char *ptrOut = nullptr; // output pointer
+  size_t cmp_size = 0;             // output size
+  size_t blockid = 1;              // block identifier (for "BIG files")
+  size_t nblocks = 1;              // #blocks in which a "BIG file" is split
+  size_t idFile = 0;               // Id of the file in the FileVector
+  size_t readBytes = 0;            // Used in the decompression to understand where each worker has to start
+  size_t uncompreFileSize = 0;     // Size of the uncompressed file
+};
+TaskPool<Task_t> taskPool;
+
+// A block in a worker process
+struct RemoteBlock
+{
+  BlockHeader header;
+  char *data = nullptr;
+  size_t size = 0;
+};
+
+// ------------ SOCKETS ---------------
+
+// host:port is a TCP endpoint, anything else is the path of a Unix socket
+static inline ff_endpoint parseEndpoint(const std::string &s)
+{
+  size_t pos = s.rfind(':');
+  if (pos == std::string::npos)
+    return ff_endpoint(s, -1);
+  return ff_endpoint(s.substr(0, pos), std::stoi(s.substr(pos + 1)));
+}
+
+static inline int listenOn(const ff_endpoint &ep)
+{
+  int fd;
+  if (ep.port < 0)
+  {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ep.address.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(ep.address.c_str());
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      perror("bind");
+      return -1;
+    }
+  }
+  else
+  {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(ep.port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    int one = 1;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      perror("bind");
+      return -1;
+    }
+  }
+  if (listen(fd, SOMAXCONN) < 0)
+  {
+    perror("listen");
+    return -1;
+  }
+  return fd;
+}
+
+static inline void setNoDelay(int fd, const ff_endpoint &ep)
+{
+  int one = 1;
+  if (ep.port >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// The master may not be listening yet, so the connection is tried a few times
+static inline int connectTo(const ff_endpoint &ep)
+{
+  for (int attempt = 0; attempt < CONNECT_RETRIES; ++attempt)
+  {
+    int fd = -1;
+    if (ep.port < 0)
+    {
+      struct sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, ep.address.c_str(), sizeof(addr.sun_path) - 1);
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        return fd;
+    }
+    else
+    {
+      struct addrinfo hints = {}, *res;
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(ep.address.c_str(), std::to_string(ep.port).c_str(), &hints, &res) == 0)
+      {
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        bool connected = fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (connected)
+        {
+          setNoDelay(fd, ep);
+          return fd;
+        }
+      }
+    }
+    if (fd >= 0)
+      close(fd);
+    usleep(100000);
+  }
+  perror("connect");
+  return -1;
+}
+
+// Adds a message to the batch, the data is not copied: if cleanup it is deleted after the send
+static inline int pushMessage(ff_batchBuffer &batch, int kind, char *data, size_t size, bool cleanup)
+{
+  message_t *m = new message_t(data, size, cleanup);
+  m->sender = 0;
+  m->chid = kind;
+  return batch.push(m);
+}
+
+static inline int pushHeader(ff_batchBuffer &batch, const BlockHeader &header)
+{
+  BlockHeader *h = (BlockHeader *)new char[sizeof(BlockHeader)];
+  h->seq = htobe64(header.seq);
+  h->rawSize = htobe64(header.rawSize);
+  h->status = htobe64(header.status);
+  return pushMessage(batch, MSG_HEADER, (char *)h, sizeof(BlockHeader), true);
+}
+
+// Reads the batches written by ff_batchBuffer: number of messages, then for each message
+// sender, kind and size followed by the data. onMessage reads the data of the message.
+template <typename F>
+static inline bool readBatch(int fd, F onMessage)
+{
+  int count;
+  if (readn(fd, (char *)&count, sizeof(int)) != sizeof(int))
+    return false;
+  count = ntohl(count);
+  for (int i = 0; i < count; ++i)
+  {
+    int sender, kind;
+    size_t size;
+    struct iovec iov[3] = {{&sender, sizeof(int)}, {&kind, sizeof(int)}, {&size, sizeof(size_t)}};
+    if (readvn(fd, iov, 3) <= 0)
+      return false;
+    if (!onMessage(ntohl(kind), be64toh(size)))
+      return false;
+  }
+  return true;
+}
+
+static inline bool readHeader(int fd, size_t size, BlockHeader &header)
+{
+  if (size != sizeof(BlockHeader) || readn(fd, (char *)&header, size) != (ssize_t)size)
+    return false;
+  header.seq = be64toh(header.seq);
+  header.rawSize = be64toh(header.rawSize);
+  header.status = be64toh(header.status);
+  return true;
+}
+
+// ------------ MASTER ---------------
+
+static inline bool writeToDisk(Task_t *in, std::vector<std::atomic<int>> &vectorOfCounters)
+{
+  size_t idFile = in->idFile;
+  size_t sizeOfT = sizeof(size_t);
+  size_t nBlocks = in->nblocks;
+
+  // Creation of the header
+  std::vector<size_t> header = {in->size, nBlocks};
+  header.insert(header.end(), FilesVector[idFile].sizeOfBlocks, FilesVector[idFile].sizeOfBlocks + nBlocks);
+
+  std::string outfilename = FilesVector[in->idFile].filename + SUFFIX;
+  FILE *pOutfile = fopen(outfilename.c_str(), "wb");
+  if (!pOutfile)
+  {
+    if (QUITE_MODE >= 1)
+    {
+      perror("fopen");
+      std::fprintf(stderr, "Failed opening output file %s!\n", outfilename.c_str());
+    }
+    return false;
+  }
+  // Write header
+  bool ok = fwrite(header.data(), sizeOfT, header.size(), pOutfile) == header.size();
+  for (size_t i = 0; i < nBlocks && ok; ++i)
+    ok = fwrite(FilesVector[idFile].arrayOfPointers[i], 1, FilesVector[idFile].sizeOfBlocks[i], pOutfile) == FilesVector[idFile].sizeOfBlocks[i];
+  if (!ok && QUITE_MODE >= 1)
+  {
+    perror("fwrite");
+    std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
+  }
+  if (fclose(pOutfile) != 0)
+    return false;
+  return ok;
+}
+struct MultiInputHelperNode : ff::ff_minode_t<Task_t>
+{
+  Task_t *svc(Task_t *in)
+  {
+    return in;
+  }
+};
+struct L_Worker : ff_monode_t<Task_t>
+{ // must be multi-output
+
+  L_Worker(std::vector<std::atomic<int>> &vectorOfCounters, size_t id, size_t numberOfTasks, size_t NumberOfLWorkers)
+      : vectorOfCounters(vectorOfCounters), id(id), numberOfTasks(numberOfTasks), NumberOfLWorkers(NumberOfLWorkers) {}
+
+  Task_t *svc(Task_t *in)
+  {
+    // IF THE INPUT IS NULL WE ARE AT THE BEGINNING AND
+    // WE ARE JUST SPLITTING THE WORK BETWEEN THE WORKERS
+    if (in == nullptr)
+    {
+      // Each Worker will read numberOfTasks files
+      for (size_t i = 0; i < numberOfTasks; ++i)
+      {
+        size_t idFile = id + i * NumberOfLWorkers;
+        const std::string infilename(FilesVector[idFile].filename);
+        size_t infile_size = FilesVector[idFile].size;
+        size_t sizeOfT = sizeof(size_t);
+
+        unsigned char *ptr = nullptr;
+        if (!mapFile(infilename.c_str(), infile_size, ptr))
+        {
+          std::fprintf(stderr, "Failed to mapFile\n");
+          success = false;
+          continue;
+        }
+        if (!compressing && (hasChunks(ptr, infile_size) || hasDedupRefs(ptr, infile_size)))
+        {
+          std::fprintf(stderr, "%s has deduplicated or variable size blocks, use FF_minizip or SEQ_minizip\n", infilename.c_str());
+          unmapFile(ptr, infile_size);
+          success = false;
+          continue;
+        }
+
+        if (compressing) //***********COMPRESSING********
+        {
+          const size_t fullblocks = infile_size / BIGFILE_LOW_THRESHOLD;
+          const size_t partialblock = infile_size % BIGFILE_LOW_THRESHOLD;
+          size_t numberOfBlocks = fullblocks + (partialblock ? 1 : 0);
+
+          // This two arrays are used to store the pointers of the compressed data and the size of each block
+          FilesVector[idFile].arrayOfPointers = new unsigned char *[numberOfBlocks];
+          FilesVector[idFile].sizeOfBlocks = new size_t[numberOfBlocks];
+
+          // Sending task to the workers
+          for (size_t j = 0; j < numberOfBlocks; ++j)
+          {
+            Task_t *t = taskPool.get();
+            t->blockid = j;
+            t->idFile = idFile;
+            t->nblocks = numberOfBlocks;
+            t->ptr = ptr;
+            t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * j;
+            t->size = infile_size;
+            t->cmp_size = j < fullblocks ? BIGFILE_LOW_THRESHOLD : partialblock;
+            ff_send_out(t);
+          }
+        }
+        else //***********DECOMPRESSING********
+        {
+          // Size of the uncompressed file and number of blocks taken from header
+          size_t uncompressedFileSize;
+          size_t numberOfBlocks;
+          memcpy(&uncompressedFileSize, ptr, sizeOfT);
+          memcpy(&numberOfBlocks, ptr + sizeOfT, sizeOfT);
+
+          // creation of an array with length of the uncompressed file bytes
+          unsigned char *ptrOut = new unsigned char[uncompressedFileSize];
+
+          size_t bytesRead = sizeOfT * (numberOfBlocks + 2);
+          // Send to workers
+          for (size_t j = 0; j < numberOfBlocks; ++j)
+          {
+            Task_t *t = taskPool.get();
+            t->blockid = j;
+            t->idFile = idFile;
+            t->nblocks = numberOfBlocks;
+            t->ptr = ptr;
+            t->ptrOut = ptrOut;
+            t->uncompreFileSize = uncompressedFileSize;
+            t->size = infile_size;
+            t->readBytes = bytesRead;
+            memcpy(&t->cmp_size, ptr + sizeOfT * (j + 2), sizeOfT);
+            bytesRead = bytesRead + t->cmp_size;
+            ff_send_out(t);
+          }
+        }
+      }
+      return EOS;
+    }
+    else // HERE WE WRITE IN THE FILE
+    {
+      size_t idFile = in->idFile;
+      if (compressing)
+      {
+        // Add the compressed block of memory to the array of pointers
+        FilesVector[idFile].arrayOfPointers[in->blockid] = in->ptrOut;
+        FilesVector[idFile].sizeOfBlocks[in->blockid] = in->cmp_size;
+      }
+      // Using an atomic to check when all the blocks have been processed
+      int val = vectorOfCounters[idFile].fetch_add(1);
+      if (val < (int)in->nblocks - 1)
+      {
+        taskPool.put(in);
+        return GO_ON;
+      }
+      if (compressing)
+      {
+        if (!writeToDisk(in, vectorOfCounters))
+        {
+          std::fprintf(stderr, "Problems in the writing of the file.\n");
+          success = false;
+        }
+        // Cleaning memory
+        for (size_t i = 0; i < in->nblocks; ++i)
+          blockPool.put(FilesVector[idFile].arrayOfPointers[i]);
+        delete[] FilesVector[idFile].arrayOfPointers;
+        delete[] FilesVector[idFile].sizeOfBlocks;
+      }
+      else
+      {
+        // if the file exist in the directory it will add 1,2,3..
+        const std::string &infilename = FilesVector[idFile].filename;
+        std::string outfilename = infilename.substr(0, infilename.size() - 6);
+        int a = 1;
+        std::string tempFileName = outfilename;
+        while (existsFile(tempFileName))
+        {
+          tempFileName = outfilename;
+          size_t pos = outfilename.find(".");
+          if (pos == std::string::npos)
+            tempFileName = outfilename + std::to_string(a);
+          else
+            tempFileName = tempFileName.insert(pos, std::to_string(a));
+          a++;
+        }
+        if (!writeFile(tempFileName, in->ptrOut, in->uncompreFileSize))
+          success = false;
+        delete[] in->ptrOut;
+      }
+      unmapFile(in->ptr, in->size);
+      taskPool.put(in);
+      return GO_ON;
+    }
+  }
+  std::vector<std::atomic<int>> &vectorOfCounters;
+  size_t id;
+  size_t numberOfTasks;
+  size_t NumberOfLWorkers;
+};
+
+// Takes the place of the R_Workers in the master: sends the blocks to a worker process and
+// gives back the results to the L_Workers. At most window blocks are on the worker process.
+struct RemoteWorker : ff_monode_t<Task_t>
+{
+  RemoteWorker(int fd, size_t window, int batchSize)
+      : fd(fd), window(window), batch(2 * batchSize, FWD, [fd](struct iovec *v, int count)
+                                      { return writevn(fd, v, count) > 0; }) {}
+
+  Task_t *svc(Task_t *in)
+  {
+    if (broken)
+    {
+      success = false;
+      return GO_ON;
+    }
+    BlockHeader header = {nextSeq, in->cmp_size, 0};
+    char *data = (char *)in->ptrOut;
+    if (!compressing)
+    {
+      // Size of the block once decompressed (the last one can be smaller)
+      header.rawSize = std::min(BIGFILE_LOW_THRESHOLD, in->uncompreFileSize - std::min(in->uncompreFileSize, in->blockid * BIGFILE_LOW_THRESHOLD));
+      data = (char *)in->ptr + in->readBytes;
+    }
+    pending[nextSeq++] = in;
+    if (pushHeader(batch, header) < 0 || pushMessage(batch, MSG_DATA, data, in->cmp_size, false) < 0)
+      return fail("sending a block");
+
+    // Too many blocks on the worker, wait for some results
+    while (pending.size() >= window && !broken)
+    {
+      if (batch.flush() < 0 || !readResults())
+        return fail("receiving the results");
+    }
+    // Takes the results already arrived
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (!broken && poll(&pfd, 1, 0) > 0)
+    {
+      if (!readResults())
+        return fail("receiving the results");
+    }
+    return GO_ON;
+  }
+
+  void eosnotify(ssize_t)
+  {
+    if (broken)
+      return;
+    if (batch.sendEOS() < 0)
+    {
+      fail("sending the end of the stream");
+      return;
+    }
+    while (!remoteEOS)
+    {
+      if (!readResults())
+      {
+        fail("receiving the results");
+        return;
+      }
+    }
+    if (!pending.empty())
+      fail("some blocks were not processed");
+  }
+
+  Task_t *fail(const char *what)
+  {
+    std::fprintf(stderr, "Worker process: error %s\n", what);
+    success = false;
+    broken = true;
+    return GO_ON;
+  }
+
+  // Reads a batch of results, the blocks are given back to the L_Workers
+  bool readResults()
+  {
+    return readBatch(fd, [this](int kind, size_t size)
+                     {
+      if (kind == MSG_EOS)
+      {
+        remoteEOS = true;
+        return true;
+      }
+      if (kind == MSG_HEADER)
+        return readHeader(fd, size, lastHeader);
+      auto it = pending.find(lastHeader.seq);
+      if (it == pending.end())
+        return false;
+      Task_t *t = it->second;
+      pending.erase(it);
+      if (lastHeader.status != 0)
+      {
+        std::fprintf(stderr, "Failed to %s a block of %s\n", compressing ? "compress" : "decompress", FilesVector[t->idFile].filename.c_str());
+        success = false;
+        taskPool.put(t);
+        return size == 0;
+      }
+      if (compressing)
+      {
+        if (size > blockPool.size())
+          return false;
+        t->ptrOut = blockPool.get();
+        if (readn(fd, (char *)t->ptrOut, size) != (ssize_t)size)
+          return false;
+      }
+      else
+      {
+        // The block goes directly in its place in the output
+        if (t->blockid * BIGFILE_LOW_THRESHOLD + size > t->uncompreFileSize)
+          return false;
+        if (readn(fd, (char *)t->ptrOut + t->blockid * BIGFILE_LOW_THRESHOLD, size) != (ssize_t)size)
+          return false;
+      }
+      t->cmp_size = size;
+      ff_send_out(t);
+      return true; });
+  }
+
+  int fd;
+  size_t window;
+  ff_batchBuffer batch;
+  std::unordered_map<uint64_t, Task_t *> pending;
+  uint64_t nextSeq = 0;
+  BlockHeader lastHeader = {};
+  bool remoteEOS = false;
+  bool broken = false;
+};
+
+// ------------ WORKER PROCESS ---------------
+
+// Reads the blocks sent by the master
+struct Receiver : ff_node_t<RemoteBlock>
+{
+  Receiver(int fd) : fd(fd) {}
+
+  RemoteBlock *svc(RemoteBlock *)
+  {
+    bool eos = false;
+    BlockHeader header;
+    while (!eos)
+    {
+      bool ok = readBatch(fd, [&](int kind, size_t size)
+                          {
+        if (kind == MSG_EOS)
+        {
+          eos = true;
+          return true;
+        }
+        if (kind == MSG_HEADER)
+          return readHeader(fd, size, header);
+        RemoteBlock *b = new RemoteBlock;
+        b->header = header;
+        b->data = new char[size];
+        b->size = size;
+        if (readn(fd, b->data, size) != (ssize_t)size)
+          return false;
+        ff_send_out(b);
+        return true; });
+      if (!ok)
+      {
+        std::fprintf(stderr, "Error receiving the blocks from the master\n");
+        success = false;
+        break;
+      }
+    }
+    return EOS;
+  }
+
+  int fd;
+};
+
+struct R_Worker : ff_node_t<RemoteBlock>
+{
+  RemoteBlock *svc(RemoteBlock *in)
+  {
+    char *out;
+    size_t outSize;
+    if (compressing) //***********COMPRESSING********
+    {
+      outSize = compressBound(in->size);
+      out = new char[outSize];
+      if (compress((unsigned char *)out, &outSize, (const unsigned char *)in->data, in->size) != Z_OK)
+        in->header.status = 1;
+    }
+    else //***********DECOMPRESSING********
+    {
+      outSize = in->header.rawSize;
+      out = new char[outSize];
+      if (mz_uncompress((unsigned char *)out, &outSize, (const unsigned char *)in->data, in->size) != MZ_OK)
+        in->header.status = 1;
+    }
+    delete[] in->data;
+    in->data = out;
+    in->size = in->header.status ? 0 : outSize;
+    return in;
+  }
+};
+
+// Sends the results to the master
+struct Sender : ff_minode_t<RemoteBlock>
+{
+  Sender(int fd, int batchSize)
+      : batch(2 * batchSize, FWD, [fd](struct iovec *v, int count)
+              { return writevn(fd, v, count) > 0; }) {}
+
+  RemoteBlock *svc(RemoteBlock *in)
+  {
+    if (pushHeader(batch, in->header) < 0 || pushMessage(batch, MSG_DATA, in->data, in->size, true) < 0)
+    {
+      std::fprintf(stderr, "Error sending the results to the master\n");
+      success = false;
+    }
+    delete in;
+    return GO_ON;
+  }
+
+  // eosnotify is called for each R_Worker, svc_end when all of them have finished
+  void svc_end()
+  {
+    if (batch.sendEOS() < 0)
+      success = false;
+  }
+
+  ff_batchBuffer batch;
+};
+
+static inline bool runWorkerProcess(const ff_endpoint &ep, int Rw)
+{
+  int fd = connectTo(ep);
+  if (fd < 0)
+    return false;
+  // The master tells the mode and the size of the batches
+  int setup[2];
+  if (readn(fd, (char *)setup, sizeof(setup)) != sizeof(setup))
+  {
+    close(fd);
+    return false;
+  }
+  compressing = ntohl(setup[0]);
+  int batchSize = ntohl(setup[1]);
+  int workers = htonl(Rw);
+  if (writen(fd, (char *)&workers, sizeof(int)) != sizeof(int))
+  {
+    close(fd);
+    return false;
+  }
+
+  std::vector<ff_node *> RW;
+  for (int i = 0; i < Rw; ++i)
+    RW.push_back(new R_Worker);
+  ff_farm farm(RW);
+  farm.add_emitter(new Receiver(fd));
+  farm.add_collector(new Sender(fd, batchSize));
+  farm.cleanup_all();
+  if (farm.run_and_wait_end() < 0)
+  {
+    error("running farm\n");
+    success = false;
+  }
+  close(fd);
+  return success;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 4)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+  const char *pMode = argv[1];
+  if (!strchr("cCdDw", pMode[0]))
+  {
+    printf("Invalid option!\n\n");
+    usage(argv[0]);
+    return -1;
+  }
+  // A broken connection is an error on the socket, not a signal
+  signal(SIGPIPE, SIG_IGN);
+  if (pMode[0] == 'w')
+    return runWorkerProcess(parseEndpoint(argv[2]), std::stol(argv[3])) ? 0 : -1;
+  if (argc < 5)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+  compressing = ((pMode[0] == 'c') || (pMode[0] == 'C'));
+
+  // TIMER
+  const auto start = std::chrono::steady_clock::now();
+
+  // Number of Left Workers and Right Workers (in each worker process)
+  const size_t Lw = std::stol(argv[3]);
+  const size_t Rw = std::stol(argv[4]);
+  blockPool.init(compressBound(BIGFILE_LOW_THRESHOLD), std::max<size_t>(64, 4 * (Lw + Rw)));
+  taskPool.init(4096);
+  const char *processesOption = getOption(argv + 5, argv + argc, "-n");
+  const char *endpointOption = getOption(argv + 5, argv + argc, "-l");
+  const char *batchOption = getOption(argv + 5, argv + argc, "-b");
+  const int numberOfProcesses = processesOption ? std::stoi(processesOption) : 2;
+  const int batchSize = std::clamp(batchOption ? std::stoi(batchOption) : DEFAULT_BATCH, 1, MAX_BATCH);
+  if (Lw < 1 || Rw < 1 || numberOfProcesses < 1)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+
+  // Without an endpoint the workers are forked here and connect through a Unix socket
+  const bool localWorkers = endpointOption == nullptr;
+  ff_endpoint ep = localWorkers ? ff_endpoint("/tmp/dff_minizip." + std::to_string(getpid()), -1) : parseEndpoint(endpointOption);
+  int listenFd = listenOn(ep);
+  if (listenFd < 0)
+    return -1;
+  std::vector<pid_t> children;
+  if (localWorkers)
+  {
+    for (int p = 0; p < numberOfProcesses; ++p)
+    {
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        close(listenFd);
+        _exit(runWorkerProcess(ep, Rw) ? 0 : 1);
+      }
+      children.push_back(pid);
+    }
+  }
+  std::vector<int> connections;
+  std::vector<size_t> windows;
+  for (int p = 0; p < numberOfProcesses; ++p)
+  {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0)
+    {
+      perror("accept");
+      return -1;
+    }
+    setNoDelay(fd, ep);
+    int setup[2] = {(int)htonl(compressing), (int)htonl(batchSize)};
+    int workers;
+    if (writen(fd, (char *)setup, sizeof(setup)) != sizeof(setup) || readn(fd, (char *)&workers, sizeof(int)) != sizeof(int))
+    {
+      std::fprintf(stderr, "Error connecting to a worker process\n");
+      return -1;
+    }
+    connections.push_back(fd);
+    // Enough blocks to keep busy the farm of the worker, and at least a batch of results
+    windows.push_back(std::max<size_t>(2 * batchSize, 2 * ntohl(workers)));
+  }
+  close(listenFd);
+  if (localWorkers)
+    unlink(ep.address.c_str());
+
+  struct stat statbuf;
+  if (stat(argv[2], &statbuf) == -1)
+  {
+    perror("stat");
+    fprintf(stderr, "Error: stat %s\n", argv[2]);
+    return -1;
+  }
+
+  // Walks in the directory and add the filenames in the FileVector
+  if (S_ISDIR(statbuf.st_mode))
+  {
+    success &= walkDirff(argv[2], compressing, FilesVector);
+  }
+  else
+  {
+    success &= addFileToVector(argv[2], statbuf.st_size, compressing, FilesVector);
+  }
+
+  // Vector of atomic int used to count the blocks received by each Left worker
+  std::vector<std::atomic<int>> vectorOfCounters(FilesVector.size());
+
+  std::vector<ff_node *> LW;
+  std::vector<ff_node *> RW;
+  size_t numberTasks = FilesVector.size() / Lw;
+  size_t overflowTasks = FilesVector.size() % Lw;
+  for (size_t i = 0; i < Lw; ++i)
+  {
+    size_t tasks = numberTasks + (i < overflowTasks ? 1 : 0);
+    LW.push_back(new ff::ff_comb(new MultiInputHelperNode, new L_Worker(vectorOfCounters, i, tasks, Lw), true, true));
+  }
+  for (int p = 0; p < numberOfProcesses; ++p)
+    RW.push_back(new ff::ff_comb(new MultiInputHelperNode, new RemoteWorker(connections[p], windows[p], batchSize), true, true));
+
+  // Adding Lworkers and the worker processes to a2a
+  ff_a2a a2a;
+  a2a.add_firstset(LW, 0, true);
+  a2a.add_secondset(RW, true);
+  a2a.wrap_around();
+
+  if (a2a.run_and_wait_end() < 0)
+  {
+    error("running a2a\n");
+    return -1;
+  }
+  for (int fd : connections)
+    close(fd);
+  for (pid_t pid : children)
+  {
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      success = false;
+  }
+
+  if (!success)
+  {
+    printf("Exiting with (some) Error(s)\n");
+    return -1;
+  }
+  const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  std::cout << "Time DFF: " << duration.count() << " milliseconds" << std::endl;
+  return 0;
+}
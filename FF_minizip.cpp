@@ -3,10 +3,19 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <filesystem>
+#include <map>
+#include <memory>
 #include <ff/ff.hpp>
 #include <ff/all2all.hpp>
 using namespace ff;
 #include <utility.hpp>
+#include <pinning.hpp>
+#include <blockpool.hpp>
+#include <trace.hpp>
+#include <perfcounters.hpp>
+#include <telemetry.hpp>
+#include <memstats.hpp>
 
 struct FileStruct
 {
@@ -15,12 +24,35 @@ struct FileStruct
   // In this array the pointer of the blocks are stored
   size_t *sizeOfBlocks;
   unsigned char **arrayOfPointers;
+  // Where the blocks start in the uncompressed file, the last one is its size. Empty when
+  // compressing without --cdc, the blocks are then BIGFILE_LOW_THRESHOLD bytes.
+  std::vector<size_t> offsets;
+  // The mapped file. With --dedup the inputs stay mapped until the end of the run, the blocks
+  // of the other files are compared with their blocks.
+  unsigned char *data = nullptr;
+  // Decompressing: the references to the same file as (block, copy of it) sorted by block, the
+  // mapped .miniz of the references to other files and the hashes of their blocks
+  std::vector<std::pair<size_t, size_t>> copies;
+  std::vector<std::pair<unsigned char *, size_t>> sources;
+  DedupSources dedupSources;
+  // A block could not be (de)compressed: the writer does not write the file. Set by the writer
+  // that gets the failed block, before it counts it.
+  bool failed = false;
+  // -i: the content hash of each block, the writer combines them when the file is written
+  std::vector<uint64_t> hashes;
 };
 
 // ------------ GLOBAL VARIBLES ---------------
 std::vector<FileStruct> FilesVector;
 bool compressing = false;
 bool success = true;
+// Buffers of the compressed blocks: with --numa one pool per NUMA node, so that a buffer freed by
+// an L_Worker is taken again by an R_Worker of the same node (they send blocks to each other only)
+std::vector<std::unique_ptr<BlockPool>> blockPools;
+bool dedup = false;   // --dedup: blocks equal to a block already seen are not compressed
+DedupTable dedupTable;
+const Chunker *chunker = nullptr; // --cdc: the blocks are cut where the content says so
+Manifest *incrementalManifest = nullptr; // -i: the writers confirm in it the files written
 // ------------ END GLOBAL VARIBLES ---------------
 
 static inline bool addFileToVector(const char fname[], size_t size, const bool comp, std::vector<FileStruct> &FilesVector)
@@ -35,88 +67,99 @@ static inline bool addFileToVector(const char fname[], size_t size, const bool c
   return true;
 }
 
-static inline bool walkDirff(const char dname[], const bool comp, std::vector<FileStruct> &FilesVector)
+// With a manifest (incremental compression) the files that have not changed since the
+// previous run are skipped
+static inline bool walkDirff(const char dname[], const bool comp, std::vector<FileStruct> &FilesVector,
+                             Manifest *manifest = nullptr)
 {
-  if (chdir(dname) == -1)
-  {
-    if (QUITE_MODE >= 1)
-    {
-      perror("chdir");
-      std::fprintf(stderr, "Error: chdir %s\n", dname);
-    }
-    return false;
-  }
-  DIR *dir;
-  if ((dir = opendir(".")) == NULL)
+  return walkFiles(dname, comp, [comp, &FilesVector](const std::string &name, const char *, const struct stat &statbuf)
+                   { return addFileToVector(name.c_str(), statbuf.st_size, comp, FilesVector); }, manifest);
+}
+
+// Where the block j of the file starts and its size
+static inline size_t blockBegin(const FileStruct &file, size_t j)
+{
+  return file.offsets.empty() ? j * BIGFILE_LOW_THRESHOLD : file.offsets[j];
+}
+static inline size_t blockLength(const FileStruct &file, size_t j)
+{
+  if (file.offsets.empty())
+    return std::min(BIGFILE_LOW_THRESHOLD, file.size - std::min(file.size, j * BIGFILE_LOW_THRESHOLD));
+  return file.offsets[j + 1] - file.offsets[j];
+}
+
+// -i: the content hash of the file, from the hashes of its blocks
+static inline uint64_t contentHashOf(const FileStruct &file)
+{
+  uint64_t hash = CONTENT_HASH_INIT;
+  for (size_t j = 0; j < file.hashes.size(); ++j)
+    hash = contentHashCombine(hash, file.hashes[j], blockLength(file, j));
+  return hash;
+}
+
+// Unmaps the input of a file when its blocks are no longer needed
+static inline void releaseInput(FileStruct &file, size_t idFile)
+{
+  std::vector<size_t>().swap(file.offsets);
+  if (file.data != nullptr)
   {
-    if (QUITE_MODE >= 1)
-    {
-      perror("opendir");
-      std::fprintf(stderr, "Error: opendir %s\n", dname);
-    }
-    return false;
+    unmapFile(file.data, file.size);
+    memoryFile(idFile, -(int64_t)file.size, true);
   }
-  struct dirent *file;
-  bool error = false;
-  while ((errno = 0, file = readdir(dir)) != NULL)
-  {
-    struct stat statbuf;
-    if (stat(file->d_name, &statbuf) == -1)
-    {
-      if (QUITE_MODE >= 1)
-      {
-        perror("stat");
-        std::fprintf(stderr, "Error: stat %s\n", file->d_name);
-      }
-      return false;
-    }
-    if (S_ISDIR(statbuf.st_mode))
-    {
-      if (!isdot(file->d_name))
-      {
-        if (walkDirff(file->d_name, comp, FilesVector))
-        {
-          if (!chdir(".."))
-          {
-            perror("chdir");
-            std::fprintf(stderr, "Error: chdir ..\n");
-            error = true;
-          }
-        }
-        else
-          error = true;
-      }
-    }
-    else
+  file.data = nullptr;
+}
+
+// Unmaps the other .miniz that the references of a file refer to
+static inline void releaseSources(FileStruct &file, size_t idFile)
+{
+  for (auto &source : file.sources)
+    if (source.first != nullptr)
     {
-      if (!addFileToVector(file->d_name, statbuf.st_size, comp, FilesVector))
-        error = true;
+      unmapFile(source.first, source.second);
+      memoryFile(idFile, -(int64_t)source.second, true);
     }
-  }
-  if (errno != 0)
-  {
-    if (QUITE_MODE >= 1)
-      perror("readdir");
-    error = true;
-  }
-  closedir(dir);
-  return !error;
+  std::vector<std::pair<unsigned char *, size_t>>().swap(file.sources);
+  std::vector<std::pair<size_t, size_t>>().swap(file.copies);
+  file.dedupSources = DedupSources();
 }
 
 static inline void usage(const char *argv0)
 {
   printf("--------------------\n");
-  printf("Usage: %s c|d|C|D file-or-directory L-Workers R-Workers  \n", argv0);
+  printf("Usage: %s c|d|C|D file-or-directory L-Workers|auto R-Workers|auto [--pin|--numa] [--ondemand N] [--blocking [--spin N]] [-i] [--dedup] [--cdc [MIN:AVG:MAX]] [--trace FILE] [--counters]\n"
+         "       [--progress [SECONDS]] [--metrics FILE|unix:PATH] [--memory [MS]]\n", argv0);
   printf("\nModes:\n");
   printf("c - Compresses file infile to a zlib stream into outfile\n");
   printf("d - Decompress a zlib stream from infile into outfile\n");
+  printf("\nauto - The number of workers is chosen from the CPUs available and a calibration on the input\n");
+  printf("\nOptions:\n");
+  printf("--pin  - Pins the workers on their own CPU, spread over the sockets\n");
+  printf("--numa - Pins the workers per NUMA node, the blocks go to the R-Workers of the node of the L-Worker\n");
+  printf("         (FF_MAPPING_STRING in the environment restricts the CPUs used)\n");
+  printf("--ondemand N - Each R-Worker has at most N blocks waiting, the others go to the free ones (default 1,\n");
+  printf("               0 distributes the blocks round-robin)\n");
+  printf("--blocking   - Idle workers sleep on their queues instead of polling them\n");
+  printf("--spin N     - With --blocking, polls of an empty queue before sleeping (default 1000)\n");
+  printf("-i           - Incremental: compresses only the files of the directory changed since the previous run\n");
+  printf("               (listed in %s in the directory)\n", MANIFEST_NAME);
+  printf("--dedup      - A block equal to a block already seen, in any file, is stored as a reference to it:\n");
+  printf("               the .miniz needs the .miniz it refers to (with -i, only to the blocks of the same file)\n");
+  printf("--cdc        - The blocks end where the content says so (sizes in KiB, default %zu:%zu:%zu), so the\n",
+         BIGFILE_LOW_THRESHOLD / 4096, BIGFILE_LOW_THRESHOLD / 2048, BIGFILE_LOW_THRESHOLD / 1024);
+  printf("               blocks after an insertion are still equal for --dedup\n");
+  printf("--trace FILE - Writes in FILE a Chrome trace of the work of each thread (chrome://tracing, ui.perfetto.dev)\n");
+  printf("--counters   - Prints the hardware counters (perf_event_open) of each stage: split, compress, decompress, write\n");
+  printf("--progress   - Prints on stderr the bytes done by each stage and the rates every SECONDS (default 2)\n");
+  printf("--metrics    - Writes the same in the Prometheus text format in FILE, or to the clients of a Unix socket\n");
+  printf("--memory     - Prints the peak memory of the process, of each stage and of the files (resident memory\n");
+  printf("               sampled every MS milliseconds, default 10), only in FF_minizip_memstats (make memstats)\n");
   printf("--------------------\n");
 }
 
+// Descriptor of a block, the name of the file is in FilesVector[idFile].
+// Recycled through taskPool, so it must stay trivially copyable.
 struct Task_t
 {
-  Task_t(const std::string &name) : filename(name) {}
-
   unsigned char *ptr;              // input pointer
   size_t size;                     // input size
   unsigned char *ptrOut = nullptr; // output pointer
@@ -126,12 +169,15 @@ struct Task_t
   size_t idFile = 0;               // Id of the file in the FileVector
   size_t readBytes = 0;            // Used in the decompression to understand where each worker has to start
   size_t uncompreFileSize = 0;     // Size of the uncompressed file
-  const std::string filename;      // source file name
+  const Hash128 *check = nullptr;  // The block is in another .miniz: hash of its data
+  bool failed = false;             // The R_Worker could not (de)compress the block
+  uint64_t hash = 0;               // -i: content hash of the block
 };
+TaskPool<Task_t> taskPool;
 
 static inline void printTask(Task_t *in)
 {
-  std::cout << "Filename: " << in->filename << std::endl;
+  std::cout << "Filename: " << FilesVector[in->idFile].filename << std::endl;
   // std::cout << "Input Pointer: " << static_cast<void*>(in->ptr) << std::endl;
   // std::cout << "Output Pointer: " << static_cast<void*>(in->ptrOut) << std::endl;
   std::cout << "Size: " << in->size << std::endl;
@@ -146,22 +192,56 @@ static inline void printTask(Task_t *in)
 
 static inline bool writeToDisk(Task_t *in, std::vector<std::atomic<int>> &vectorOfCounters)
 {
+  TraceSpan span("write", in->size);
+  StageCounters counters(STAGE_WRITE, in->size);
   size_t idFile = in->idFile;
   size_t sizeOfT = sizeof(size_t);
   size_t nBlocks = in->nblocks;
+  // with --cdc the sizes of the blocks follow the sizes of the compressed blocks
+  const bool chunked = !FilesVector[idFile].offsets.empty();
+  size_t nblocksField = chunked ? nBlocks | CHUNKED_BLOCKS : nBlocks;
+  size_t headerSize = headerBytes(nblocksField);
+
+  // The R_Workers write a reference to another file as its index in FilesVector + 1, in the
+  // .miniz it is the index of the name of the other .miniz in the sources of the file
+  FileStruct &file = FilesVector[idFile];
+  DedupSources sources;
+  std::map<size_t, size_t> sourceOf;
+  for (size_t i = 0; i < nBlocks; ++i)
+  {
+    size_t &entry = file.sizeOfBlocks[i];
+    if (!isDedupRef(entry) || dedupSource(entry) == 0)
+      continue;
+    const size_t other = dedupSource(entry) - 1;
+    auto it = sourceOf.find(other);
+    if (it == sourceOf.end())
+    {
+      const std::filesystem::path dir = std::filesystem::path(file.filename).parent_path();
+      const std::filesystem::path name = std::filesystem::path(FilesVector[other].filename + SUFFIX);
+      sources.names.push_back(name.lexically_relative(dir.empty() ? "." : dir).string());
+      it = sourceOf.emplace(other, sources.names.size()).first;
+    }
+    entry = dedupRef(it->second, dedupTarget(entry));
+    sources.checks.push_back(hash128(file.data + blockBegin(file, i), blockLength(file, i)));
+  }
 
   // Creation of the header
-  unsigned char *ptrHeader = new unsigned char[sizeOfT * (in->nblocks + 2)];
+  unsigned char *ptrHeader = new unsigned char[headerSize];
   // size of file
   memcpy(ptrHeader, &in->size, sizeof(size_t));
   // number of blocks
-  memcpy(ptrHeader + sizeOfT, &nBlocks, sizeof(size_t));
+  memcpy(ptrHeader + sizeOfT, &nblocksField, sizeof(size_t));
   for (size_t i = 0; i < nBlocks; ++i)
   {
     memcpy(ptrHeader + sizeOfT * (i + 2), &FilesVector[idFile].sizeOfBlocks[i], sizeof(size_t));
+    if (chunked)
+    {
+      size_t length = blockLength(FilesVector[idFile], i);
+      memcpy(ptrHeader + sizeOfT * (nBlocks + i + 2), &length, sizeof(size_t));
+    }
   }
 
-  std::string outfilename = std::string(in->filename) + SUFFIX;
+  std::string outfilename = FilesVector[idFile].filename + SUFFIX;
   FILE *pOutfile = fopen(outfilename.c_str(), "wb");
   if (!pOutfile)
   {
@@ -169,21 +249,30 @@ static inline bool writeToDisk(Task_t *in, std::vector<std::atomic<int>> &vector
     {
       perror("fopen");
       std::fprintf(stderr, "Failed opening output file %s!\n", outfilename.c_str());
-      return false;
     }
+    delete [] ptrHeader;
+    return false;
   }
   // Write header
-  if (fwrite(ptrHeader, 1, sizeOfT * (nBlocks + 2), pOutfile) != sizeOfT * (nBlocks + 2))
+  const bool headerWritten = fwrite(ptrHeader, 1, headerSize, pOutfile) == headerSize;
+  delete [] ptrHeader;
+  if (!headerWritten)
   {
     if (QUITE_MODE >= 1)
     {
       perror("fwrite");
       std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
     }
+    fclose(pOutfile);
     return false;
   }
+  size_t written = headerSize;
   for (size_t i = 0; i < nBlocks; ++i)
   {
+    // a deduplicated block has no data
+    if (isDedupRef(FilesVector[idFile].sizeOfBlocks[i]))
+      continue;
+    written += FilesVector[idFile].sizeOfBlocks[i];
     if (fwrite(FilesVector[idFile].arrayOfPointers[i], 1, FilesVector[idFile].sizeOfBlocks[i], pOutfile) != FilesVector[idFile].sizeOfBlocks[i])
     {
       if (QUITE_MODE >= 1)
@@ -191,11 +280,28 @@ static inline bool writeToDisk(Task_t *in, std::vector<std::atomic<int>> &vector
         perror("fwrite");
         std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
       }
+      fclose(pOutfile);
+      return false;
+    }
+  }
+  if (!sources.names.empty())
+  {
+    const std::vector<unsigned char> trailer = dedupTrailer(sources);
+    written += trailer.size();
+    if (fwrite(trailer.data(), 1, trailer.size(), pOutfile) != trailer.size())
+    {
+      if (QUITE_MODE >= 1)
+      {
+        perror("fwrite");
+        std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
+      }
+      fclose(pOutfile);
       return false;
     }
   }
   if (fclose(pOutfile) != 0)
     return false;
+  telemetryAdd(STAGE_WRITE, in->size, written, 0);
   return true;
 }
 struct MultiInputHelperNode : ff::ff_minode_t<Task_t>
@@ -211,12 +317,40 @@ struct L_Worker : ff_monode_t<Task_t>
   L_Worker(std::vector<std::atomic<int>> &vectorOfCounters, size_t id, size_t numberOfTasks, size_t NumberOfLWorkers)
       : vectorOfCounters(vectorOfCounters), id(id), numberOfTasks(numberOfTasks), NumberOfLWorkers(NumberOfLWorkers) {}
 
+  int svc_init()
+  {
+    pinThread(cpu);
+    traceThread("L_Worker " + std::to_string(id));
+    countersThread();
+    return 0;
+  }
+
+  // With --numa the blocks go only to the R_Workers on the same NUMA node, that read the
+  // input first and allocate the output on their node. On demand, the block goes to the first
+  // of them with a free slot, or waits for the next one if they are all busy.
+  void sendBlock(Task_t *t)
+  {
+    TraceSpan span("send", t->cmp_size);
+    telemetryAdd(STAGE_SPLIT, t->cmp_size, 0);
+    if (localWorkers.empty())
+    {
+      ff_send_out(t);
+      return;
+    }
+    if (ondemand)
+      for (size_t k = 0; k < localWorkers.size(); ++k)
+        if (ff_send_out_to(t, localWorkers[nextWorker++ % localWorkers.size()], 1))
+          return;
+    ff_send_out_to(t, localWorkers[nextWorker++ % localWorkers.size()]);
+  }
+
   Task_t *svc(Task_t *in)
   {
     // IF THE INPUT IS NULL WE ARE AT THE BEGINNING AND
     // WE ARE JUST SPLITTING THE WORK BETWEEN THE WORKERS
     if (in == nullptr)
     {
+      MemoryStage stage(STAGE_SPLIT);
       // Based on the Id (The id is given at the creation of the node)
       // the files are divided for each worker
       if (compressing) //***********COMPRESSING********
@@ -230,48 +364,51 @@ struct L_Worker : ff_monode_t<Task_t>
           size_t sizeOfT = sizeof(size_t);
 
           unsigned char *ptr = nullptr;
-          if (!mapFile(infilename.c_str(), infile_size, ptr))
+          bool mapped;
+          {
+            TraceSpan span("map", infile_size);
+            StageCounters counters(STAGE_SPLIT, infile_size);
+            mapped = mapFile(infilename.c_str(), infile_size, ptr);
+          }
+          if (!mapped)
           {
             std::fprintf(stderr, "Failed to mapFile\n");
             success = false;
             continue;
           }
+          memoryFile(idFile, infile_size, true);
 
-          const size_t fullblocks = infile_size / BIGFILE_LOW_THRESHOLD;
-          const size_t partialblock = infile_size % BIGFILE_LOW_THRESHOLD;
-          size_t numberOfBlocks = fullblocks;
-
-          if (partialblock)
-            numberOfBlocks++;
+          // With --cdc the whole file is cut before sending the first block, the number of
+          // blocks must be known by the tasks
+          FileStruct &file = FilesVector[idFile];
+          file.data = ptr;
+          size_t numberOfBlocks = (infile_size + BIGFILE_LOW_THRESHOLD - 1) / BIGFILE_LOW_THRESHOLD;
+          if (chunker != nullptr)
+          {
+            TraceSpan span("split", infile_size);
+            StageCounters counters(STAGE_SPLIT, 0);
+            chunker->split(ptr, infile_size, file.offsets);
+            numberOfBlocks = file.offsets.size() - 1;
+          }
 
           //This two arrays are used to store the pointers of the compressed data and the size of each block
           FilesVector[idFile].arrayOfPointers = new unsigned char *[numberOfBlocks];
           FilesVector[idFile].sizeOfBlocks = new size_t[numberOfBlocks];
+          if (incrementalManifest != nullptr)
+            file.hashes.assign(numberOfBlocks, 0);
           
           //Sending task to the workers
-          for (size_t j = 0; j < fullblocks; ++j)
+          for (size_t j = 0; j < numberOfBlocks; ++j)
           {
-            Task_t *t = new Task_t(infilename);
+            Task_t *t = taskPool.get();
             t->blockid = j;
             t->idFile = idFile;
             t->nblocks = numberOfBlocks;
             t->ptr = ptr;
-            t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * j;
+            t->ptrOut = ptr + blockBegin(file, j);
             t->size = infile_size;
-            t->cmp_size = BIGFILE_LOW_THRESHOLD;
-            ff_send_out(t);
-          }
-          if (partialblock)
-          {
-            Task_t *t = new Task_t(infilename);
-            t->blockid = fullblocks;
-            t->idFile = idFile;
-            t->nblocks = numberOfBlocks;
-            t->ptr = ptr;
-            t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * fullblocks;
-            t->size = infile_size;
-            t->cmp_size = partialblock;
-            ff_send_out(t);
+            t->cmp_size = blockLength(file, j);
+            sendBlock(t);
           }
         }
       }
@@ -286,12 +423,19 @@ struct L_Worker : ff_monode_t<Task_t>
           size_t sizeOfT = sizeof(size_t);
 
           unsigned char *ptr = nullptr;
-          if (!mapFile(infilename.c_str(), infile_size, ptr))
+          bool mapped;
+          {
+            TraceSpan span("map", infile_size);
+            StageCounters counters(STAGE_SPLIT, infile_size);
+            mapped = mapFile(infilename.c_str(), infile_size, ptr);
+          }
+          if (!mapped)
           {
             std::fprintf(stderr, "Failed to mapFile\n");
             success = false;
             continue;
           }
+          memoryFile(idFile, infile_size, true);
 
           // Size of the uncompressed file
           size_t uncompressedFileSize;
@@ -301,45 +445,135 @@ struct L_Worker : ff_monode_t<Task_t>
           size_t numberOfBlocks;
           memcpy(&numberOfBlocks, ptr + sizeOfT, sizeof(size_t));
 
+          // Where each block goes in the uncompressed file (the blocks can have different sizes)
+          bool validHeader;
+          {
+            StageCounters counters(STAGE_SPLIT, 0);
+            validHeader = blockOffsets(ptr, infile_size, BIGFILE_LOW_THRESHOLD, FilesVector[idFile].offsets);
+          }
+          if (!validHeader)
+          {
+            std::fprintf(stderr, "Invalid header in %s\n", infilename.c_str());
+            success = false;
+            unmapFile(ptr, infile_size);
+            memoryFile(idFile, -(int64_t)infile_size, true);
+            continue;
+          }
+          size_t headerSize = headerBytes(numberOfBlocks);
+          numberOfBlocks = blockCount(numberOfBlocks);
 
           //In this vectore the length of each block is stored
-          size_t *vectorOfSizes = new size_t[numberOfBlocks*sizeOfT];
-          for (size_t j = 0; j < numberOfBlocks; ++j)
+          std::vector<size_t> vectorOfSizes(numberOfBlocks);
+          memcpy(vectorOfSizes.data(), ptr + sizeOfT * 2, sizeOfT * numberOfBlocks);
+          FileStruct &file = FilesVector[idFile];
+          file.data = ptr;
+
+          // The references to the same file are copied by the R_Worker of the block they refer
+          // to, the ones to other files are decompressed from the other .miniz by an R_Worker
+          struct SourceBlock
           {
-            memcpy(&vectorOfSizes[j], ptr + sizeOfT * (j + 2), sizeof(size_t));
+            size_t block, source, begin, cmpSize;
+          };
+          std::vector<SourceBlock> sourceBlocks;
+          bool validRefs = readDedupSources(ptr, infile_size, file.dedupSources);
+          if (validRefs)
+            file.sources.assign(file.dedupSources.names.size(), {nullptr, 0});
+          for (size_t j = 0; j < numberOfBlocks && validRefs; ++j)
+          {
+            if (!isDedupRef(vectorOfSizes[j]))
+              continue;
+            const size_t target = dedupTarget(vectorOfSizes[j]), k = dedupSource(vectorOfSizes[j]);
+            const size_t length = file.offsets[j + 1] - file.offsets[j];
+            if (k == 0)
+            {
+              validRefs = target < numberOfBlocks && !isDedupRef(vectorOfSizes[target]) &&
+                          file.offsets[target + 1] - file.offsets[target] == length;
+              file.copies.emplace_back(target, j);
+              continue;
+            }
+            std::pair<unsigned char *, size_t> &source = file.sources[k - 1];
+            if (source.first == nullptr)
+            {
+              const std::string sourceName = sourcePath(infilename, file.dedupSources.names[k - 1]);
+              if (!mapFile(sourceName.c_str(), source.second, source.first))
+              {
+                std::fprintf(stderr, "%s refers to %s that cannot be read\n", infilename.c_str(), sourceName.c_str());
+                validRefs = false;
+                break;
+              }
+              memoryFile(idFile, source.second, true);
+            }
+            SourceBlock b = {j, k - 1, 0, 0};
+            size_t sourceLength;
+            validRefs = sourceBlock(source.first, source.second, BIGFILE_LOW_THRESHOLD, target, b.begin, b.cmpSize, sourceLength) &&
+                        sourceLength == length;
+            sourceBlocks.push_back(b);
+          }
+          if (!validRefs)
+          {
+            std::fprintf(stderr, "Invalid block reference in %s\n", infilename.c_str());
+            success = false;
+            releaseSources(file, idFile);
+            releaseInput(file, idFile);
+            continue;
           }
+          std::sort(file.copies.begin(), file.copies.end());
 
           //creation of an array with length of the uncompressed file bytes
           unsigned char *ptrOut = new unsigned char[uncompressedFileSize];
+          memoryFile(idFile, uncompressedFileSize);
 
-          size_t headerSize = sizeOfT * (numberOfBlocks + 2);
+          // every block that is not a reference to the same file is a task
+          const size_t tasks = numberOfBlocks - file.copies.size();
           size_t bytesRead = headerSize;
-          //Send to workers
           for (size_t j = 0; j < numberOfBlocks; ++j)
           {
-            Task_t *t = new Task_t(infilename);
+            if (isDedupRef(vectorOfSizes[j]))
+              continue;
+            Task_t *t = taskPool.get();
             t->blockid = j;
             t->idFile = idFile;
-            t->nblocks = numberOfBlocks;
+            t->nblocks = tasks;
             t->ptr = ptr;
             t->ptrOut = ptrOut;
             t->uncompreFileSize = uncompressedFileSize;
             t->size = infile_size;
             t->readBytes = bytesRead;
-            memcpy(&t->cmp_size, &vectorOfSizes[j], sizeof(size_t));
+            t->cmp_size = vectorOfSizes[j];
             bytesRead = bytesRead + t->cmp_size;
-            ff_send_out(t);
+            sendBlock(t);
+          }
+          for (size_t c = 0; c < sourceBlocks.size(); ++c)
+          {
+            Task_t *t = taskPool.get();
+            t->blockid = sourceBlocks[c].block;
+            t->idFile = idFile;
+            t->nblocks = tasks;
+            t->ptr = file.sources[sourceBlocks[c].source].first;
+            t->ptrOut = ptrOut;
+            t->uncompreFileSize = uncompressedFileSize;
+            t->size = infile_size;
+            t->readBytes = sourceBlocks[c].begin;
+            t->cmp_size = sourceBlocks[c].cmpSize;
+            t->check = &file.dedupSources.checks[c];
+            sendBlock(t);
           }
-          delete [] vectorOfSizes;
         }
       }
       return EOS;
     }
     else //HERE WE WRITE IN THE FILE
     {
+      MemoryStage stage(STAGE_WRITE);
+      // a block back from the R_Workers
+      telemetryAdd(STAGE_WRITE, 0, 0);
       if (compressing)
       {
         size_t idFile = in->idFile;
+        if (in->failed)
+          FilesVector[idFile].failed = true;
+        else if (!FilesVector[idFile].hashes.empty())
+          FilesVector[idFile].hashes[in->blockid] = in->hash;
         // Add the compressed block of memory to the array of pointers
         FilesVector[idFile].arrayOfPointers[in->blockid] = in->ptrOut;
         FilesVector[idFile].sizeOfBlocks[in->blockid] = in->cmp_size;
@@ -348,32 +582,48 @@ struct L_Worker : ff_monode_t<Task_t>
 
         if (val >= in->nblocks - 1)
         {
-
-          if (!writeToDisk(in, vectorOfCounters))
+          // a failed file is not written, its memory is released all the same
+          bool written = !FilesVector[idFile].failed;
+          if (written && !writeToDisk(in, vectorOfCounters))
           {
             std::fprintf(stderr, "Problems in the writing of the file.\n");
             success = false;
-            return GO_ON;
+            written = false;
           }
-          // Cleaning memory
+          // -i: the file goes in the manifest only now that its .miniz is written and closed
+          if (written && incrementalManifest != nullptr)
+            incrementalManifest->done(FilesVector[idFile].filename, contentHashOf(FilesVector[idFile]));
+          // Cleaning memory, the blocks go back to the pool
           for (size_t i = 0; i < in->nblocks; ++i)
           {
-            delete FilesVector[idFile].arrayOfPointers[i];
+            if (FilesVector[idFile].arrayOfPointers[i] != nullptr)
+              memoryFile(idFile, -(int64_t)blockPool->size());
+            blockPool->put(FilesVector[idFile].arrayOfPointers[i]);
           }
           delete [] FilesVector[idFile].arrayOfPointers;
           delete [] FilesVector[idFile].sizeOfBlocks;
-          unmapFile(in->ptr, in->size);
-          delete in;
+          // with --dedup the blocks of the file can still be compared with the others
+          if (!dedup)
+            releaseInput(FilesVector[idFile], idFile);
         }
       }
       else
       {
         size_t idFile = in->idFile;
+        if (in->failed)
+          FilesVector[idFile].failed = true;
         // Using an atomic to check when all the blocks have been decompressed
         int val = vectorOfCounters[idFile].fetch_add(1);
-        if (val >= in->nblocks - 1)
+        if (val >= in->nblocks - 1 && FilesVector[idFile].failed)
+        {
+          releaseSources(FilesVector[idFile], idFile);
+          releaseInput(FilesVector[idFile], idFile);
+          delete [] in->ptrOut;
+          memoryFile(idFile, -(int64_t)in->uncompreFileSize);
+        }
+        else if (val >= in->nblocks - 1)
         {
-          const std::string infilename(in->filename);
+          const std::string &infilename = FilesVector[idFile].filename;
           std::string outfilename = infilename.substr(0, infilename.size() - 6);
 
           // if the file exist in the directory it will add 1,2,3..
@@ -391,12 +641,20 @@ struct L_Worker : ff_monode_t<Task_t>
           }
           outfilename = tempFileName;
 
-          bool success = writeFile(outfilename,in->ptrOut, in->uncompreFileSize);
-          unmapFile(in->ptr, in->size);
+          // the references have been resolved by the R_Workers
+          TraceSpan span("write", in->uncompreFileSize);
+          StageCounters counters(STAGE_WRITE, in->uncompreFileSize);
+          if (!writeFile(outfilename,in->ptrOut, in->uncompreFileSize))
+            success = false;
+          else
+            telemetryAdd(STAGE_WRITE, in->size, in->uncompreFileSize, 0);
+          releaseSources(FilesVector[idFile], idFile);
+          releaseInput(FilesVector[idFile], idFile);
           delete [] in->ptrOut;
-          delete in;
+          memoryFile(idFile, -(int64_t)in->uncompreFileSize);
         }
       }
+      taskPool.put(in);
       return GO_ON;
     }
   }
@@ -404,27 +662,73 @@ struct L_Worker : ff_monode_t<Task_t>
   size_t id;
   size_t numberOfTasks;
   size_t NumberOfLWorkers;
+  int cpu = -1;                  // --pin/--numa: CPU of the thread
+  std::vector<int> localWorkers; // --numa: R_Workers on the same NUMA node
+  BlockPool *blockPool = nullptr; // where the buffers of the written blocks go back
+  size_t nextWorker = 0;
+  bool ondemand = false;         // the R_Workers get the blocks on demand
 };
 struct R_Worker : ff_monode_t<Task_t>
 { // must be multi-input
-  R_Worker(const size_t Lw) : Lw(Lw) {}
+  R_Worker(const size_t Lw, size_t id) : Lw(Lw), id(id) {}
+
+  int svc_init()
+  {
+    pinThread(cpu);
+    traceThread("R_Worker " + std::to_string(id));
+    countersThread();
+    return 0;
+  }
+
   Task_t *svc(Task_t *in)
   {
+    MemoryStage stage(compressing ? STAGE_COMPRESS : STAGE_DECOMPRESS);
     if (compressing) //***********COMPRESSING********
     {
-      //Creation of an array of char to store the compressed block
+      StageCounters counters(STAGE_COMPRESS, in->cmp_size);
+      // -i: the hash of what is compressed, for the manifest
+      if (incrementalManifest != nullptr)
+        in->hash = contentHashBlock(in->ptrOut, in->cmp_size);
+      // A block equal to one already seen, in this file or in another one, is sent as a
+      // reference to it (to another file as its index + 1, see writeToDisk). The hash only finds
+      // the candidate, the blocks are compared so a collision is not a problem.
+      if (dedup)
+      {
+        TraceSpan span("dedup", in->cmp_size);
+        DedupBlock first = dedupTable.insert(hash128(in->ptrOut, in->cmp_size), {in->idFile, in->blockid});
+        if (first.file != in->idFile || first.block != in->blockid)
+        {
+          const FileStruct &file = FilesVector[first.file];
+          const unsigned char *other = file.data + blockBegin(file, first.block);
+          if (blockLength(file, first.block) == in->cmp_size &&
+              memcmp(other, in->ptrOut, in->cmp_size) == 0)
+          {
+            telemetryAdd(STAGE_COMPRESS, in->cmp_size, 0);
+            in->cmp_size = dedupRef(first.file == in->idFile ? 0 : first.file + 1, first.block);
+            in->ptrOut = nullptr;
+            ff_send_out(in);
+            return GO_ON;
+          }
+        }
+      }
+      //The compressed block goes in a buffer of the pool
+      TraceSpan span("compress", in->cmp_size);
       size_t estimation = compressBound(in->cmp_size);
-      unsigned char *ptrCompress = new unsigned char[estimation];
+      unsigned char *ptrCompress = blockPool->get();
       if (compress((ptrCompress), &estimation, in->ptrOut, in->cmp_size) != Z_OK)
       {
         if (QUITE_MODE >= 1)
           std::fprintf(stderr, "Failed to compress file in memory\n");
         success = false;
-        //Cleaning memory
-        unmapFile(in->ptr, in->size);
-        delete[] in->ptrOut;
+        // The input is released by the writer, when all the blocks of the file are back
+        blockPool->put(ptrCompress);
+        in->failed = true;
+        in->ptrOut = nullptr;
+        ff_send_out(in);
         return GO_ON;
       }
+      telemetryAdd(STAGE_COMPRESS, in->cmp_size, estimation);
+      memoryFile(in->idFile, blockPool->size());
       in->cmp_size = estimation;
       in->ptrOut = ptrCompress;
       ff_send_out(in);
@@ -432,21 +736,192 @@ struct R_Worker : ff_monode_t<Task_t>
     else //***********DECOMPRESSING********
     {
       //The decompression is done in the same unsigned char *, each worker won't touch the other's memory
-      size_t cmp_len = BIGFILE_LOW_THRESHOLD;
-      if (mz_uncompress((in->ptrOut + in->blockid * BIGFILE_LOW_THRESHOLD), &cmp_len, (const unsigned char *)(in->ptr + in->readBytes), in->cmp_size) != MZ_OK)
+      const FileStruct &file = FilesVector[in->idFile];
+      size_t cmp_len = file.offsets[in->blockid + 1] - file.offsets[in->blockid];
+      TraceSpan span("decompress", cmp_len);
+      StageCounters counters(STAGE_DECOMPRESS, cmp_len);
+      if (mz_uncompress((in->ptrOut + file.offsets[in->blockid]), &cmp_len, (const unsigned char *)(in->ptr + in->readBytes), in->cmp_size) != MZ_OK)
       {
         if (QUITE_MODE >= 1)
           std::fprintf(stderr, "Failed to decompress file in memory\n");
         success = false;
+        in->failed = true;
+        ff_send_out(in);
         return GO_ON;
       }
+      unsigned char *block = in->ptrOut + file.offsets[in->blockid];
+      // a block of another .miniz: the hash tells if it is still the block that was referenced
+      if (in->check != nullptr)
+      {
+        const Hash128 h = hash128(block, cmp_len);
+        if (h.lo != in->check->lo || h.hi != in->check->hi)
+        {
+          std::fprintf(stderr, "Stale block reference in %s, the .miniz it refers to has changed\n", file.filename.c_str());
+          success = false;
+          in->failed = true;
+          ff_send_out(in);
+          return GO_ON;
+        }
+      }
+      // the references to this block in the same file
+      auto copies = std::equal_range(file.copies.begin(), file.copies.end(), std::make_pair(in->blockid, (size_t)0),
+                                     [](const std::pair<size_t, size_t> &a, const std::pair<size_t, size_t> &b)
+                                     { return a.first < b.first; });
+      for (auto c = copies.first; c != copies.second; ++c)
+        memcpy(in->ptrOut + file.offsets[c->second], block, cmp_len);
+      telemetryAdd(STAGE_DECOMPRESS, in->cmp_size, cmp_len);
       ff_send_out(in);
     }
     return GO_ON;
   }
   const size_t Lw;
+  const size_t id;
+  int cpu = -1; // --pin/--numa: CPU of the thread
+  BlockPool *blockPool = nullptr; // where the buffers of the compressed blocks are taken
 };
 
+// ------------ AUTO TUNING (L-Workers or R-Workers "auto") ---------------
+
+// Cost of the work of the L_Workers (mapping, reading and writing the files) and of the
+// R_Workers (compressing or decompressing the blocks), measured on one file of the input
+struct Calibration
+{
+  double perFile = 0;  // mapping and unmapping a file
+  double perBlock = 0; // reading the data of a block
+  double cpuBlock = 0; // compressing or decompressing a block
+};
+
+static inline double secondsSince(const std::chrono::steady_clock::time_point &t)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+// Number of blocks of a file: from its size when compressing, from the header of the .miniz otherwise
+static inline size_t blocksOfFile(const FileStruct &file)
+{
+  if (compressing)
+    return std::max<size_t>(1, (file.size + BIGFILE_LOW_THRESHOLD - 1) / BIGFILE_LOW_THRESHOLD);
+  size_t header[2] = {0, 1};
+  FILE *in = fopen(file.filename.c_str(), "rb");
+  if (in != nullptr)
+  {
+    if (fread(header, sizeof(size_t), 2, in) != 2)
+      header[1] = 1;
+    fclose(in);
+  }
+  return std::max<size_t>(1, blockCount(header[1]));
+}
+
+// Processes the first block of the file as the workers would do
+static inline bool calibrate(const FileStruct &file, Calibration &cal)
+{
+  const size_t sizeOfT = sizeof(size_t);
+  size_t size = file.size;
+  unsigned char *ptr = nullptr;
+  auto t = std::chrono::steady_clock::now();
+  if (!mapFile(file.filename.c_str(), size, ptr))
+    return false;
+  double mapTime = secondsSince(t);
+
+  // the data of the first block
+  const unsigned char *data = ptr;
+  size_t dataSize = std::min(size, BIGFILE_LOW_THRESHOLD);
+  size_t rawSize = dataSize;
+  if (!compressing)
+  {
+    size_t nblocks = 0;
+    if (size >= 3 * sizeOfT)
+    {
+      memcpy(&rawSize, ptr, sizeOfT);
+      memcpy(&nblocks, ptr + sizeOfT, sizeOfT);
+    }
+    if (blockCount(nblocks) == 0 || blockCount(nblocks) > size / sizeOfT || headerBytes(nblocks) > size)
+    {
+      unmapFile(ptr, size);
+      return false;
+    }
+    memcpy(&dataSize, ptr + 2 * sizeOfT, sizeOfT);
+    data = ptr + headerBytes(nblocks);
+    dataSize = std::min(dataSize, size - headerBytes(nblocks));
+    rawSize = std::min(rawSize, BIGFILE_LOW_THRESHOLD);
+    if (isChunked(nblocks))
+      memcpy(&rawSize, ptr + sizeOfT * (blockCount(nblocks) + 2), sizeOfT);
+  }
+
+  t = std::chrono::steady_clock::now();
+  unsigned char sum = 0;
+  for (size_t i = 0; i < dataSize; i += 4096)
+    sum += data[i];
+  asm volatile("" : : "r"(sum)); // the reads are not optimized away
+  cal.perBlock = secondsSince(t);
+
+  size_t outSize = compressing ? compressBound(dataSize) : rawSize;
+  unsigned char *out = new unsigned char[std::max<size_t>(outSize, 1)];
+  t = std::chrono::steady_clock::now();
+  bool ok = compressing ? compress(out, &outSize, data, dataSize) == Z_OK
+                        : mz_uncompress(out, &outSize, data, dataSize) == MZ_OK;
+  cal.cpuBlock = secondsSince(t);
+  delete[] out;
+
+  t = std::chrono::steady_clock::now();
+  unmapFile(ptr, size);
+  cal.perFile = mapTime + secondsSince(t);
+  return ok;
+}
+
+// Chooses the workers given as 0 (auto) among the CPUs that can be used: the L_Workers get
+// the share of the time spent in reading and writing the files, the R_Workers the rest.
+// There are no more L_Workers than files and no more R_Workers than blocks.
+static inline void autoWorkers(size_t &Lw, size_t &Rw)
+{
+  size_t cpus = 0;
+  for (auto &g : cpuGroups(false))
+    cpus += g.size();
+  // one L_Worker and one R_Worker at least, also with a single CPU
+  const size_t slots = std::max<size_t>(cpus, 2);
+  const size_t files = std::max<size_t>(FilesVector.size(), 1);
+
+  // blocks of the input, from at most SAMPLES files when they must be read
+  const size_t SAMPLES = 64;
+  size_t blocks = 0;
+  size_t step = compressing ? 1 : std::max<size_t>(1, FilesVector.size() / SAMPLES);
+  size_t sampled = 0;
+  for (size_t i = 0; i < FilesVector.size(); i += step, ++sampled)
+    blocks += blocksOfFile(FilesVector[i]);
+  if (sampled > 0)
+    blocks = blocks * FilesVector.size() / sampled;
+  blocks = std::max(blocks, files);
+
+  // calibration on the file of median size
+  double shareL = 0.5;
+  if (!FilesVector.empty())
+  {
+    std::vector<size_t> order(FilesVector.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::nth_element(order.begin(), order.begin() + order.size() / 2, order.end(),
+                     [](size_t a, size_t b) { return FilesVector[a].size < FilesVector[b].size; });
+    Calibration cal;
+    if (calibrate(FilesVector[order[order.size() / 2]], cal))
+    {
+      // each file is read and written, each block is read and written too
+      double timeL = 2 * (files * cal.perFile + blocks * cal.perBlock);
+      double timeR = blocks * cal.cpuBlock;
+      if (timeL + timeR > 0)
+        shareL = timeL / (timeL + timeR);
+    }
+  }
+
+  if (Lw == 0)
+  {
+    size_t cpusL = Rw == 0 ? (size_t)std::lround(slots * shareL) : slots - std::min(Rw, slots - 1);
+    Lw = std::min(std::max<size_t>(cpusL, 1), std::min(files, slots - 1));
+  }
+  if (Rw == 0)
+    Rw = std::min(std::max<size_t>(slots - std::min(Lw, slots - 1), 1), blocks);
+  std::printf("Auto: %zu L-Workers, %zu R-Workers (%zu CPUs, %zu files, %zu blocks)\n", Lw, Rw, cpus, files, blocks);
+}
+
 int main(int argc, char *argv[])
 {
   if (argc < 5)
@@ -466,9 +941,45 @@ int main(int argc, char *argv[])
   //TIMER
   const auto start = std::chrono::steady_clock::now();
 
-  //Number of Left Workers and Right Workers
-  const size_t Lw = std::stol(argv[3]);
-  const size_t Rw = std::stol(argv[4]);
+  //Number of Left Workers and Right Workers, 0 if they are chosen by autoWorkers
+  size_t Lw = strcmp(argv[3], "auto") == 0 ? 0 : std::stol(argv[3]);
+  size_t Rw = strcmp(argv[4], "auto") == 0 ? 0 : std::stol(argv[4]);
+  const bool numa = hasOption(argv + 5, argv + argc, "--numa");
+  const bool pin = numa || hasOption(argv + 5, argv + argc, "--pin");
+  // blocks that an R_Worker can have in its queue, 0 for round-robin distribution
+  const char *chunk = getOption(argv + 5, argv + argc, "--ondemand");
+  const int ondemand = chunk != nullptr ? std::max(std::atoi(chunk), 0) : 1;
+  dedup = compressing && hasOption(argv + 5, argv + argc, "--dedup");
+  // --cdc [MIN:AVG:MAX]: content-defined blocks, the sizes are in KiB
+  size_t minChunk = BIGFILE_LOW_THRESHOLD / 4, avgChunk = BIGFILE_LOW_THRESHOLD / 2, maxChunk = BIGFILE_LOW_THRESHOLD;
+  const bool cdc = compressing && hasOption(argv + 5, argv + argc, "--cdc");
+  const char *chunkSizes = getOption(argv + 5, argv + argc, "--cdc");
+  if (cdc && chunkSizes != nullptr && chunkSizes[0] != '-' && !parseChunkSizes(chunkSizes, minChunk, avgChunk, maxChunk))
+  {
+    printf("Invalid --cdc sizes %s, they must be MIN:AVG:MAX in KiB with MIN < AVG < MAX\n\n", chunkSizes);
+    usage(argv[0]);
+    return -1;
+  }
+  Chunker cdcChunker(minChunk, avgChunk, maxChunk);
+  if (cdc)
+    chunker = &cdcChunker;
+  // idle workers sleep on their queues, after polling them spin times
+  const bool blocking = hasOption(argv + 5, argv + argc, "--blocking");
+  const char *spin = getOption(argv + 5, argv + argc, "--spin");
+  ff::blocking_spin_budget = spin != nullptr ? std::strtoul(spin, nullptr, 10) : 1000;
+  // --trace FILE: absolute, walkDirff changes the current directory
+  const char *traceOption = getOption(argv + 5, argv + argc, "--trace");
+  const std::string traceFile = traceOption != nullptr ? std::filesystem::absolute(traceOption).string() : "";
+  countersEnabled = hasOption(argv + 5, argv + argc, "--counters");
+  // --progress [SECONDS] and --metrics FILE|unix:PATH, reported by another thread
+  const bool progress = hasOption(argv + 5, argv + argc, "--progress");
+  const char *interval = getOption(argv + 5, argv + argc, "--progress");
+  const char *metricsOption = getOption(argv + 5, argv + argc, "--metrics");
+  const std::string metrics = metricsOption == nullptr ? "" : metricsPath(metricsOption);
+  TelemetryReporter reporter(interval != nullptr && interval[0] != '-' ? std::atof(interval) : 2.0, progress, metrics, "");
+  // --memory [MS]: counts the allocations from here on, the resident memory sampled every MS
+  const bool memory = hasOption(argv + 5, argv + argc, "--memory") && memoryAvailable("FF_minizip");
+  const char *sampling = getOption(argv + 5, argv + argc, "--memory");
 
   struct stat statbuf;
   if (stat(argv[2], &statbuf) == -1)
@@ -480,47 +991,142 @@ int main(int argc, char *argv[])
   bool dir = false;
 
   // Walks in the directory and add the filenames in the FileVector
+  const bool incremental = compressing && S_ISDIR(statbuf.st_mode) && hasOption(argv + 5, argv + argc, "-i");
+  Manifest manifest(argv[2], SUFFIX);
+  if (incremental && !manifest.load())
+  {
+    fprintf(stderr, "Error: cannot read the manifest in %s\n", argv[2]);
+    return -1;
+  }
+  if (incremental)
+    incrementalManifest = &manifest;
   if (S_ISDIR(statbuf.st_mode))
   {
-    success &= walkDirff(argv[2], compressing, FilesVector);
+    success &= walkDirff(argv[2], compressing, FilesVector, incremental ? &manifest : nullptr);
   }
   else
   {
     success &= addFileToVector(argv[2], statbuf.st_size, compressing, FilesVector);
   }
 
+  if (Lw == 0 || Rw == 0)
+    autoWorkers(Lw, Rw);
+  taskPool.init(4096);
+  // at most this many blocks in the input
+  const size_t minBlock = cdc ? minChunk : BIGFILE_LOW_THRESHOLD;
+  size_t totalBlocks = 0;
+  for (auto &f : FilesVector)
+    totalBlocks += f.size / minBlock + 1;
+  // with -i the files compressed in a previous run may be compressed again, so a .miniz
+  // refers only to itself
+  if (dedup)
+    dedupTable.init(totalBlocks, !incremental);
+
   //Vector of atomic int used to count the blocks received by each Left worker
   std::vector<std::atomic<int>> vectorOfCounters(FilesVector.size());
 
+  // CPUs of the workers, by socket (--pin) or by NUMA node (--numa)
+  Placement placement(numa);
+  if (pin)
+    placement.plan(Lw, Rw);
+  // enough idle buffers for the blocks in flight, each one for the largest block
+  const size_t pools = numa ? std::max<size_t>(placement.groups.size(), 1) : 1;
+  for (size_t g = 0; g < pools; ++g)
+  {
+    blockPools.emplace_back(new BlockPool);
+    blockPools.back()->init(compressBound(cdc ? std::max(maxChunk, BIGFILE_LOW_THRESHOLD) : BIGFILE_LOW_THRESHOLD),
+                            std::max<size_t>(64, 4 * (Lw + Rw) / pools));
+  }
+
   std::vector<ff_node *> LW;
   std::vector<ff_node *> RW;
   size_t numberTasks = FilesVector.size() / Lw;
   size_t overflowTasks = FilesVector.size() % Lw;
   for (size_t i = 0; i < Lw; ++i)
   {
+    L_Worker *lw;
     if (overflowTasks)
     {
-      LW.push_back(new ff::ff_comb(new MultiInputHelperNode, new L_Worker(vectorOfCounters, i, numberTasks + 1, Lw)));
+      lw = new L_Worker(vectorOfCounters, i, numberTasks + 1, Lw);
       overflowTasks--;
     }
     else
-      LW.push_back(new ff::ff_comb(new MultiInputHelperNode, new L_Worker(vectorOfCounters, i, numberTasks, Lw)));
+      lw = new L_Worker(vectorOfCounters, i, numberTasks, Lw);
+    if (pin)
+      lw->cpu = placement.cpuL[i];
+    if (numa)
+      lw->localWorkers = placement.localWorkers(i);
+    lw->blockPool = blockPools[numa ? placement.groupL[i] : 0].get();
+    lw->ondemand = ondemand > 0;
+    LW.push_back(new ff::ff_comb(new MultiInputHelperNode, lw));
   }
   for (size_t i = 0; i < Rw; ++i)
-    RW.push_back(new ff::ff_comb(new MultiInputHelperNode, new R_Worker(Lw)));
+  {
+    R_Worker *rw = new R_Worker(Lw, i);
+    if (pin)
+      rw->cpu = placement.cpuR[i];
+    rw->blockPool = blockPools[numa ? placement.feederR[i] : 0].get();
+    RW.push_back(new ff::ff_comb(new MultiInputHelperNode, rw));
+  }
 
-  // Adding Lworkers and Rworkers to a2a
+  // The results go back to the L_Workers on the feedback channels (wrap_around), that the
+  // all-to-all creates always unbounded: an L_Worker sends all the blocks of its files before
+  // reading any result, so a bounded feedback channel could block the R_Workers forever.
+  // The initial capacity is what an L_Worker may get from one R_Worker, so the channels
+  // do not grow in the common case.
+  const int feedbackEntries = (int)std::min<size_t>(std::max<size_t>(DEFAULT_BUFFER_CAPACITY, totalBlocks / (Lw * Rw) + 1), 1 << 16);
+
+  // Adding Lworkers and Rworkers to a2a, the channels L->R keep DEFAULT_BUFFER_CAPACITY
   ff_a2a a2a;
-  a2a.add_firstset(LW);
+  a2a.setFeedbackQueueLength(feedbackEntries);
+  a2a.add_firstset(LW, ondemand);
   a2a.add_secondset(RW);
   a2a.wrap_around(); 
+  a2a.blocking_mode(blocking);
   
+  if (!traceFile.empty())
+    traceStart();
+  if ((progress || !metrics.empty()) && !reporter.start())
+    return -1;
+  if (memory)
+    memoryStart(FilesVector.size(), sampling != nullptr && sampling[0] != '-' ? std::atof(sampling) : 10.0);
   if (a2a.run_and_wait_end() < 0)
   {
     error("running a2a\n");
     return -1;
   } 
+  reporter.stop();
+  // the inputs that --dedup has kept mapped
+  for (size_t i = 0; i < FilesVector.size(); ++i)
+    releaseInput(FilesVector[i], i);
+  if (!traceFile.empty())
+    success &= traceWrite(traceFile, traceEvents(0, "FF_minizip"));
+  if (countersEnabled)
+  {
+    CounterTotals totals[STAGES];
+    bool available[COUNTERS];
+    countersTotals(totals, available);
+    printCounters(totals, available);
+#if defined(TRACE_FASTFLOW)
+    // tasks and service time of each node, from FastFlow
+    a2a.ffStats(std::cout);
+#endif
+  }
+  if (memory)
+  {
+    memoryStop();
+    printMemoryPeaks(memoryPeaks());
+    std::vector<std::string> names;
+    for (auto &f : FilesVector)
+      names.push_back(f.filename);
+    printMemoryFiles(names);
+  }
   
+  if (incremental)
+  {
+    printf("Incremental: %zu files compressed, %zu unchanged\n", manifest.added(), manifest.kept());
+    success &= manifest.save();
+  }
   if (!success)
   {
     printf("Exiting with (some) Error(s)\n");
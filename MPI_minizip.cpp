@@ -2,11 +2,22 @@
 #include <cmath>
 #include <string>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <array>
+#include <thread>
 #include <iostream>
 #include <ff/ff.hpp>
 #include <ff/all2all.hpp>
 using namespace ff;
 #include <utility.hpp>
+#include <pinning.hpp>
+#include <blockpool.hpp>
+#include <trace.hpp>
+#include <perfcounters.hpp>
+#include <telemetry.hpp>
+#include <memstats.hpp>
 #include <mpi.h>
 #include <omp.h>
 #include <filesystem>
@@ -14,13 +25,13 @@ struct FileStruct
 {
   std::string filename;
   size_t size;
-  int uncompressedLength = 0;
+  size_t uncompressedLength = 0;
   // In this array the pointer of the blocks are stored
-  unsigned char *pointer;
-  size_t *sizeOfBlocks;
-  unsigned char **arrayOfPointers;
+  unsigned char *pointer = nullptr;
+  size_t *sizeOfBlocks = nullptr;
+  unsigned char **arrayOfPointers = nullptr;
   size_t compressedLength = 0;
-  int numBlocks = -1; // Used in decompressing to check if it is the first message from the Master
+  int numBlocks = -1; // Number of blocks received in decompression
 };
 
 // ------------ GLOBAL VARIBLES ---------------
@@ -28,13 +39,114 @@ std::vector<FileStruct> FilesVector;
 std::vector<int> vectorOfCounters;
 bool compressing = false;
 bool success = true;
-int MAX_FILES_IN_DIRECTORY = 2000;
 int myId;
 int numP;
 int numW;
-bool workingMaster = false;
+bool workingMaster = false;            // the master runs a farm and gets blocks like the workers
+bool hierarchical = false;             // the data is sent once per node, to the leader of the node
+bool nodeHelper = false;               // gets the tasks from the leader of its node instead of the master
+bool nodeLeader = false;               // receives the data of its helpers
+MPI_Comm taskComm = MPI_COMM_NULL;     // master -> workers tasks
+MPI_Comm nodeComm = MPI_COMM_NULL;     // ranks of the same node
+bool oneSided = false;                 // the workers get the data and put the results with RMA on dataWin
+MPI_Win dataWin = MPI_WIN_NULL;        // dynamic window, the master attaches the files in flight
+std::vector<MPI_Aint> resultAddress;   // one sided: where the result of each file goes in the master
+std::vector<size_t> resultCapacity;    // one sided: space for the result of each file in the master
+std::vector<int> workerRanks;          // master: ranks of the workers, in the order in which they get the blocks
+std::vector<std::vector<int>> groups;  // master: workers (index in workerRanks) that get the data in one message
 // ------------ END GLOBAL VARIBLES ---------------
 
+// MPI tags of the messages between the master and the workers, the file is written in the header
+enum : int
+{
+  TAG_TASK_HEADER = 1, // master -> worker: id of the file, number of sizes, sizes of the compressed blocks
+  TAG_TASK_DATA,       // master -> worker: data to compress/decompress (not used with -R)
+  TAG_RESULT_HEADER,   // worker -> master: id of the file, size of the result
+  TAG_RESULT_DATA,     // worker -> master: result (not used with -R)
+  TAG_END              // master -> worker: no more files
+};
+// The header of a task is an array of size_t:
+// id of the file, address of the data of the group in dataWin (-R only),
+// number of sizes n, n sizes of the compressed blocks, number of ranks m of the group,
+// m parts (bytes, blocks, address and space of the result in dataWin) one for each rank of the group,
+// and only from a leader to a helper: slot of the node window, offset of the data in the slot
+static const size_t PART_FIELDS = 4;
+static const size_t NO_SLOT = SIZE_MAX;
+
+// Pool of the buffers used to receive the messages. The size of each message is known
+// through MPI_Mprobe, so the buffer is taken from the pool with the exact size needed
+// and given back when the data has been processed. Shared by the threads of the process.
+struct MsgBufferPool
+{
+  ~MsgBufferPool()
+  {
+    for (auto &b : freeBuffers)
+      delete[] b.second;
+  }
+  // returns a buffer of at least size bytes
+  unsigned char *get(size_t size)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto it = freeBuffers.lower_bound(size);
+      // a buffer much bigger than needed is not reused
+      if (it != freeBuffers.end() && it->first <= size * 2)
+      {
+        unsigned char *ptr = it->second;
+        freeBuffers.erase(it);
+        return ptr;
+      }
+    }
+    // at least one byte, so that empty messages get a valid pointer
+    unsigned char *ptr = new unsigned char[std::max<size_t>(size, 1)];
+    std::lock_guard<std::mutex> lock(mtx);
+    capacity[ptr] = size;
+    return ptr;
+  }
+  // gives back a buffer obtained with get
+  void put(unsigned char *ptr)
+  {
+    if (ptr == nullptr)
+      return;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (freeBuffers.size() >= MAX_POOLED_BUFFERS)
+    {
+      capacity.erase(ptr);
+      delete[] ptr;
+      return;
+    }
+    freeBuffers.emplace(capacity[ptr], ptr);
+  }
+
+  static const size_t MAX_POOLED_BUFFERS = 64;
+  std::mutex mtx;
+  std::multimap<size_t, unsigned char *> freeBuffers;
+  std::unordered_map<unsigned char *, size_t> capacity;
+};
+MsgBufferPool bufferPool;
+BlockPool blockPool; // buffers of the compressed blocks
+
+// Hierarchical mode: memory shared by the ranks of a node. The leader of the node receives
+// the data of the whole node in a slot, the other ranks of the node read their part from there.
+// A slot can be reused when all the ranks that read it have finished (readers == 0).
+struct NodeWindow
+{
+  static const size_t SLOTS = 2;
+  static const size_t HEADER = 64; // space for the counters of readers
+  static const size_t MAX_SLOT_SIZE = 1UL << 30;
+
+  unsigned char *slot(size_t s) { return base + HEADER + s * slotSize; }
+
+  MPI_Win win = MPI_WIN_NULL;
+  unsigned char *base = nullptr; // memory of the leader, mapped in every rank of the node
+  size_t slotSize = 0;
+  std::atomic<long> *readers = nullptr;
+  size_t nextSlot = 0;
+};
+NodeWindow nodeWindow;
+
+// Descriptor of a block, the data of the file is in FilesVector[idFile].
+// Recycled through taskPool, so it must stay trivially copyable.
 struct Task_t
 {
   unsigned char *ptr;              // input pointer
@@ -46,8 +158,32 @@ struct Task_t
   size_t idFile = 0;               // Id of the file in the FileVector
   size_t readBytes = 0;            // Used in the decompression to understand where each worker has to start
   size_t uncompreFileSize = 0;     // Size of the uncompressed file
-  const std::string filename;      // source file name
+  size_t slot = NO_SLOT;           // Slot of the node window with the input, NO_SLOT if it is a buffer of the pool
 };
+TaskPool<Task_t> taskPool;
+
+// The input of the task is no longer needed
+static inline void releaseInput(Task_t *in)
+{
+  if (in->slot != NO_SLOT)
+    nodeWindow.readers[in->slot]--;
+  else
+    bufferPool.put(in->ptr);
+}
+
+// The workers do not resolve references nor split variable size blocks: the .miniz files with
+// them are left to FF_minizip and SEQ_minizip, the small ones too
+static inline bool plainArchive(const std::string &infilename, size_t size)
+{
+  unsigned char *ptr = nullptr;
+  if (!mapFile(infilename.c_str(), size, ptr))
+    return false;
+  const bool plain = !hasChunks(ptr, size) && !hasDedupRefs(ptr, size);
+  unmapFile(ptr, size);
+  if (!plain)
+    std::fprintf(stderr, "%s has deduplicated or variable size blocks, use FF_minizip or SEQ_minizip\n", infilename.c_str());
+  return plain;
+}
 
 static inline bool addFileToVector(const char fname[], size_t size, const bool comp, std::vector<FileStruct> &FilesVector)
 {
@@ -63,370 +199,553 @@ static inline bool addFileToVector(const char fname[], size_t size, const bool c
 
 static inline bool walkDirMpi(const char dname[], const bool comp, std::vector<FileStruct> &FilesVector)
 {
-  if (chdir(dname) == -1)
-  {
-    if (QUITE_MODE >= 1)
-    {
-      perror("chdir");
-      std::fprintf(stderr, "Error: chdir %s\n", dname);
-    }
-    return false;
-  }
-  DIR *dir;
-  if ((dir = opendir(".")) == NULL)
-  {
-    if (QUITE_MODE >= 1)
-    {
-      perror("opendir");
-      std::fprintf(stderr, "Error: opendir %s\n", dname);
-    }
-    return false;
-  }
-  struct dirent *file;
-  bool error = false;
-  while ((errno = 0, file = readdir(dir)) != NULL)
-  {
-    struct stat statbuf;
-    if (stat(file->d_name, &statbuf) == -1)
-    {
-      if (QUITE_MODE >= 1)
-      {
-        perror("stat");
-        std::fprintf(stderr, "Error: stat %s\n", file->d_name);
-      }
-      return false;
-    }
-    if (S_ISDIR(statbuf.st_mode))
-    {
-      if (!isdot(file->d_name))
-      {
-        if (walkDirMpi(file->d_name, comp, FilesVector))
-        {
-          if (!chdir(".."))
-          {
-            perror("chdir");
-            std::fprintf(stderr, "Error: chdir ..\n");
-            error = true;
-          }
-        }
-        else
-          error = true;
-      }
-    }
-    else
-    {
-      if (!addFileToVector(file->d_name, statbuf.st_size, comp, FilesVector))
-        error = true;
-    }
-  }
-  if (errno != 0)
+  return walkFiles(dname, comp, [comp, &FilesVector](const std::string &name, const char *, const struct stat &statbuf)
+                   { return addFileToVector(name.c_str(), statbuf.st_size, comp, FilesVector); });
+}
+
+// Broadcast the size of every file from the master to all the workers.
+// First the number of files is sent, then the sizes in chunks (MPI counts are int),
+// so there is no limit on the number of files and nothing is put on the stack
+static inline void bcastFileSizes(std::vector<unsigned long long> &sizes)
+{
+  unsigned long long numberOfFiles = sizes.size();
+  MPI_Bcast(&numberOfFiles, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+  sizes.resize(numberOfFiles);
+
+  const size_t chunk = INT_MAX / sizeof(unsigned long long);
+  for (size_t sent = 0; sent < numberOfFiles; sent += chunk)
   {
-    if (QUITE_MODE >= 1)
-      perror("readdir");
-    error = true;
+    int count = std::min<size_t>(chunk, numberOfFiles - sent);
+    MPI_Bcast(sizes.data() + sent, count, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
   }
-  closedir(dir);
-  return !error;
 }
 
 static inline void usage(const char *argv0)
 {
   printf("--------------------\n");
-  printf("Usage: %s c|d|C|D file-or-directory Farm-Workers  \n", argv0);
+  printf("Usage: %s c|d|C|D file-or-directory Farm-Workers [-m] [-H] [-R] [--pin|--numa] [--trace FILE] [--counters]\n"
+         "       [--progress [SECONDS]] [--metrics FILE|unix:PATH] [--memory [MS]]\n", argv0);
   printf("\nModes:\n");
   printf("c - Compresses file infile to a zlib stream into outfile\n");
   printf("d - Decompress a zlib stream from infile into outfile\n");
+  printf("\nOptions:\n");
+  printf("-m - The master works on the big files too\n");
+  printf("-H - Hierarchical mode, one rank per node receives the data for the whole node\n");
+  printf("-R - The workers get the data and put the results with one sided communication\n");
+  printf("--pin  - Pins the threads of the farm, the ranks of a node share its CPUs\n");
+  printf("--numa - Pins the threads of the farm of each rank on one NUMA node\n");
+  printf("--trace FILE - Writes in FILE a Chrome trace of the threads of all the ranks (chrome://tracing, ui.perfetto.dev)\n");
+  printf("--counters   - Prints the hardware counters (perf_event_open) of each stage, summed over the ranks\n");
+  printf("--progress   - Each rank prints on stderr the bytes done by its stages every SECONDS (default 2),\n");
+  printf("               the master also the rate of each rank\n");
+  printf("--metrics    - Writes the same in the Prometheus text format in FILE, or to the clients of a Unix socket\n");
+  printf("               (FILE.N and PATH.N for the rank N)\n");
+  printf("--memory     - The master prints the peak memory of each rank and of each stage, and the memory of the files\n");
+  printf("               on the master (resident memory sampled every MS milliseconds, default 10), only in\n");
+  printf("               MPI_minizip_memstats (make memstats)\n");
   printf("--------------------\n");
 }
 
-static inline bool mpiMasterCompressing(size_t i, int numP)
+// Name of the decompressed file, if the file exist in the directory it will add 1,2,3..
+static inline std::string decompressedFileName(const std::string &infilename)
 {
-  size_t idFile = i;
-  const std::string infilename(FilesVector[idFile].filename);
-  size_t infile_size = FilesVector[idFile].size;
-  size_t sizeOfT = sizeof(size_t);
-
-  unsigned char *ptr = nullptr;
-  if (!mapFile(infilename.c_str(), infile_size, ptr))
+  std::string outfilename = infilename.substr(0, infilename.size() - 6);
+  int a = 1;
+  std::string tempFileName = outfilename;
+  while (existsFile(tempFileName))
   {
-    std::fprintf(stderr, "Failed to mapFile\n");
-    success = false;
-    return false;
+    tempFileName = outfilename;
+    size_t pos = outfilename.find(".");
+    if (pos == std::string::npos)
+      tempFileName = outfilename + std::to_string(a);
+    else
+      tempFileName = tempFileName.insert(pos, std::to_string(a));
+    a++;
   }
+  return tempFileName;
+}
+
+// A file split between the workers, the master keeps it until all the results are received
+struct FileJob
+{
+  size_t idFile;
+  unsigned char *ptr = nullptr;      // mapped input file
+  size_t numberOfBlocks = 0;
+  int pendingSends = 0;              // sends to the workers not completed yet
+  int pendingResults = 0;            // results of the workers not received yet
+  // One header for each group of workers, kept until the send is completed
+  std::vector<std::vector<size_t>> taskHeaders;
+  // Compression: the data compressed by each worker
+  std::vector<unsigned char *> results;
+  std::vector<size_t> resultSizes;
+  // Decompression: the output file and where the output of each worker goes
+  unsigned char *ptrFinal = nullptr;
+  size_t uncompressedFileSize = 0;
+  size_t finalSizeOfFile = 0;
+  std::vector<size_t> displacement;
+  // One sided: the workers put the results here (compression), space of the result of each worker
+  unsigned char *output = nullptr;
+  std::vector<size_t> outputSpace;
+  // --memory: bytes held for the file besides its mapping (output, results)
+  size_t memory = 0;
+};
+
+// Event driven master: only one thread talks with the workers. It keeps a window of files
+// in flight on all the workers, and waits on all the outstanding requests with MPI_Waitsome.
+// The file a message belongs to is written in the header of the message (tags are constants),
+// so the results are matched by (worker rank, id of the file).
+struct MasterEngine
+{
+  MasterEngine(size_t maxJobsInFlight)
+      : maxJobsInFlight(maxJobsInFlight), resultHeaders(numW) {}
 
-  const size_t fullblocks = infile_size / BIGFILE_LOW_THRESHOLD;
-  const size_t partialblock = infile_size % BIGFILE_LOW_THRESHOLD;
-  size_t numberOfBlocks = fullblocks;
-  if (partialblock)
-    numberOfBlocks++;
+  void run(const std::vector<size_t> &files)
+  {
+    traceThread("master");
+    // Each worker can always send the header of a result
+    for (int w = 0; w < numW; ++w)
+      postResultHeader(w);
+
+    size_t next = 0;
+    std::vector<int> indices;
+    while (next < files.size() || !jobs.empty())
+    {
+      while (next < files.size() && jobs.size() < maxJobsInFlight)
+        startJob(files[next++]);
+      if (jobs.empty())
+        continue;
+
+      compactRequests();
+      indices.resize(requests.size());
+      int outcount;
+      TraceSpan span("MPI_Waitsome");
+      MPI_Waitsome(requests.size(), requests.data(), &outcount, indices.data(), MPI_STATUSES_IGNORE);
+      for (int k = 0; k < outcount; ++k)
+        handleRequest(indices[k]);
+    }
 
-  std::vector<int> counts(numW);
-  std::vector<int> displs(numW);
-  int max = 0;
+    // No more results to receive
+    for (size_t k = 0; k < requests.size(); ++k)
+    {
+      if (requests[k] != MPI_REQUEST_NULL)
+      {
+        MPI_Cancel(&requests[k]);
+        MPI_Wait(&requests[k], MPI_STATUS_IGNORE);
+      }
+    }
+  }
 
-  // Here we split the data between the other nodes, we send X nodes to each node in one message
-  for (int j = 0; j < numW; ++j)
+private:
+  enum RequestKind
+  {
+    SEND,
+    RESULT_HEADER,
+    RESULT_DATA
+  };
+  struct RequestInfo
   {
-    auto start = (fullblocks * j / (numW)) * BIGFILE_LOW_THRESHOLD;
-    auto end = (fullblocks * (j + 1) / (numW)) * BIGFILE_LOW_THRESHOLD;
-    counts[j] = end - start;
-    displs[j] = start;
+    RequestKind kind;
+    int worker;
+    size_t idFile;
+  };
 
-    if (counts[j] > max)
-      max = counts[j] + partialblock;
+  void addRequest(MPI_Request rq, RequestKind kind, int worker, size_t idFile)
+  {
+    requests.push_back(rq);
+    info.push_back({kind, worker, idFile});
   }
-  counts[counts.size() - 1] += partialblock;
 
-  MPI_Request rq_send[numW];
-  MPI_Status statuses[numW];
-  int loopLength = (numW == numP) ? numP : numW;
-  int sentMessages = 0;
-  // Send the data to the workers
-  for (int j = (numW == numP) ? 1 : 0; j < loopLength; ++j)
+  // Remove the completed requests
+  void compactRequests()
   {
-    if (counts[j] != 0)
+    size_t k = 0;
+    for (size_t j = 0; j < requests.size(); ++j)
     {
-      MPI_Isend((ptr + displs[j]), counts[j], MPI_UNSIGNED_CHAR, j + numP - numW, idFile, MPI_COMM_WORLD, &rq_send[j]);
-      sentMessages++;
+      if (requests[j] != MPI_REQUEST_NULL)
+      {
+        requests[k] = requests[j];
+        info[k] = info[j];
+        k++;
+      }
     }
+    requests.resize(k);
+    info.resize(k);
   }
 
-  // This vector is used to
-  FilesVector[idFile].arrayOfPointers = new unsigned char *[numW];
-  int activeWorkers[numW];
-  for (int j = 0; j < numW; ++j)
+  void postResultHeader(int w)
   {
-    activeWorkers[j] = -1;
+    MPI_Request rq;
+    MPI_Irecv(resultHeaders[w].data(), 2 * sizeof(size_t), MPI_UNSIGNED_CHAR, workerRanks[w], TAG_RESULT_HEADER, MPI_COMM_WORLD, &rq);
+    addRequest(rq, RESULT_HEADER, w, 0);
   }
-  if (!workingMaster)
+
+  // Sends to the first worker of the group the header and the data of the whole group.
+  // sizes are the sizes of the compressed blocks of the group (decompression only),
+  // bytes and blocks the part of each worker
+  void sendTask(FileJob &job, int g, unsigned char *data, const size_t *sizes, size_t numberOfSizes,
+                const std::vector<size_t> &bytes, const std::vector<size_t> &blocks)
   {
-    size_t sizeOfT = sizeof(size_t);
-    // size of the first 2 sizeof t in the header
-    size_t compressFileSize = sizeOfT * 2;
-    size_t compressedByWorkerSize[numW];
-    // Some nodes may not receive any data to process so we use sent messages
-    for (int j = 0; j < sentMessages; ++j)
-    {
-      MPI_Request rq_recv;
-      MPI_Status status;
-      // We estimate the data to receive
-      int estimatedSize = max + BIGFILE_LOW_THRESHOLD * 4;
-      unsigned char *ptrIN = new unsigned char[estimatedSize];
-      MPI_Irecv(ptrIN, estimatedSize, MPI_UNSIGNED_CHAR, MPI_ANY_SOURCE, idFile, MPI_COMM_WORLD, &rq_recv);
-      MPI_Wait(&rq_recv, &status);
-      int countElements;
-      MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &countElements);
-      size_t nblocks;
-
-      memcpy(&nblocks, ptrIN, sizeOfT);
-      // we keep track of the size of the compressed file
-      compressFileSize += countElements - sizeOfT;
-      // Number of bytes compressed by the worker
-      compressedByWorkerSize[status.MPI_SOURCE - 1] = countElements - sizeOfT * (nblocks + 1);
-      // Use this variable to know which workers are active and the number of blocks they have compressed
-      activeWorkers[status.MPI_SOURCE - 1] = nblocks;
-      // store the pointer
-      FilesVector[idFile].arrayOfPointers[status.MPI_SOURCE - 1] = ptrIN;
+    const std::vector<int> &group = groups[g];
+    std::vector<size_t> &header = job.taskHeaders[g];
+    // One sided: the workers get the data and put the results in the memory attached to dataWin
+    MPI_Aint dataAddress = 0;
+    unsigned char *output = compressing ? job.output : job.ptrFinal;
+    if (oneSided)
+      MPI_Get_address(data, &dataAddress);
+    header = {job.idFile, (size_t)dataAddress, numberOfSizes};
+    header.insert(header.end(), sizes, sizes + numberOfSizes);
+    header.push_back(group.size());
+    size_t size = 0;
+    for (int w : group)
+    {
+      telemetryRankAdd(workerRanks[w], bytes[w], 0);
+      MPI_Aint resultAddress = 0;
+      if (oneSided && bytes[w] > 0)
+        MPI_Get_address(output + job.displacement[w], &resultAddress);
+      header.push_back(bytes[w]);
+      header.push_back(blocks[w]);
+      header.push_back(resultAddress);
+      header.push_back(oneSided ? job.outputSpace[w] : 0);
+      size += bytes[w];
+      if (bytes[w] > 0)
+        job.pendingResults++;
     }
+    if (size == 0)
+      return;
+
+    MPI_Request rq;
+    int dest = workerRanks[group[0]];
+    TraceSpan span("MPI_Isend", size);
+    MPI_Isend(header.data(), header.size() * sizeof(size_t), MPI_UNSIGNED_CHAR, dest, TAG_TASK_HEADER, taskComm, &rq);
+    addRequest(rq, SEND, group[0], job.idFile);
+    job.pendingSends++;
+    if (!oneSided)
+    {
+      MPI_Isend(data, size, MPI_UNSIGNED_CHAR, dest, TAG_TASK_DATA, taskComm, &rq);
+      addRequest(rq, SEND, group[0], job.idFile);
+      job.pendingSends++;
+    }
+  }
 
-    //  Creation header
-    unsigned char *ptrHeader = new unsigned char[sizeOfT * (numberOfBlocks + 2)];
-
-    // size of file
-    memcpy(ptrHeader, &FilesVector[idFile].size, sizeof(size_t));
-    // number of blocks
-    memcpy(ptrHeader + sizeOfT, &numberOfBlocks, sizeof(size_t));
+  void startJob(size_t idFile)
+  {
+    MemoryStage stage(STAGE_SPLIT);
+    const std::string infilename(FilesVector[idFile].filename);
+    size_t infile_size = FilesVector[idFile].size;
+    size_t sizeOfT = sizeof(size_t);
 
-    size_t bytesRead = sizeOfT * 2;
-    for (int j = 0; j < numW; ++j)
+    unsigned char *ptr = nullptr;
+    bool mapped;
     {
-      // write the length of each block in the header
-      if (activeWorkers[j] != -1)
-      {
-        memcpy((ptrHeader + bytesRead), (FilesVector[idFile].arrayOfPointers[j] + sizeOfT), activeWorkers[j] * sizeOfT);
-        bytesRead += activeWorkers[j] * sizeOfT;
-      }
+      TraceSpan span("map", infile_size);
+      mapped = mapFile(infilename.c_str(), infile_size, ptr);
+    }
+    if (!mapped)
+    {
+      std::fprintf(stderr, "Failed to mapFile\n");
+      success = false;
+      return;
     }
+    memoryFile(idFile, infile_size, true);
+    if (!compressing && (hasChunks(ptr, infile_size) || hasDedupRefs(ptr, infile_size)))
+    {
+      std::fprintf(stderr, "%s has deduplicated or variable size blocks, use FF_minizip or SEQ_minizip\n", infilename.c_str());
+      unmapFile(ptr, infile_size);
+      memoryFile(idFile, -(int64_t)infile_size, true);
+      success = false;
+      return;
+    }
+    FileJob &job = jobs[idFile];
+    job.idFile = idFile;
+    job.ptr = ptr;
+    job.taskHeaders.resize(groups.size());
+    if (oneSided)
+      MPI_Win_attach(dataWin, ptr, infile_size);
+
+    // Part of each worker
+    std::vector<size_t> bytes(numW, 0);
+    std::vector<size_t> blocks(numW, 0);
+    // Where the data of each worker starts in the input file
+    std::vector<size_t> start(numW, 0);
+    // Decompression: sizes of the compressed blocks, from the header of the file
+    const size_t *sizes = nullptr;
 
-    std::string outfilename = std::string(FilesVector[idFile].filename) + SUFFIX;
-    FILE *pOutfile = fopen(outfilename.c_str(), "wb");
-    if (!pOutfile)
+    if (compressing)
     {
-      if (QUITE_MODE >= 1)
+      const size_t fullblocks = infile_size / BIGFILE_LOW_THRESHOLD;
+      const size_t partialblock = infile_size % BIGFILE_LOW_THRESHOLD;
+      job.numberOfBlocks = fullblocks + (partialblock ? 1 : 0);
+      job.results.assign(numW, nullptr);
+      job.resultSizes.assign(numW, 0);
+
+      // Here we split the data between the workers, X blocks to each worker
+      for (int j = 0; j < numW; ++j)
       {
-        perror("fopen");
-        std::fprintf(stderr, "Failed opening output file %s!\n", outfilename.c_str());
-        return false;
+        size_t begin = (fullblocks * j / numW) * BIGFILE_LOW_THRESHOLD;
+        size_t end = (fullblocks * (j + 1) / numW) * BIGFILE_LOW_THRESHOLD;
+        if (j == numW - 1)
+          end += partialblock;
+        start[j] = begin;
+        bytes[j] = end - begin;
+        blocks[j] = (bytes[j] + BIGFILE_LOW_THRESHOLD - 1) / BIGFILE_LOW_THRESHOLD;
       }
-    }
-    // Write header
-    if (fwrite(ptrHeader, 1, bytesRead, pOutfile) != bytesRead)
-    {
-      if (QUITE_MODE >= 1)
+      if (oneSided)
       {
-        perror("fwrite");
-        std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
+        // Each worker puts its result in its own part of the output, big enough for the worst case
+        job.displacement.assign(numW, 0);
+        job.outputSpace.assign(numW, 0);
+        size_t outputSize = 0;
+        for (int j = 0; j < numW; ++j)
+        {
+          size_t partial = bytes[j] % BIGFILE_LOW_THRESHOLD;
+          job.displacement[j] = outputSize;
+          job.outputSpace[j] = sizeOfT * (blocks[j] + 1) + (bytes[j] / BIGFILE_LOW_THRESHOLD) * compressBound(BIGFILE_LOW_THRESHOLD) + (partial ? compressBound(partial) : 0);
+          outputSize += job.outputSpace[j];
+        }
+        job.output = new unsigned char[outputSize];
+        job.memory += outputSize;
+        MPI_Win_attach(dataWin, job.output, outputSize);
       }
-      return false;
     }
-    //  Write of the workers compressed data
-    for (size_t j = 0; j < numW; ++j)
+    else
     {
-      if (activeWorkers[j] != -1)
+      // Size of the uncompressed file
+      memcpy(&job.uncompressedFileSize, ptr, sizeOfT);
+      // Number of blocks taken from header
+      memcpy(&job.numberOfBlocks, ptr + sizeOfT, sizeOfT);
+      job.ptrFinal = new unsigned char[job.uncompressedFileSize];
+      job.memory += job.uncompressedFileSize;
+      job.displacement.assign(numW, 0);
+      sizes = (const size_t *)(ptr + sizeOfT * 2);
+
+      size_t numberTasks = job.numberOfBlocks / numW;
+      size_t overflowTasks = job.numberOfBlocks % numW;
+      size_t bytesRead = sizeOfT * (job.numberOfBlocks + 2);
+      size_t firstBlock = 0;
+      for (int j = 0; j < numW; ++j)
+      {
+        blocks[j] = numberTasks + ((size_t)j < overflowTasks ? 1 : 0);
+        start[j] = bytesRead;
+        for (size_t z = 0; z < blocks[j]; ++z)
+          bytes[j] += sizes[firstBlock + z];
+        job.displacement[j] = firstBlock * BIGFILE_LOW_THRESHOLD;
+        firstBlock += blocks[j];
+        bytesRead += bytes[j];
+      }
+      if (oneSided)
       {
-        if (fwrite((FilesVector[idFile].arrayOfPointers[j] + sizeOfT * (activeWorkers[j] + 1)), 1, compressedByWorkerSize[j], pOutfile) != compressedByWorkerSize[j])
+        job.outputSpace.assign(numW, 0);
+        for (int j = 0; j < numW; ++j)
         {
-          if (QUITE_MODE >= 1)
-          {
-            perror("fwrite");
-            std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
-          }
-          return false;
+          if (job.displacement[j] < job.uncompressedFileSize)
+            job.outputSpace[j] = std::min(blocks[j] * BIGFILE_LOW_THRESHOLD, job.uncompressedFileSize - job.displacement[j]);
         }
+        MPI_Win_attach(dataWin, job.ptrFinal, job.uncompressedFileSize);
       }
     }
-    if (fclose(pOutfile) != 0)
-      return false;
-  }
-  return true;
-}
 
-static inline bool mpiMasterDecompressing(size_t i, int numP)
-{
-  size_t idFile = i;
-  const std::string infilename(FilesVector[idFile].filename);
-  size_t infile_size = FilesVector[idFile].size;
-  size_t sizeOfT = sizeof(size_t);
+    memoryFile(idFile, job.memory);
 
-  unsigned char *ptr = nullptr;
-  if (!mapFile(infilename.c_str(), infile_size, ptr))
-  {
-    std::fprintf(stderr, "Failed to mapFile\n");
-    success = false;
-    return false;
+    // The workers of a group are consecutive, so the data of the group is contiguous
+    size_t firstBlock = 0;
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+      size_t groupBlocks = 0;
+      for (int w : groups[g])
+        groupBlocks += blocks[w];
+      sendTask(job, g, ptr + start[groups[g][0]], sizes ? sizes + firstBlock : nullptr, sizes ? groupBlocks : 0, bytes, blocks);
+      firstBlock += groupBlocks;
+    }
+    if (job.pendingResults == 0)
+      finishJob(job);
   }
 
-  // Size of the uncompressed file
-  size_t uncompressedFileSize;
-  memcpy(&uncompressedFileSize, ptr, sizeof(size_t));
-
-  // Number of blocks taken from header
-  size_t numberOfBlocks;
-  memcpy(&numberOfBlocks, ptr + sizeOfT, sizeof(size_t));
-
-  size_t headerSize = sizeOfT * (numberOfBlocks + 2);
-  size_t bytesRead = headerSize;
-
-  size_t numberTasks = numberOfBlocks / numW;
-  size_t overflowTasks = numberOfBlocks % numW;
-
-  MPI_Request rq_send[numW];
-  MPI_Status statuses[numW];
-  int sentMessages = 0;
-  // We skip the the uncompressed file size and the number of blocks from the header
-  int tot = sizeOfT * 2;
-  if (!workingMaster)
+  void handleRequest(int index)
   {
-
-    size_t bytesToSendForEachWorker[numW];
-    size_t numberOfBlocksForEachWorker[numW];
-    size_t displacement[numW + 1];
-    size_t tempValue;
-    for (int j = 0; j < numW; ++j)
+    MemoryStage stage(STAGE_WRITE); // gathering the results
+    RequestInfo ri = info[index];
+    switch (ri.kind)
+    {
+    case SEND:
     {
-      bytesToSendForEachWorker[j] = 0;
-      numberOfBlocksForEachWorker[j] = 0;
-      displacement[j] = 0;
+      FileJob &job = jobs[ri.idFile];
+      job.pendingSends--;
+      checkJob(job);
+      break;
     }
-
-    // THIS LOOP IS TO SEND THE LENGTH OF EACH COMPRESSED BLOCK TO THE WORKERS
-    for (int j = 0; j < numW; ++j)
+    case RESULT_HEADER:
     {
-      if (overflowTasks > 0)
+      size_t idFile = resultHeaders[ri.worker][0];
+      size_t bytes = resultHeaders[ri.worker][1];
+      FileJob &job = jobs[idFile];
+      telemetryRankAdd(workerRanks[ri.worker], 0, bytes);
+      if (oneSided)
       {
-        MPI_Isend((ptr + tot), sizeOfT * (numberTasks + 1), MPI_UNSIGNED_CHAR, j + 1, idFile, MPI_COMM_WORLD, &rq_send[j]);
-
-        for (int z = 0; z < numberTasks + 1; z++)
+        // The worker has already put the result in its place
+        if (bytes > job.outputSpace[ri.worker])
+        {
+          std::fprintf(stderr, "Worker %d sent more data than expected for %s\n", workerRanks[ri.worker], FilesVector[idFile].filename.c_str());
+          success = false;
+        }
+        else if (compressing)
         {
-          memcpy(&tempValue, ptr + tot + z * sizeOfT, sizeOfT);
-          bytesToSendForEachWorker[j] += tempValue;
+          job.results[ri.worker] = job.output + job.displacement[ri.worker];
+          job.resultSizes[ri.worker] = bytes;
         }
-        tot += sizeOfT * (numberTasks + 1);
-        overflowTasks--;
-        numberOfBlocksForEachWorker[j] += numberTasks + 1;
-        displacement[j + 1] += displacement[j] + (numberTasks + 1) * BIGFILE_LOW_THRESHOLD;
-        sentMessages++;
+        else
+          job.finalSizeOfFile += bytes;
+        job.pendingResults--;
+        postResultHeader(ri.worker);
+        checkJob(job);
+        break;
+      }
+      unsigned char *dest;
+      if (compressing)
+      {
+        dest = bufferPool.get(bytes);
+        job.results[ri.worker] = dest;
+        job.resultSizes[ri.worker] = bytes;
+        job.memory += bytes;
+        memoryFile(idFile, bytes);
+      }
+      else if (job.displacement[ri.worker] + bytes > job.uncompressedFileSize)
+      {
+        // Corrupted data: the message is received but discarded
+        std::fprintf(stderr, "Worker %d sent more data than expected for %s\n", workerRanks[ri.worker], FilesVector[idFile].filename.c_str());
+        success = false;
+        dest = bufferPool.get(bytes);
+        if (job.results.empty())
+          job.results.assign(numW, nullptr);
+        job.results[ri.worker] = dest;
       }
       else
       {
-        if (numberTasks > 0)
-        {
-          MPI_Isend((ptr + tot), sizeOfT * (numberTasks), MPI_UNSIGNED_CHAR, j + 1, idFile, MPI_COMM_WORLD, &rq_send[j]);
-          for (int z = 0; z < numberTasks; z++)
-          {
-            memcpy(&tempValue, ptr + tot + z * sizeOfT, sizeOfT);
-            bytesToSendForEachWorker[j] += tempValue;
-          }
-          tot += sizeOfT * (numberTasks);
-          numberOfBlocksForEachWorker[j] += numberTasks;
-          displacement[j + 1] = displacement[j] + (numberTasks)*BIGFILE_LOW_THRESHOLD;
-          sentMessages++;
-        }
+        dest = job.ptrFinal + job.displacement[ri.worker];
+        job.finalSizeOfFile += bytes;
       }
+      MPI_Request rq;
+      TraceSpan span("MPI_Irecv", bytes);
+      MPI_Irecv(dest, bytes, MPI_UNSIGNED_CHAR, workerRanks[ri.worker], TAG_RESULT_DATA, MPI_COMM_WORLD, &rq);
+      addRequest(rq, RESULT_DATA, ri.worker, idFile);
+      // Ready for the next result of this worker
+      postResultHeader(ri.worker);
+      break;
     }
-    // send to everyworker the chunks of data
-    for (int j = 0; j < numW; ++j)
+    case RESULT_DATA:
     {
-      MPI_Isend((ptr + tot), bytesToSendForEachWorker[j], MPI_UNSIGNED_CHAR, j + 1, idFile, MPI_COMM_WORLD, &rq_send[j]);
-      tot += bytesToSendForEachWorker[j];
+      FileJob &job = jobs[ri.idFile];
+      job.pendingResults--;
+      checkJob(job);
+      break;
     }
-
-    unsigned char *ptrFinal = new unsigned char[uncompressedFileSize + BIGFILE_LOW_THRESHOLD];
-    size_t finalSizeOfFile = 0;
-    for (int j = 0; j < sentMessages; ++j)
-    {
-      MPI_Request rq_recv;
-      MPI_Status status;
-      // Using the probe the master knows the offset in where put the uncompressed data in the vector
-      MPI_Probe(MPI_ANY_SOURCE, idFile, MPI_COMM_WORLD, &status);
-
-      int sourceReceived = status.MPI_SOURCE;
-      int split = numberOfBlocksForEachWorker[sourceReceived - 1] * BIGFILE_LOW_THRESHOLD;
-      MPI_Irecv(ptrFinal + displacement[sourceReceived - 1], split, MPI_UNSIGNED_CHAR, status.MPI_SOURCE, idFile, MPI_COMM_WORLD, &rq_recv);
-      // std::cout << "BIP4" << "\n";
-      MPI_Wait(&rq_recv, &status);
-      int countElements;
-      MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &countElements);
-      finalSizeOfFile += countElements;
     }
+  }
 
-    // Writing to the file from this point till the end of the function
-
-    const std::string infilename(FilesVector[idFile].filename);
-    std::string outfilename = infilename.substr(0, infilename.size() - 6);
+  void checkJob(FileJob &job)
+  {
+    if (job.pendingSends == 0 && job.pendingResults == 0)
+      finishJob(job);
+  }
 
-    // if the file exist in the directory it will add 1,2,3..
-    int a = 1;
-    std::string tempFileName = outfilename;
-    while (existsFile(tempFileName))
+  void finishJob(FileJob &job)
+  {
+    MemoryStage stage(STAGE_WRITE);
+    const size_t bytes = compressing ? FilesVector[job.idFile].size : job.uncompressedFileSize;
+    TraceSpan span("write", bytes);
+    StageCounters counters(STAGE_WRITE, bytes);
+    telemetryAdd(STAGE_WRITE, bytes, 0, 0);
+    if (oneSided)
     {
-      tempFileName = outfilename;
-      size_t pos = outfilename.find(".");
-      if (pos == std::string::npos)
-        tempFileName = outfilename + std::to_string(a);
+      MPI_Win_detach(dataWin, job.ptr);
+      MPI_Win_detach(dataWin, compressing ? job.output : job.ptrFinal);
+    }
+    if (compressing)
+    {
+      if (!writeCompressed(job))
+      {
+        std::fprintf(stderr, "Problems in the writing of the file.\n");
+        success = false;
+      }
+      if (oneSided)
+        delete[] job.output;
       else
-        tempFileName = tempFileName.insert(pos, std::to_string(a));
-      a++;
+      {
+        for (int j = 0; j < numW; ++j)
+          bufferPool.put(job.results[j]);
+      }
+    }
+    else
+    {
+      const std::string outfilename = decompressedFileName(FilesVector[job.idFile].filename);
+      if (!writeFile(outfilename, job.ptrFinal, job.finalSizeOfFile))
+        success = false;
+      delete[] job.ptrFinal;
+      for (size_t j = 0; j < job.results.size(); ++j)
+        bufferPool.put(job.results[j]);
+    }
+    unmapFile(job.ptr, FilesVector[job.idFile].size);
+    memoryFile(job.idFile, -(int64_t)FilesVector[job.idFile].size, true);
+    memoryFile(job.idFile, -(int64_t)job.memory);
+    jobs.erase(job.idFile);
+  }
+
+  // Each worker sends: number of blocks, size of each compressed block, compressed blocks
+  bool writeCompressed(FileJob &job)
+  {
+    size_t sizeOfT = sizeof(size_t);
+    //  Creation header
+    std::vector<size_t> header = {FilesVector[job.idFile].size, job.numberOfBlocks};
+    for (int j = 0; j < numW; ++j)
+    {
+      // write the length of each block in the header
+      if (job.results[j] != nullptr)
+      {
+        size_t nblocks;
+        memcpy(&nblocks, job.results[j], sizeOfT);
+        header.resize(header.size() + nblocks);
+        memcpy(header.data() + header.size() - nblocks, job.results[j] + sizeOfT, nblocks * sizeOfT);
+      }
     }
-    outfilename = tempFileName;
 
-    success = writeFile(outfilename, ptrFinal, finalSizeOfFile);
-    unmapFile(ptr, FilesVector[idFile].size);
-    delete[] ptrFinal;
+    std::string outfilename = std::string(FilesVector[job.idFile].filename) + SUFFIX;
+    FILE *pOutfile = fopen(outfilename.c_str(), "wb");
+    if (!pOutfile)
+    {
+      if (QUITE_MODE >= 1)
+      {
+        perror("fopen");
+        std::fprintf(stderr, "Failed opening output file %s!\n", outfilename.c_str());
+      }
+      return false;
+    }
+    bool ok = fwrite(header.data(), sizeOfT, header.size(), pOutfile) == header.size();
+    //  Write of the workers compressed data
+    for (int j = 0; j < numW && ok; ++j)
+    {
+      if (job.results[j] != nullptr)
+      {
+        size_t nblocks;
+        memcpy(&nblocks, job.results[j], sizeOfT);
+        size_t skip = sizeOfT * (nblocks + 1);
+        ok = fwrite(job.results[j] + skip, 1, job.resultSizes[j] - skip, pOutfile) == job.resultSizes[j] - skip;
+      }
+    }
+    if (!ok && QUITE_MODE >= 1)
+    {
+      perror("fwrite");
+      std::fprintf(stderr, "Failed writing to output file %s\n", outfilename.c_str());
+    }
+    if (fclose(pOutfile) != 0)
+      return false;
+    return ok;
   }
 
-  return true;
-}
+  const size_t maxJobsInFlight;
+  std::unordered_map<size_t, FileJob> jobs;
+  std::vector<MPI_Request> requests;
+  std::vector<RequestInfo> info;
+  std::vector<std::array<size_t, 2>> resultHeaders;
+};
 
 struct MultiInputHelperNode : ff::ff_minode_t<Task_t>
 {
@@ -441,164 +760,313 @@ struct L_Worker : ff_monode_t<Task_t>
   L_Worker(int myId, int numP)
       : myId(myId), numP(numP) {}
 
+  int svc_init()
+  {
+    pinThread(cpu);
+    traceThread("L_Worker");
+    return 0;
+  }
+
   Task_t *svc(Task_t *in)
   {
-    if (compressing) //***********COMPRESSING********
+    MemoryStage stage(STAGE_SPLIT);
+    // The helpers of a node get the tasks from the leader of the node, the others from the master
+    MPI_Comm comm = nodeHelper ? nodeComm : taskComm;
+    MPI_Status status;
+    int countElements;
+    unsigned char *ptrHeader;
+    // Each task is a header followed by the data, until the master sends the end message
+    while ((ptrHeader = recvTask(comm, MPI_ANY_TAG, status, countElements)) != nullptr)
     {
-      MPI_Status status;
-      MPI_Request rq_recv;
-      do
+      const size_t *header = (const size_t *)ptrHeader;
+      size_t idFile = header[0];
+      MPI_Aint dataAddress = header[1];
+      size_t numberOfSizes = header[2];
+      const size_t *sizes = header + 3;
+      size_t members = header[3 + numberOfSizes];
+      const size_t *parts = header + 4 + numberOfSizes;
+      if (oneSided)
       {
+        resultAddress[idFile] = parts[2];
+        resultCapacity[idFile] = parts[3];
+      }
 
-        // Using the probe to get the tag so we can get an estimation of the data to receive
-        MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+      unsigned char *ptrIN;
+      size_t slot = NO_SLOT;
+      if (nodeHelper)
+      {
+        // The data is in the memory of the node, or it follows if it didn't fit in a slot
+        slot = parts[PART_FIELDS];
+        size_t offset = parts[PART_FIELDS + 1];
+        if (slot != NO_SLOT)
+        {
+          MPI_Win_sync(nodeWindow.win);
+          ptrIN = nodeWindow.slot(slot) + offset;
+        }
+        else if (oneSided)
+        {
+          ptrIN = bufferPool.get(parts[0]);
+          getData(ptrIN, MPI_Aint_add(dataAddress, offset), parts[0]);
+        }
+        else
+          ptrIN = recvTask(nodeComm, TAG_TASK_DATA, status, countElements);
+      }
+      else if (members > 1)
+      {
+        // Leader of the node: the data of the whole node goes in the memory of the node
+        size_t size = 0;
+        for (size_t r = 0; r < members; ++r)
+          size += parts[PART_FIELDS * r];
+        ptrIN = recvIntoSlot(slot, dataAddress, size);
+        forwardToHelpers(header, ptrIN, slot);
+      }
+      else if (oneSided)
+      {
+        ptrIN = bufferPool.get(parts[0]);
+        getData(ptrIN, dataAddress, parts[0]);
+      }
+      else
+        ptrIN = recvTask(taskComm, TAG_TASK_DATA, status, countElements);
 
-        if (status.MPI_TAG == INT_MAX)
-          break;
+      // Our part is the first of the group
+      if (parts[0] > 0)
+        sendBlocks(idFile, ptrIN, parts[0], parts[1], sizes, slot);
+      else if (slot != NO_SLOT)
+        nodeWindow.readers[slot]--;
+      else
+        bufferPool.put(ptrIN);
+      bufferPool.put(ptrHeader);
+    }
+    // Stop the helpers of the node
+    if (nodeLeader)
+    {
+      int nodeSize;
+      MPI_Comm_size(nodeComm, &nodeSize);
+      for (int r = 1; r < nodeSize; ++r)
+        MPI_Send(NULL, 0, MPI_UNSIGNED_CHAR, r, TAG_END, nodeComm);
+    }
+    return EOS;
+  }
 
-        int mpitag = status.MPI_TAG;
-        //  Get an estimate of the data to recive
-        int estimation = FilesVector[mpitag].size / numW + BIGFILE_LOW_THRESHOLD * 2;
-        unsigned char *ptrIN = new unsigned char[estimation];
-        MPI_Irecv(ptrIN, estimation, MPI_UNSIGNED_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &rq_recv);
-        MPI_Wait(&rq_recv, &status);
-        int countElements;
-        MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &countElements);
+  // Splits the data in blocks and sends them to the Right Workers of Fast Flow all2all
+  void sendBlocks(size_t idFile, unsigned char *ptr, size_t infile_size, size_t numberOfBlocks, const size_t *sizes, size_t slot)
+  {
+    if (compressing) //***********COMPRESSING********
+    {
+      const size_t fullblocks = infile_size / BIGFILE_LOW_THRESHOLD;
+      const size_t partialblock = infile_size % BIGFILE_LOW_THRESHOLD;
 
-        size_t idFile = mpitag;
+      FilesVector[idFile].arrayOfPointers = new unsigned char *[numberOfBlocks];
+      FilesVector[idFile].sizeOfBlocks = new size_t[numberOfBlocks];
 
-        size_t infile_size = countElements;
-        size_t sizeOfT = sizeof(size_t);
+      for (size_t j = 0; j < fullblocks; ++j)
+      {
+        Task_t *t = taskPool.get();
+        t->blockid = j;
+        t->idFile = idFile;
+        t->nblocks = numberOfBlocks;
+        t->ptr = ptr;
+        t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * j;
+        t->size = infile_size;
+        t->cmp_size = BIGFILE_LOW_THRESHOLD;
+        t->slot = slot;
+        TraceSpan span("send", t->cmp_size);
+        telemetryAdd(STAGE_SPLIT, t->cmp_size, 0);
+        ff_send_out(t);
+      }
+      if (partialblock)
+      {
+        Task_t *t = taskPool.get();
+        t->blockid = fullblocks;
+        t->idFile = idFile;
+        t->nblocks = numberOfBlocks;
+        t->ptr = ptr;
+        t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * fullblocks;
+        t->size = infile_size;
+        t->cmp_size = partialblock;
+        t->slot = slot;
+        TraceSpan span("send", t->cmp_size);
+        telemetryAdd(STAGE_SPLIT, t->cmp_size, 0);
+        ff_send_out(t);
+      }
+    }
+    else //***********DECOMPRESSING********
+    {
+      FilesVector[idFile].numBlocks = numberOfBlocks;
+      FilesVector[idFile].sizeOfBlocks = new size_t[numberOfBlocks];
+      memcpy(FilesVector[idFile].sizeOfBlocks, sizes, sizeof(size_t) * numberOfBlocks);
+      FilesVector[idFile].compressedLength = infile_size;
 
-        unsigned char *ptr = ptrIN;
+      FilesVector[idFile].pointer = bufferPool.get(BIGFILE_LOW_THRESHOLD * numberOfBlocks);
+      size_t bytesRead = 0;
 
-        // The data is splitted in blocks and sent to the Right Workers of Fast Flow all2all
-        const size_t fullblocks = infile_size / BIGFILE_LOW_THRESHOLD;
-        const size_t partialblock = infile_size % BIGFILE_LOW_THRESHOLD;
-        size_t numberOfBlocks = fullblocks;
+      // Send blocks to the Right Workers of all2all
+      for (size_t j = 0; j < numberOfBlocks; ++j)
+      {
+        Task_t *t = taskPool.get();
+        t->blockid = j;
+        t->idFile = idFile;
+        t->nblocks = numberOfBlocks;
+        t->ptr = ptr;
+        t->ptrOut = FilesVector[idFile].pointer;
+        t->uncompreFileSize = BIGFILE_LOW_THRESHOLD * numberOfBlocks;
+        t->size = infile_size;
+        t->readBytes = bytesRead;
+        t->cmp_size = sizes[j];
+        t->slot = slot;
+        bytesRead = bytesRead + t->cmp_size;
+        TraceSpan span("send", t->cmp_size);
+        telemetryAdd(STAGE_SPLIT, t->cmp_size, 0);
+        ff_send_out(t);
+      }
+    }
+  }
 
-        if (partialblock)
-          numberOfBlocks++;
+  // One sided: gets size bytes at address in the memory of the master
+  void getData(unsigned char *ptr, MPI_Aint address, size_t size)
+  {
+    TraceSpan span("MPI_Get", size);
+    MPI_Get(ptr, size, MPI_UNSIGNED_CHAR, 0, address, size, MPI_UNSIGNED_CHAR, dataWin);
+    MPI_Win_flush(0, dataWin);
+  }
 
-        FilesVector[idFile].arrayOfPointers = new unsigned char *[numberOfBlocks];
-        FilesVector[idFile].sizeOfBlocks = new size_t[numberOfBlocks];
+  // Receives the data of the node (size bytes) in a free slot of the node window,
+  // in a buffer of the pool if it doesn't fit (slot is NO_SLOT)
+  unsigned char *recvIntoSlot(size_t &slot, MPI_Aint dataAddress, size_t size)
+  {
+    MPI_Message msg;
+    MPI_Status status;
+    if (!oneSided)
+    {
+      TraceSpan span("MPI_Mprobe");
+      MPI_Mprobe(0, TAG_TASK_DATA, taskComm, &msg, &status);
+    }
+    unsigned char *ptrIN;
+    if (size <= nodeWindow.slotSize)
+    {
+      // The slots are used in order, wait until the ranks of the node have finished with it
+      slot = nodeWindow.nextSlot;
+      nodeWindow.nextSlot = (slot + 1) % NodeWindow::SLOTS;
+      while (nodeWindow.readers[slot].load() != 0)
+        std::this_thread::yield();
+      ptrIN = nodeWindow.slot(slot);
+    }
+    else
+    {
+      slot = NO_SLOT;
+      ptrIN = bufferPool.get(size);
+    }
+    if (oneSided)
+      getData(ptrIN, dataAddress, size);
+    else
+    {
+      TraceSpan span("MPI_Mrecv", size);
+      MPI_Mrecv(ptrIN, size, MPI_UNSIGNED_CHAR, &msg, &status);
+    }
+    return ptrIN;
+  }
 
-        for (size_t j = 0; j < fullblocks; ++j)
-        {
-          Task_t *t = new Task_t;
-          t->blockid = j;
-          t->idFile = idFile;
-          t->nblocks = numberOfBlocks;
-          t->ptr = ptr;
-          t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * j;
-          t->size = infile_size;
-          t->cmp_size = BIGFILE_LOW_THRESHOLD;
-          ff_send_out(t);
-        }
-        if (partialblock)
-        {
-          Task_t *t = new Task_t;
-          t->blockid = fullblocks;
-          t->idFile = idFile;
-          t->nblocks = numberOfBlocks;
-          t->ptr = ptr;
-          t->ptrOut = ptr + BIGFILE_LOW_THRESHOLD * fullblocks;
-          t->size = infile_size;
-          t->cmp_size = partialblock;
-          ff_send_out(t);
-        }
-      } while (status.MPI_TAG != INT_MAX);
+  // Sends to each helper of the node its part: the position in the slot of the node,
+  // or the data itself if it didn't fit in a slot
+  void forwardToHelpers(const size_t *header, unsigned char *ptrIN, size_t slot)
+  {
+    size_t numberOfSizes = header[2];
+    size_t members = header[3 + numberOfSizes];
+    const size_t *parts = header + 4 + numberOfSizes;
+    if (slot != NO_SLOT)
+    {
+      long readers = 0;
+      for (size_t r = 0; r < members; ++r)
+        readers += parts[PART_FIELDS * r] > 0 ? 1 : 0;
+      // Our part is released like the others
+      nodeWindow.readers[slot] = readers + (parts[0] > 0 ? 0 : 1);
+      MPI_Win_sync(nodeWindow.win);
     }
-    else //***********DECOMPRESSING********
+    size_t offset = parts[0];
+    size_t firstBlock = parts[1];
+    for (size_t r = 1; r < members; ++r)
     {
-      MPI_Status status;
-      MPI_Request rq_recv;
-      size_t sizeOfT = sizeof(size_t);
-      do
+      const size_t *part = parts + PART_FIELDS * r;
+      size_t bytes = part[0];
+      size_t blocks = part[1];
+      if (bytes > 0)
       {
-        // Using the probe to get the tag so we can get an estimation of the data to receive
-        MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-
-        if (status.MPI_TAG == INT_MAX)
-          break;
-
-        int mpitag = status.MPI_TAG;
-        // If it is the first message coming from the master for that specific file
-        // The master will send us the number of compressed blocks with their specific length
-        if (FilesVector[mpitag].numBlocks == -1)
-        {
-          //  Get an estimate of the data to recive
-          int idFile = mpitag;
-          int estimation = (FilesVector[idFile].size * 3 / BIGFILE_LOW_THRESHOLD + 1) / numW;
-          estimation *= sizeOfT;
-          unsigned char *ptrIN = new unsigned char[estimation];
-          MPI_Irecv(ptrIN, estimation, MPI_UNSIGNED_CHAR, 0, idFile, MPI_COMM_WORLD, &rq_recv);
-          MPI_Wait(&rq_recv, &status);
-          int countElements;
-          MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &countElements);
-
-          FilesVector[idFile].numBlocks = countElements / sizeOfT;
-          FilesVector[idFile].sizeOfBlocks = new size_t[FilesVector[idFile].numBlocks];
-          for (int j = 0; j < FilesVector[idFile].numBlocks; ++j)
-          {
-            memcpy(&FilesVector[idFile].sizeOfBlocks[j], ptrIN + sizeOfT * j, sizeOfT);
-            // Used to get the exact estimation in the else branch
-            FilesVector[idFile].compressedLength += FilesVector[idFile].sizeOfBlocks[j];
-          }
-        }
-        else
-        {
-          int idFile = mpitag;
-          int estimation = FilesVector[idFile].compressedLength;
-          unsigned char *ptrDe = new unsigned char[estimation];
-          MPI_Irecv(ptrDe, estimation, MPI_UNSIGNED_CHAR, 0, idFile, MPI_COMM_WORLD, &rq_recv);
-          MPI_Wait(&rq_recv, &status);
-          FilesVector[idFile].pointer = new unsigned char[BIGFILE_LOW_THRESHOLD * FilesVector[idFile].numBlocks];
-          size_t bytesRead = 0;
-
-          // Send blocks to the Right Workers of all2all
-          for (size_t j = 0; j < FilesVector[idFile].numBlocks; ++j)
-          {
-            Task_t *t = new Task_t();
-            t->blockid = j;
-            t->idFile = idFile;
-            t->nblocks = FilesVector[idFile].numBlocks;
-            t->ptr = ptrDe;
-            t->ptrOut = FilesVector[idFile].pointer;
-            t->uncompreFileSize = BIGFILE_LOW_THRESHOLD * FilesVector[idFile].numBlocks;
-            t->size = FilesVector[idFile].compressedLength;
-            t->readBytes = bytesRead;
-            memcpy(&t->cmp_size, &FilesVector[idFile].sizeOfBlocks[j], sizeof(size_t));
-            bytesRead = bytesRead + t->cmp_size;
-            ff_send_out(t);
-          }
-        }
+        std::vector<size_t> helperHeader = {header[0], header[1], numberOfSizes ? blocks : 0};
+        if (numberOfSizes)
+          helperHeader.insert(helperHeader.end(), header + 3 + firstBlock, header + 3 + firstBlock + blocks);
+        helperHeader.push_back(1);
+        helperHeader.insert(helperHeader.end(), part, part + PART_FIELDS);
+        helperHeader.insert(helperHeader.end(), {slot, offset});
+        TraceSpan span("MPI_Send", slot == NO_SLOT && !oneSided ? bytes : 0);
+        MPI_Send(helperHeader.data(), helperHeader.size() * sizeof(size_t), MPI_UNSIGNED_CHAR, r, TAG_TASK_HEADER, nodeComm);
+        // With -R the helper gets the data from the master
+        if (slot == NO_SLOT && !oneSided)
+          MPI_Send(ptrIN + offset, bytes, MPI_UNSIGNED_CHAR, r, TAG_TASK_DATA, nodeComm);
+      }
+      offset += bytes;
+      firstBlock += blocks;
+    }
+  }
 
-      } while (status.MPI_TAG != INT_MAX);
+  // Receives the next message with the given tag, in a buffer of the pool of exactly
+  // the size of the message. Returns nullptr when the end message is received.
+  unsigned char *recvTask(MPI_Comm comm, int tag, MPI_Status &status, int &countElements)
+  {
+    MPI_Message msg;
+    {
+      TraceSpan span("MPI_Mprobe");
+      MPI_Mprobe(0, tag, comm, &msg, &status);
     }
-    return EOS;
+    if (status.MPI_TAG == TAG_END)
+    {
+      MPI_Mrecv(NULL, 0, MPI_UNSIGNED_CHAR, &msg, &status);
+      return nullptr;
+    }
+    MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &countElements);
+    unsigned char *ptrIN = bufferPool.get(countElements);
+    TraceSpan span("MPI_Mrecv", countElements);
+    MPI_Mrecv(ptrIN, countElements, MPI_UNSIGNED_CHAR, &msg, &status);
+    return ptrIN;
   }
+
   int myId;
   int numP;
+  int cpu = -1; // --pin/--numa: CPU of the thread
 };
 struct R_Worker : ff_minode_t<Task_t>
 { // must be multi-input
+  R_Worker(size_t id) : id(id) {}
+
+  int svc_init()
+  {
+    pinThread(cpu);
+    traceThread("R_Worker " + std::to_string(id));
+    countersThread();
+    return 0;
+  }
+
   Task_t *svc(Task_t *in)
   {
+    MemoryStage stage(compressing ? STAGE_COMPRESS : STAGE_DECOMPRESS);
     // SendToWriter
     // printTask(in);
     if (compressing) //***********COMPRESSING********
     {
 
+      TraceSpan span("compress", in->cmp_size);
+      StageCounters counters(STAGE_COMPRESS, in->cmp_size);
       size_t estimation = compressBound(in->cmp_size);
-      unsigned char *ptrCompress = new unsigned char[estimation];
+      unsigned char *ptrCompress = blockPool.get();
       if (compress((ptrCompress), &estimation, in->ptrOut, in->cmp_size) != Z_OK)
       {
         if (QUITE_MODE >= 1)
           std::fprintf(stderr, "Failed to compress file in memory\n");
         success = false;
+        blockPool.put(ptrCompress);
+        taskPool.put(in);
         return GO_ON;
       }
+      telemetryAdd(STAGE_COMPRESS, in->cmp_size, estimation);
       in->cmp_size = estimation;
       in->ptrOut = ptrCompress;
       ff_send_out(in);
@@ -607,24 +1075,41 @@ struct R_Worker : ff_minode_t<Task_t>
     {
       // The decompression is done in the same unsigned char *, each worker won't touch the other's memory
       size_t cmp_len = BIGFILE_LOW_THRESHOLD;
+      TraceSpan span("decompress", cmp_len);
+      StageCounters counters(STAGE_DECOMPRESS, cmp_len);
       if (mz_uncompress((in->ptrOut + in->blockid * BIGFILE_LOW_THRESHOLD), &cmp_len, (const unsigned char *)(in->ptr + in->readBytes), in->cmp_size) != MZ_OK)
       {
         if (QUITE_MODE >= 1)
           std::fprintf(stderr, "Failed to decompress file in memory\n");
         success = false;
+        taskPool.put(in);
         return GO_ON;
       }
+      telemetryAdd(STAGE_DECOMPRESS, in->cmp_size, cmp_len);
       in->cmp_size = cmp_len;
       ff_send_out(in);
     }
     return GO_ON;
   }
+
+  const size_t id;
+  int cpu = -1; // --pin/--numa: CPU of the thread
 };
 
 struct Gatherer : ff_minode_t<Task_t>
 {
+  int svc_init()
+  {
+    pinThread(cpu);
+    traceThread("Gatherer");
+    return 0;
+  }
+
   Task_t *svc(Task_t *in)
   {
+    MemoryStage stage(STAGE_WRITE);
+    // the "write" stage of a worker are the blocks gathered and the results sent to the master
+    telemetryAdd(STAGE_WRITE, 0, 0);
     if (compressing)
     {
       size_t idFile = in->idFile;
@@ -640,7 +1125,8 @@ struct Gatherer : ff_minode_t<Task_t>
         // WRITE TO MASTER
         size_t sizeOfT = sizeof(size_t);
         size_t numberOfBlocks = in->nblocks;
-        unsigned char *ptrToSend = new unsigned char[(sizeOfT * (in->nblocks + 1) + FilesVector[idFile].compressedLength)];
+        TraceSpan span("gather", FilesVector[idFile].compressedLength);
+        unsigned char *ptrToSend = bufferPool.get(sizeOfT * (in->nblocks + 1) + FilesVector[idFile].compressedLength);
         memcpy(ptrToSend, &numberOfBlocks, sizeOfT);
 
         memcpy((ptrToSend + sizeOfT), FilesVector[idFile].sizeOfBlocks, sizeOfT * in->nblocks);
@@ -650,16 +1136,15 @@ struct Gatherer : ff_minode_t<Task_t>
           memcpy(ptrToSend + tot, FilesVector[idFile].arrayOfPointers[i], FilesVector[idFile].sizeOfBlocks[i]);
           tot += FilesVector[idFile].sizeOfBlocks[i];
         }
-        MPI_Request rq_send;
-        MPI_Isend(ptrToSend, tot, MPI_UNSIGNED_CHAR, 0, idFile, MPI_COMM_WORLD, &rq_send);
-        FilesVector[idFile].pointer = ptrToSend;
-        for (int i = 0; i < in->nblocks; ++i)
-          // Cleaning memory
-          for (size_t i = 0; i < in->nblocks; ++i)
-          {
-            delete FilesVector[idFile].arrayOfPointers[i];
-          }
-        delete FilesVector[idFile].sizeOfBlocks;
+        sendToMaster(ptrToSend, tot, idFile);
+        // Cleaning memory, the input data and the blocks go back to the pools
+        for (size_t i = 0; i < in->nblocks; ++i)
+        {
+          blockPool.put(FilesVector[idFile].arrayOfPointers[i]);
+        }
+        delete[] FilesVector[idFile].arrayOfPointers;
+        delete[] FilesVector[idFile].sizeOfBlocks;
+        releaseInput(in);
       }
     }
     else
@@ -672,60 +1157,298 @@ struct Gatherer : ff_minode_t<Task_t>
 
       if (val >= in->nblocks - 1)
       {
-        MPI_Request rq_send;
-        MPI_Status status;
         // Send BLOCK
-        MPI_Isend(FilesVector[idFile].pointer, FilesVector[idFile].uncompressedLength, MPI_UNSIGNED_CHAR, 0, idFile, MPI_COMM_WORLD, &rq_send);
-        MPI_Wait(&rq_send, &status);
+        sendToMaster(FilesVector[idFile].pointer, FilesVector[idFile].uncompressedLength, idFile);
+        delete[] FilesVector[idFile].sizeOfBlocks;
+        releaseInput(in);
       }
     }
+    taskPool.put(in);
+    recycleSends(false);
     return GO_ON;
   }
+
+  void svc_end()
+  {
+    recycleSends(true);
+  }
+
+  int cpu = -1; // --pin/--numa: CPU of the thread
+
+  // Sends the header (id of the file, size) and the result,
+  // the buffers go back to the pool when the sends are completed
+  void sendToMaster(unsigned char *ptr, size_t size, size_t idFile)
+  {
+    telemetryAdd(STAGE_WRITE, size, size, 0);
+    MPI_Request rq_send;
+    // One sided: the result goes in its place in the master before the header is sent
+    if (oneSided)
+    {
+      if (size <= resultCapacity[idFile])
+      {
+        TraceSpan span("MPI_Put", size);
+        MPI_Put(ptr, size, MPI_UNSIGNED_CHAR, 0, resultAddress[idFile], size, MPI_UNSIGNED_CHAR, dataWin);
+        MPI_Win_flush(0, dataWin);
+      }
+      bufferPool.put(ptr);
+    }
+    unsigned char *ptrHeader = bufferPool.get(2 * sizeof(size_t));
+    memcpy(ptrHeader, &idFile, sizeof(size_t));
+    memcpy(ptrHeader + sizeof(size_t), &size, sizeof(size_t));
+    MPI_Isend(ptrHeader, 2 * sizeof(size_t), MPI_UNSIGNED_CHAR, 0, TAG_RESULT_HEADER, MPI_COMM_WORLD, &rq_send);
+    pendingSends.emplace_back(rq_send, ptrHeader);
+    if (!oneSided)
+    {
+      TraceSpan span("MPI_Isend", size);
+      MPI_Isend(ptr, size, MPI_UNSIGNED_CHAR, 0, TAG_RESULT_DATA, MPI_COMM_WORLD, &rq_send);
+      pendingSends.emplace_back(rq_send, ptr);
+    }
+  }
+
+  // Gives back to the pool the buffers of the completed sends, if wait it waits for all of them
+  void recycleSends(bool wait)
+  {
+    for (size_t i = 0; i < pendingSends.size();)
+    {
+      int done = 1;
+      if (wait)
+        MPI_Wait(&pendingSends[i].first, MPI_STATUS_IGNORE);
+      else
+        MPI_Test(&pendingSends[i].first, &done, MPI_STATUS_IGNORE);
+      if (done)
+      {
+        bufferPool.put(pendingSends[i].second);
+        pendingSends[i] = pendingSends.back();
+        pendingSends.pop_back();
+      }
+      else
+        ++i;
+    }
+  }
+
+  std::vector<std::pair<MPI_Request, unsigned char *>> pendingSends;
 };
-static inline bool mpiWorker(int myId, int numP, int numberOfWorkers)
+// Size of a slot of the node window: the biggest part of a file that the leader can receive
+// for the whole node. In decompression the part depends on the compressed blocks, so the
+// whole file is used. Bigger parts are sent through messages.
+static inline size_t computeSlotSize(int nodeSize)
 {
-  // Each worker has a all to all inside
-  unsigned long long array[MAX_FILES_IN_DIRECTORY];
-  MPI_Status status;
-  MPI_Status statusProbe;
-  int numberOfFiles = 0;
-  MPI_Request rq_recv;
-  MPI_Irecv(array, MAX_FILES_IN_DIRECTORY * sizeof(MPI_UNSIGNED_LONG_LONG), MPI_UNSIGNED_LONG_LONG, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &rq_recv);
-  MPI_Wait(&rq_recv, &status);
-  MPI_Get_count(&status, MPI_UNSIGNED_LONG_LONG, &numberOfFiles);
+  int workers = numP - 1 + (workingMaster ? 1 : 0);
+  size_t slotSize = 0;
+  for (size_t i = 0; i < FilesVector.size(); ++i)
+  {
+    size_t size = FilesVector[i].size;
+    if (size <= BIGFILE_LOW_THRESHOLD)
+      continue;
+    if (compressing)
+    {
+      size_t fullblocks = size / BIGFILE_LOW_THRESHOLD;
+      size = std::min(size, (fullblocks * nodeSize / workers + 2) * BIGFILE_LOW_THRESHOLD);
+    }
+    slotSize = std::max(slotSize, size);
+  }
+  return std::min(slotSize, NodeWindow::MAX_SLOT_SIZE);
+}
 
-  for (int i = 0; i < numberOfFiles; ++i)
+// Finds the ranks of each node. In hierarchical mode the ranks of a node (except the node of the master)
+// get the data through the leader of the node, which receives it in the shared memory of the node.
+// The master gets the position of every rank and builds the list of the workers.
+static inline void setupTopology()
+{
+  int nodeRank = 0;
+  int nodeLeaderRank = myId;
+  if (hierarchical)
   {
-    FilesVector.emplace_back("a", array[i]);
-    vectorOfCounters.emplace_back(0);
+    int nodeSize;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myId, MPI_INFO_NULL, &nodeComm);
+    // To try the hierarchical mode on one machine, the node can be split in smaller nodes
+    const char *ranksPerNode = getenv("MINIZIP_RANKS_PER_NODE");
+    if (ranksPerNode != nullptr && atoi(ranksPerNode) > 0)
+    {
+      MPI_Comm subComm;
+      MPI_Comm_rank(nodeComm, &nodeRank);
+      MPI_Comm_split(nodeComm, nodeRank / atoi(ranksPerNode), nodeRank, &subComm);
+      MPI_Comm_free(&nodeComm);
+      nodeComm = subComm;
+    }
+    MPI_Comm_rank(nodeComm, &nodeRank);
+    MPI_Comm_size(nodeComm, &nodeSize);
+    MPI_Bcast(&nodeLeaderRank, 1, MPI_INT, 0, nodeComm);
+
+    // The ranks on the node of the master get the data directly from the master
+    bool masterNode = nodeLeaderRank == 0;
+    nodeLeader = !masterNode && nodeRank == 0 && nodeSize > 1;
+    nodeHelper = !masterNode && nodeRank > 0;
+
+    // Every rank of the node needs the size of the slots to find them
+    unsigned long long slotSize = nodeLeader ? computeSlotSize(nodeSize) : 0;
+    MPI_Bcast(&slotSize, 1, MPI_UNSIGNED_LONG_LONG, 0, nodeComm);
+    MPI_Aint windowSize = nodeLeader ? NodeWindow::HEADER + NodeWindow::SLOTS * slotSize : 0;
+    unsigned char *myMemory;
+    MPI_Win_allocate_shared(windowSize, 1, MPI_INFO_NULL, nodeComm, &myMemory, &nodeWindow.win);
+    MPI_Aint leaderSize;
+    int dispUnit;
+    MPI_Win_shared_query(nodeWindow.win, 0, &leaderSize, &dispUnit, &nodeWindow.base);
+    nodeWindow.slotSize = slotSize;
+    nodeWindow.readers = (std::atomic<long> *)nodeWindow.base;
+    if (nodeLeader)
+    {
+      for (size_t s = 0; s < NodeWindow::SLOTS; ++s)
+        new (&nodeWindow.readers[s]) std::atomic<long>(0);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, nodeWindow.win);
+    MPI_Barrier(nodeComm);
   }
 
-  int countElements;
+  // One sided: the master attaches the files in flight to dataWin
+  if (oneSided)
+  {
+    resultAddress.assign(FilesVector.size(), 0);
+    resultCapacity.assign(FilesVector.size(), 0);
+    MPI_Win_create_dynamic(MPI_INFO_NULL, MPI_COMM_WORLD, &dataWin);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, dataWin);
+  }
+
+  int position[2] = {nodeLeaderRank, nodeRank};
+  std::vector<int> topology(2 * numP);
+  MPI_Gather(position, 2, MPI_INT, topology.data(), 2, MPI_INT, 0, MPI_COMM_WORLD);
+  if (myId != 0)
+    return;
+
+  // The ranks are ordered by node, the helpers of a node are in the group of their leader
+  std::vector<int> order(numP);
+  for (int r = 0; r < numP; ++r)
+    order[r] = r;
+  std::stable_sort(order.begin(), order.end(), [&topology](int a, int b)
+                   { return topology[2 * a] < topology[2 * b]; });
+  for (int r : order)
+  {
+    if (r == 0 && !workingMaster)
+      continue;
+    bool helper = hierarchical && topology[2 * r] != 0 && topology[2 * r + 1] > 0;
+    if (helper)
+      groups.back().push_back(workerRanks.size());
+    else
+      groups.push_back({(int)workerRanks.size()});
+    workerRanks.push_back(r);
+  }
+  numW = workerRanks.size();
+}
+
+static inline void freeTopology()
+{
+  if (oneSided)
+  {
+    MPI_Win_unlock_all(dataWin);
+    MPI_Win_free(&dataWin);
+  }
+  if (hierarchical)
+  {
+    MPI_Win_unlock_all(nodeWindow.win);
+    MPI_Win_free(&nodeWindow.win);
+    MPI_Comm_free(&nodeComm);
+  }
+}
+
+// The master writes the events of all the ranks in one trace, a process per rank
+static inline bool gatherTrace(const std::string &traceFile)
+{
+  const std::string events = traceEvents(myId, "rank " + std::to_string(myId));
+  int length = events.size();
+  std::vector<int> lengths(numP), displs(numP, 0);
+  MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+  std::string all;
+  if (myId == 0)
+  {
+    for (int r = 1; r < numP; ++r)
+      displs[r] = displs[r - 1] + lengths[r - 1] + 1;
+    // the events of the ranks separated by commas
+    all.assign(displs[numP - 1] + lengths[numP - 1], ',');
+  }
+  MPI_Gatherv(events.data(), length, MPI_CHAR, all.data(), lengths.data(), displs.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+  return myId != 0 || traceWrite(traceFile, all);
+}
+
+// The master prints the counters of the stages summed over all the ranks
+static inline void reduceCounters()
+{
+  CounterTotals totals[STAGES];
+  bool available[COUNTERS];
+  countersTotals(totals, available);
+  std::vector<unsigned long long> values;
+  for (int s = 0; s < STAGES; ++s)
+  {
+    values.push_back(totals[s].bytes);
+    values.insert(values.end(), totals[s].value, totals[s].value + COUNTERS);
+  }
+  std::vector<int> opened(available, available + COUNTERS);
+  std::vector<unsigned long long> sums(values.size());
+  std::vector<int> anyOpened(COUNTERS);
+  MPI_Reduce(values.data(), sums.data(), values.size(), MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(opened.data(), anyOpened.data(), COUNTERS, MPI_INT, MPI_LOR, 0, MPI_COMM_WORLD);
+  if (myId != 0)
+    return;
+  for (int s = 0; s < STAGES; ++s)
+  {
+    totals[s].bytes = sums[s * (COUNTERS + 1)];
+    for (int k = 0; k < COUNTERS; ++k)
+      totals[s].value[k] = sums[s * (COUNTERS + 1) + 1 + k];
+  }
+  for (int k = 0; k < COUNTERS; ++k)
+    available[k] = anyOpened[k] != 0;
+  printCounters(totals, available);
+}
+
+// The master prints the peaks of each rank, and the memory of the files it has sent
+static inline void gatherMemory()
+{
+  memoryStop();
+  MemoryPeaks peaks = memoryPeaks();
+  std::vector<MemoryPeaks> all(myId == 0 ? numP : 0);
+  const int count = sizeof(MemoryPeaks) / sizeof(double);
+  MPI_Gather(&peaks, count, MPI_DOUBLE, all.data(), count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  if (myId != 0)
+    return;
+  for (int r = 0; r < numP; ++r)
+    printMemoryPeaks(all[r], "rank " + std::to_string(r));
+  std::vector<std::string> names;
+  for (auto &f : FilesVector)
+    names.push_back(f.filename);
+  printMemoryFiles(names);
+}
+
+// placement is nullptr if the threads are not pinned
+static inline bool mpiWorker(int myId, int numP, int numberOfWorkers, const Placement *placement)
+{
+  // Each worker has a all to all inside
   //Creation of All to All
   std::vector<ff_node *> LW;
   std::vector<ff_node *> RW;
 
   size_t Rw = numberOfWorkers;
-  LW.push_back(new L_Worker(myId, numP));
+  L_Worker *lw = new L_Worker(myId, numP);
+  Gatherer *gatherer = new Gatherer;
+  if (placement)
+    lw->cpu = gatherer->cpu = placement->cpuL[0];
+  LW.push_back(lw);
 
   for (size_t i = 0; i < Rw; ++i)
-    RW.push_back(new R_Worker);
+  {
+    R_Worker *rw = new R_Worker(i);
+    if (placement)
+      rw->cpu = placement->cpuR[i];
+    RW.push_back(rw);
+  }
 
   // Adding Lworkers and Rworkers to a2a
   ff_a2a a2a;
   a2a.add_firstset(LW);
   a2a.add_secondset(RW);
-  ff_Pipe<> pipe(a2a, new Gatherer);
+  ff_Pipe<> pipe(a2a, gatherer);
   if (pipe.run_and_wait_end() < 0)
   {
     error("running a2a\n");
-    return -1;
-  }
-
-  // delete all the allocated memory
-  for (int i = 0; i < FilesVector.size(); ++i)
-  {
-    delete FilesVector[i].pointer;
+    return false;
   }
 
   return true;
@@ -755,10 +1478,7 @@ int main(int argc, char *argv[])
   MPI_Comm_rank(MPI_COMM_WORLD, &myId);
   MPI_Comm_size(MPI_COMM_WORLD, &numP);
 
-  if (workingMaster)
-    numW = numP;
-  else
-    numW = numP - 1;
+  numW = numP - 1;
   if (argc < 4)
   {
     usage(argv[0]);
@@ -777,6 +1497,57 @@ int main(int argc, char *argv[])
 
   double start_time = MPI_Wtime();
   const size_t Rw = std::stol(argv[3]);
+  // enough idle buffers for the blocks in flight
+  blockPool.init(compressBound(BIGFILE_LOW_THRESHOLD), std::max<size_t>(64, 4 * (Rw + 1)));
+  taskPool.init(4096);
+  workingMaster = hasOption(argv + 4, argv + argc, "-m");
+  hierarchical = hasOption(argv + 4, argv + argc, "-H");
+  // With only one process there is no one to share the memory with (and no RMA support in MPI)
+  oneSided = hasOption(argv + 4, argv + argc, "-R") && numP > 1;
+
+  // The ranks on the same node share its CPUs (with --numa each rank gets a NUMA node)
+  const bool numa = hasOption(argv + 4, argv + argc, "--numa");
+  const bool pin = numa || hasOption(argv + 4, argv + argc, "--pin");
+  Placement placement(numa);
+  if (pin)
+  {
+    MPI_Comm localComm;
+    int localRank, localSize;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myId, MPI_INFO_NULL, &localComm);
+    MPI_Comm_rank(localComm, &localRank);
+    MPI_Comm_size(localComm, &localSize);
+    MPI_Comm_free(&localComm);
+    placement.share(localRank, localSize);
+    placement.plan(1, Rw);
+  }
+  MPI_Comm_dup(MPI_COMM_WORLD, &taskComm);
+  // --trace FILE: absolute, walkDirMpi changes the current directory. The ranks start the
+  // trace together so their timelines have the same origin.
+  const char *traceOption = getOption(argv + 4, argv + argc, "--trace");
+  const std::string traceFile = traceOption != nullptr ? std::filesystem::absolute(traceOption).string() : "";
+  if (!traceFile.empty())
+  {
+    MPI_Barrier(MPI_COMM_WORLD);
+    traceStart();
+  }
+  countersEnabled = hasOption(argv + 4, argv + argc, "--counters");
+  // --progress [SECONDS] and --metrics FILE|unix:PATH, each rank has its own reporter
+  const bool progress = hasOption(argv + 4, argv + argc, "--progress");
+  const char *interval = getOption(argv + 4, argv + argc, "--progress");
+  const char *metricsOption = getOption(argv + 4, argv + argc, "--metrics");
+  const std::string metrics = metricsOption == nullptr ? "" : metricsPath(metricsOption, myId ? "." + std::to_string(myId) : "");
+  TelemetryReporter reporter(interval != nullptr && interval[0] != '-' ? std::atof(interval) : 2.0, progress, metrics,
+                             numP > 1 ? "rank " + std::to_string(myId) : "", myId == 0 ? numP : 0);
+  if ((progress || !metrics.empty()) && !reporter.start())
+  {
+    MPI_Abort(MPI_COMM_WORLD, -1);
+    return -1;
+  }
+
+  // --memory [MS]: the master starts it when it knows the files, for memoryFile
+  const bool memory = hasOption(argv + 4, argv + argc, "--memory") && memoryAvailable("MPI_minizip", myId == 0);
+  const char *sampling = getOption(argv + 4, argv + argc, "--memory");
+  const double samplingMs = sampling != nullptr && sampling[0] != '-' ? std::atof(sampling) : 10.0;
 
   struct stat statbuf;
   bool dir = false;
@@ -803,61 +1574,90 @@ int main(int argc, char *argv[])
     }
 
     size_t sizeVector = FilesVector.size();
-    unsigned long long arrayToSend[sizeVector];
 
     // Send the size of each file to every worker
     //------------------------------------------
-    for (int i = 0; i < sizeVector; ++i)
     {
-      arrayToSend[i] = FilesVector[i].size;
-      if (arrayToSend[i] != FilesVector[i].size)
-      {
-        //  std::cout << "NOT EQUAL NOT EQUAL NOT EQUAL FILESVECTOR ARRAY TO SEND" << "\n";
-      }
+      std::vector<unsigned long long> sizes(sizeVector);
+      for (size_t i = 0; i < sizeVector; ++i)
+        sizes[i] = FilesVector[i].size;
+      bcastFileSizes(sizes);
     }
-    MPI_Request rq_sendBEGINNING[numP];
-    for (int i = 1; i < numP; ++i)
+    //------------------------------------------
+    setupTopology();
+    vectorOfCounters.assign(sizeVector, 0);
+    if (memory)
+      memoryStart(sizeVector, samplingMs);
+
+    // In case the files are very small we just do it locally
+    std::vector<size_t> bigFiles;
+    std::vector<size_t> smallFiles;
+    for (size_t i = 0; i < sizeVector; ++i)
     {
-      MPI_Isend(arrayToSend, sizeVector, MPI_UNSIGNED_LONG_LONG, i, 0, MPI_COMM_WORLD, &rq_sendBEGINNING[i]);
+      if (FilesVector[i].size > BIGFILE_LOW_THRESHOLD && numW > 0)
+        bigFiles.push_back(i);
+      else
+        smallFiles.push_back(i);
     }
 
-    //------------------------------------------
-#pragma omp parallel for
-    for (int i = 0; i < sizeVector; ++i)
+    // One thread sends the big files to the workers and receives the results
+    std::thread progress([&bigFiles]()
+                         {
+      MasterEngine engine(std::max(4, 2 * numW));
+      engine.run(bigFiles);
+      // Send messages to the workers to stop them, the leaders stop the ranks of their node
+      for (auto &group : groups)
+        MPI_Send(NULL, 0, MPI_UNSIGNED_CHAR, workerRanks[group[0]], TAG_END, taskComm); });
+    // With -m the master runs its own farm on the blocks of the big files
+    std::thread farm;
+    if (workingMaster)
+      farm = std::thread([Rw, pin, &placement]()
+                         { success &= mpiWorker(myId, numP, Rw, pin ? &placement : nullptr); });
+
+    // In the meantime the other threads process the small files
+#pragma omp parallel for schedule(dynamic)
+    for (size_t k = 0; k < smallFiles.size(); ++k)
     {
-      if (FilesVector[i].size > BIGFILE_LOW_THRESHOLD)
-      {
-        if (compressing)
-        {
-          mpiMasterCompressing(i, numP);
-        }
-        else
-        {
-
-          mpiMasterDecompressing(i, numP);
-        }
-      }
-      else // In case the files are very small we just do it locally
+      size_t i = smallFiles[k];
+      traceThread("OpenMP " + std::to_string(omp_get_thread_num()));
+      TraceSpan span(compressing ? "compress file" : "decompress file", FilesVector[i].size);
+      MemoryStage stage(compressing ? STAGE_COMPRESS : STAGE_DECOMPRESS);
+      telemetryAdd(compressing ? STAGE_COMPRESS : STAGE_DECOMPRESS, FilesVector[i].size, 0, 0);
+      if (compressing)
+        compressFile(FilesVector[i].filename.c_str(), FilesVector[i].size, 0);
+      else if (plainArchive(FilesVector[i].filename, FilesVector[i].size))
+        decompressFile(FilesVector[i].filename.c_str(), FilesVector[i].size, 0);
+      else
       {
-        if (compressing)
-          compressFile(FilesVector[i].filename.c_str(), FilesVector[i].size, 0);
-        else
-          decompressFile(FilesVector[i].filename.c_str(), FilesVector[i].size, 0);
+#pragma omp atomic write
+        success = false;
       }
     }
-
-    // Send messages to the workers to stop them
-    MPI_Request rq_end[numP];
-    MPI_Status rq_end_status[numP];
-    for (int j = 1; j < numP; ++j)
-    {
-      MPI_Isend(NULL, 0, MPI_UNSIGNED_CHAR, j % (numP - 1) + 1, INT_MAX, MPI_COMM_WORLD, &rq_end[j]);
-    }
+    progress.join();
+    if (farm.joinable())
+      farm.join();
   }
   else // Handle the workers
   {
-    mpiWorker(myId, numP, Rw);
+    std::vector<unsigned long long> sizes;
+    bcastFileSizes(sizes);
+    for (size_t i = 0; i < sizes.size(); ++i)
+      FilesVector.push_back(FileStruct("", sizes[i]));
+    vectorOfCounters.assign(sizes.size(), 0);
+    setupTopology();
+    if (memory)
+      memoryStart(0, samplingMs);
+    mpiWorker(myId, numP, Rw, pin ? &placement : nullptr);
   }
+  reporter.stop();
+  freeTopology();
+  MPI_Comm_free(&taskComm);
+  if (!traceFile.empty())
+    success &= gatherTrace(traceFile);
+  if (countersEnabled)
+    reduceCounters();
+  if (memory)
+    gatherMemory();
   if (!success)
 
   // END
@@ -3,10 +3,13 @@
 static inline void usage(const char *argv0)
 {
     printf("--------------------\n");
-    printf("Usage: %s c|d|C|D file-or-directory\n", argv0);
+    printf("Usage: %s c|d|C|D file-or-directory [-i]\n", argv0);
     printf("\nModes:\n");
     printf("c - Compresses file infile to a zlib stream into outfile\n");
     printf("d - Decompress a zlib stream from infile into outfile\n");
+    printf("\nOptions:\n");
+    printf("-i - Incremental: compresses only the files of the directory changed since the previous run\n");
+    printf("     (listed in %s in the directory)\n", MANIFEST_NAME);
     printf("--------------------\n");
 }
 
@@ -18,7 +21,7 @@ int main(int argc, char *argv[])
         return -1;
     }
     const char *pMode = argv[1];
-    --argc;
+    const char *path = argv[2];
     if (!strchr("cCdD", pMode[0]))
     {
         printf("Invalid option!\n\n");
@@ -32,20 +35,32 @@ int main(int argc, char *argv[])
 
     bool success = true;
     struct stat statbuf;
-    if (stat(argv[argc], &statbuf) == -1)
+    if (stat(path, &statbuf) == -1)
     {
         perror("stat");
-        fprintf(stderr, "Error: stat %s\n", argv[argc]);
+        fprintf(stderr, "Error: stat %s\n", path);
         return -1;
     }
     bool dir = false;
     if (S_ISDIR(statbuf.st_mode))
     {
-        success &= walkDir(argv[argc], compress);
+        const bool incremental = compress && hasOption(argv + 3, argv + argc, "-i");
+        Manifest manifest(path, SUFFIX);
+        if (incremental && !manifest.load())
+        {
+            fprintf(stderr, "Error: cannot read the manifest in %s\n", path);
+            return -1;
+        }
+        success &= walkDir(path, compress, incremental ? &manifest : nullptr);
+        if (incremental)
+        {
+            printf("Incremental: %zu files compressed, %zu unchanged\n", manifest.added(), manifest.kept());
+            success &= manifest.save();
+        }
     }
     else
     {
-        success &= doWork(argv[argc], statbuf.st_size, compress);
+        success &= doWork(path, statbuf.st_size, compress);
     }
 
     if (!success)
@@ -0,0 +1,580 @@
+#include <spawn.h>
+#include <sys/wait.h>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility.hpp>
+
+extern char **environ;
+
+// Local benchmark of the engines: generates a corpus, compresses and decompresses it with each
+// configuration of the sweep, checks that the files come back equal and writes the median of
+// the times in the r,ct layout of CSV_FOLDER (one file for each engine, mode and L-Workers or
+// ranks), with all the samples in bench.json. With --baseline the results are compared with
+// the CSV files of a previous run, and a slower configuration is an error. With --counters
+// FF_minizip and MPI_minizip read the hardware counters of their stages, written in counters.csv.
+
+static inline void usage(const char *argv0)
+{
+  printf("--------------------\n");
+  printf("Usage: %s [options]\n", argv0);
+  printf("\nCorpus:\n");
+  printf("--files N         - Files of the corpus (default 4)\n");
+  printf("--size MB         - Size of each file (default 16)\n");
+  printf("--gen CMD         - Generator of the files, run as CMD MB FILE (default ./generateTxt)\n");
+  printf("--dir DIR         - Where the corpus is generated (default a new directory in /tmp)\n");
+  printf("\nSweep:\n");
+  printf("--engines LIST    - Among seq,ff,mpi (default seq,ff)\n");
+  printf("--lw LIST         - L-Workers of FF_minizip (default 1)\n");
+  printf("--rw LIST         - R-Workers of FF_minizip and MPI_minizip (default 1,2,4)\n");
+  printf("--np LIST         - Ranks of MPI_minizip (default 2)\n");
+  printf("--mpirun CMD      - Launcher of MPI_minizip (default mpirun)\n");
+  printf("--opts \"A;B\"      - Options of the engines, each one is a configuration (for instance \"; --cdc --dedup\")\n");
+  printf("--warmup N        - Runs not measured of each configuration (default 1)\n");
+  printf("--reps N          - Runs measured of each configuration (default 5)\n");
+  printf("\nResults:\n");
+  printf("--out DIR         - Where the CSV and JSON files are written (default bench_results)\n");
+  printf("--baseline DIR    - CSV files of a previous run, a configuration slower than them is an error\n");
+  printf("--max-slowdown X  - Slowdown allowed with --baseline (default 1.10)\n");
+  printf("--counters        - Hardware counters of the stages of FF and MPI (IPC and misses per MB) in counters.csv\n");
+  printf("--------------------\n");
+}
+
+// Words of a command line, split on the spaces
+static inline std::vector<std::string> splitWords(const std::string &s)
+{
+  std::vector<std::string> words;
+  std::istringstream in(s);
+  std::string w;
+  while (in >> w)
+    words.push_back(w);
+  return words;
+}
+
+static inline std::vector<std::string> splitList(const std::string &s, char sep)
+{
+  std::vector<std::string> items;
+  std::string item;
+  std::istringstream in(s);
+  while (std::getline(in, item, sep))
+    items.push_back(item);
+  if (s.empty() || s.back() == sep)
+    items.push_back("");
+  return items;
+}
+
+static inline std::vector<long> parseNumbers(const char *list, const std::vector<long> &defaults)
+{
+  if (list == nullptr)
+    return defaults;
+  std::vector<long> numbers;
+  for (auto &item : splitList(list, ','))
+  {
+    long n;
+    if (!isNumber(item.c_str(), n) || n <= 0)
+    {
+      std::fprintf(stderr, "Invalid number %s in %s\n", item.c_str(), list);
+      exit(-1);
+    }
+    numbers.push_back(n);
+  }
+  return numbers;
+}
+
+// Runs the command, its output (stdout and stderr) goes in output
+static inline bool runCommand(const std::vector<std::string> &args, std::string &output)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    perror("pipe");
+    return false;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  std::vector<char *> argv;
+  for (auto &a : args)
+    argv.push_back(const_cast<char *>(a.c_str()));
+  argv.push_back(nullptr);
+  pid_t pid;
+  int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (err != 0)
+  {
+    close(fds[0]);
+    std::fprintf(stderr, "Cannot run %s: %s\n", argv[0], strerror(err));
+    return false;
+  }
+  output.clear();
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    if (n > 0)
+      output.append(buf, n);
+  close(fds[0]);
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The time printed by the engines ("Time FastFlow: 123 milliseconds"), -1 if there is none
+static inline double reportedMilliseconds(const std::string &output)
+{
+  double ms = -1;
+  std::istringstream in(output);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    size_t unit = line.find("millisecond");
+    size_t colon = line.find(':');
+    if (unit == std::string::npos || colon == std::string::npos || colon > unit ||
+        (line.find("Time") == std::string::npos && line.find("TIME") == std::string::npos))
+      continue;
+    ms = std::atof(line.c_str() + colon + 1);
+  }
+  return ms;
+}
+
+// Counters of a stage printed by the engines with --counters: MB and the counters in the
+// order of the line ("Counters compress: MB 64.00 task-clock 123 cycles 456 ..."), -1 if the
+// counter is not available
+typedef std::map<std::string, std::vector<double>> StageCounters;
+static const std::vector<std::string> counterColumns = {"MB", "task-clock", "cycles", "instructions", "llc-misses", "branch-misses", "dtlb-misses"};
+
+static inline StageCounters reportedCounters(const std::string &output)
+{
+  StageCounters stages;
+  std::istringstream in(output);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    size_t colon = line.find(':');
+    if (line.compare(0, 9, "Counters ") != 0 || colon == std::string::npos)
+      continue;
+    std::vector<double> &values = stages[line.substr(9, colon - 9)];
+    values.assign(counterColumns.size(), -1);
+    std::vector<std::string> words = splitWords(line.substr(colon + 1));
+    for (size_t i = 0; i + 1 < words.size(); i += 2)
+    {
+      auto it = std::find(counterColumns.begin(), counterColumns.end(), words[i]);
+      if (it != counterColumns.end())
+        values[it - counterColumns.begin()] = std::atof(words[i + 1].c_str());
+    }
+  }
+  return stages;
+}
+
+static inline bool sameContent(const std::string &a, const std::string &b)
+{
+  struct stat sa, sb;
+  if (stat(a.c_str(), &sa) != 0 || stat(b.c_str(), &sb) != 0 || sa.st_size != sb.st_size)
+    return false;
+  if (sa.st_size == 0)
+    return true;
+  size_t sizeA = sa.st_size, sizeB = sb.st_size;
+  unsigned char *pa = nullptr, *pb = nullptr;
+  if (!mapFile(a.c_str(), sizeA, pa))
+    return false;
+  if (!mapFile(b.c_str(), sizeB, pb))
+  {
+    unmapFile(pa, sizeA);
+    return false;
+  }
+  bool same = memcmp(pa, pb, sizeA) == 0;
+  unmapFile(pa, sizeA);
+  unmapFile(pb, sizeB);
+  return same;
+}
+
+static inline size_t fileSize(const std::string &path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// One configuration of the sweep
+struct Config
+{
+  std::string engine; // SEQ, FF or MPI
+  size_t lw = 0;      // FF
+  size_t np = 0;      // MPI
+  size_t rw = 0;      // FF and MPI
+  std::string opts;   // options of the engine
+};
+
+struct Result
+{
+  Config config;
+  std::vector<double> ms[2];     // compression, decompression: times printed by the engine
+  std::vector<double> wallMs[2]; // same, with the start of the processes
+  size_t inputBytes = 0, outputBytes = 0;
+  bool ok = true;
+  StageCounters counters[2]; // sums of the measured runs, -1 if a run had not the counter
+};
+
+// Median and 95th percentile (nearest rank) of the samples
+static inline double percentile(std::vector<double> v, double p)
+{
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  if (p == 50 && v.size() % 2 == 0)
+    return (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+  size_t rank = (size_t)std::ceil(p / 100 * v.size());
+  return v[std::max<size_t>(rank, 1) - 1];
+}
+
+struct Bench
+{
+  std::string exeDir;              // where the engines are
+  std::string corpus, work;        // the files, and their compressed form while decompressing
+  std::vector<std::string> files;  // names of the files of the corpus
+  std::vector<std::string> mpirun; // launcher of MPI_minizip
+  bool counters = false;           // --counters to FF_minizip and MPI_minizip
+
+  std::vector<std::string> command(const Config &c, const char *mode, const std::string &dir) const
+  {
+    std::vector<std::string> args;
+    if (c.engine == "MPI")
+    {
+      args = mpirun;
+      args.push_back("-np");
+      args.push_back(std::to_string(c.np));
+    }
+    args.push_back(exeDir + c.engine + "_minizip");
+    args.push_back(mode);
+    args.push_back(dir);
+    if (c.engine == "FF")
+      args.push_back(std::to_string(c.lw));
+    if (c.engine != "SEQ")
+      args.push_back(std::to_string(c.rw));
+    for (auto &o : splitWords(c.opts))
+      args.push_back(o);
+    if (counters && c.engine != "SEQ")
+      args.push_back("--counters");
+    return args;
+  }
+
+  bool step(const Config &c, int m, Result &r, bool measured)
+  {
+    const char *mode = m == 0 ? "c" : "d";
+    std::string output;
+    auto t = std::chrono::steady_clock::now();
+    bool ok = runCommand(command(c, mode, m == 0 ? corpus : work), output);
+    double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+    double ms = reportedMilliseconds(output);
+    if (!ok)
+    {
+      std::fprintf(stderr, "%s %s failed:\n%s\n", c.engine.c_str(), mode, output.c_str());
+      return false;
+    }
+    if (measured)
+    {
+      r.ms[m].push_back(ms >= 0 ? ms : wall);
+      r.wallMs[m].push_back(wall);
+      for (auto &stage : reportedCounters(output))
+      {
+        std::vector<double> &sum = r.counters[m][stage.first];
+        sum.resize(stage.second.size(), 0);
+        for (size_t k = 0; k < sum.size(); ++k)
+          sum[k] = sum[k] < 0 || stage.second[k] < 0 ? -1 : sum[k] + stage.second[k];
+      }
+    }
+    return true;
+  }
+
+  // Compression of the corpus, then decompression of the compressed files moved to work
+  bool run(const Config &c, Result &r, bool measured)
+  {
+    if (!step(c, 0, r, measured))
+      return false;
+    bool ok = true;
+    r.outputBytes = 0;
+    for (auto &f : files)
+    {
+      std::string packed = corpus + f + SUFFIX;
+      r.outputBytes += fileSize(packed);
+      if (rename(packed.c_str(), (work + f + SUFFIX).c_str()) != 0)
+      {
+        std::fprintf(stderr, "%s c did not write %s\n", c.engine.c_str(), packed.c_str());
+        ok = false;
+      }
+    }
+    ok = ok && step(c, 1, r, measured);
+    for (auto &f : files)
+    {
+      if (ok && !sameContent(corpus + f, work + f))
+      {
+        std::fprintf(stderr, "%s: %s is different after the round trip\n", c.engine.c_str(), f.c_str());
+        ok = false;
+      }
+      unlink((work + f).c_str());
+      unlink((work + f + SUFFIX).c_str());
+    }
+    return ok;
+  }
+};
+
+// CSV file of a configuration, the same name for the same sweep so that runs can be compared
+static inline std::string csvName(const std::string &corpusName, const Config &c, int m)
+{
+  std::string name = c.engine + "_" + corpusName;
+  for (auto &o : splitWords(c.opts))
+  {
+    name += "_";
+    for (char ch : o)
+      if (isalnum((unsigned char)ch))
+        name += ch;
+  }
+  name += m == 0 ? "_COMP" : "_DECOMP";
+  if (c.engine == "FF")
+    name += "_LW" + std::to_string(c.lw);
+  if (c.engine == "MPI")
+    name += "_NP" + std::to_string(c.np);
+  return name + ".csv";
+}
+
+// r -> ct of a CSV file written by a previous run
+static inline std::map<long, double> readCsv(const std::string &path)
+{
+  std::map<long, double> rows;
+  std::ifstream in(path);
+  std::string line;
+  long r = 1;
+  while (std::getline(in, line))
+  {
+    size_t comma = line.find(',');
+    if (line.empty() || !isdigit((unsigned char)line[0]))
+      continue;
+    if (comma == std::string::npos)
+      rows[r++] = std::atof(line.c_str()); // SEQ: ct only
+    else
+      rows[std::atol(line.c_str())] = std::atof(line.c_str() + comma + 1);
+  }
+  return rows;
+}
+
+int main(int argc, char *argv[])
+{
+  if (hasOption(argv + 1, argv + argc, "-h") || hasOption(argv + 1, argv + argc, "--help"))
+  {
+    usage(argv[0]);
+    return 0;
+  }
+  auto option = [&](const char *name, const char *def) -> std::string
+  {
+    const char *v = getOption(argv + 1, argv + argc, name);
+    return v != nullptr ? v : def;
+  };
+  const size_t nfiles = parseNumbers(getOption(argv + 1, argv + argc, "--files"), {4})[0];
+  const size_t sizeMB = parseNumbers(getOption(argv + 1, argv + argc, "--size"), {16})[0];
+  const std::vector<long> lws = parseNumbers(getOption(argv + 1, argv + argc, "--lw"), {1});
+  const std::vector<long> rws = parseNumbers(getOption(argv + 1, argv + argc, "--rw"), {1, 2, 4});
+  const std::vector<long> nps = parseNumbers(getOption(argv + 1, argv + argc, "--np"), {2});
+  const char *warmupArg = getOption(argv + 1, argv + argc, "--warmup");
+  const size_t warmup = warmupArg != nullptr ? std::strtoul(warmupArg, nullptr, 10) : 1;
+  const size_t reps = parseNumbers(getOption(argv + 1, argv + argc, "--reps"), {5})[0];
+  const double maxSlowdown = std::atof(option("--max-slowdown", "1.10").c_str());
+  const std::string outDir = option("--out", "bench_results");
+  const char *baseline = getOption(argv + 1, argv + argc, "--baseline");
+
+  Bench bench;
+  std::string self(argv[0]);
+  bench.exeDir = self.find('/') == std::string::npos ? "./" : self.substr(0, self.rfind('/') + 1);
+  bench.mpirun = splitWords(option("--mpirun", "mpirun"));
+  bench.counters = hasOption(argv + 1, argv + argc, "--counters");
+
+  // the configurations of the sweep
+  std::vector<Config> configs;
+  for (auto &o : splitList(option("--opts", ""), ';'))
+    for (auto &e : splitList(option("--engines", "seq,ff"), ','))
+    {
+      Config c;
+      c.opts = o;
+      if (e == "seq")
+      {
+        c.engine = "SEQ";
+        configs.push_back(c);
+      }
+      else if (e == "ff")
+      {
+        c.engine = "FF";
+        for (long l : lws)
+          for (long r : rws)
+          {
+            c.lw = l;
+            c.rw = r;
+            configs.push_back(c);
+          }
+      }
+      else if (e == "mpi")
+      {
+        c.engine = "MPI";
+        for (long n : nps)
+          for (long r : rws)
+          {
+            c.np = n;
+            c.rw = r;
+            configs.push_back(c);
+          }
+      }
+      else
+      {
+        std::fprintf(stderr, "Unknown engine %s\n\n", e.c_str());
+        usage(argv[0]);
+        return -1;
+      }
+    }
+
+  // the corpus, named as the files of the old scripts
+  std::string dir = option("--dir", "");
+  const bool tmpDir = dir.empty();
+  if (tmpDir)
+  {
+    dir = "/tmp/minizip_bench.";
+    if (!createTmpDir(dir))
+      return -1;
+  }
+  bench.corpus = dir + "/corpus/";
+  bench.work = dir + "/work/";
+  mkdir(dir.c_str(), 0755);
+  mkdir(bench.corpus.c_str(), 0755);
+  mkdir(bench.work.c_str(), 0755);
+  const std::string gen = option("--gen", (bench.exeDir + "generateTxt").c_str());
+  const std::string corpusName = std::to_string(nfiles) + "x" + std::to_string(sizeMB) + "MB";
+  size_t inputBytes = 0;
+  for (size_t i = 1; i <= nfiles; ++i)
+  {
+    std::string name = std::to_string(i) + "_" + std::to_string(sizeMB) + "MB";
+    std::vector<std::string> args = splitWords(gen);
+    args.push_back(std::to_string(sizeMB));
+    args.push_back(bench.corpus + name);
+    std::string output;
+    if (!runCommand(args, output))
+    {
+      std::fprintf(stderr, "Cannot generate %s:\n%s\n", name.c_str(), output.c_str());
+      return -1;
+    }
+    bench.files.push_back(name);
+    inputBytes += fileSize(bench.corpus + name);
+  }
+  std::printf("Corpus: %zu files of %zu MB in %s\n", nfiles, sizeMB, bench.corpus.c_str());
+
+  std::vector<Result> results;
+  bool success = true;
+  for (auto &c : configs)
+  {
+    Result r;
+    r.config = c;
+    r.inputBytes = inputBytes;
+    for (size_t i = 0; i < warmup + reps && r.ok; ++i)
+      r.ok = bench.run(c, r, i >= warmup);
+    success &= r.ok;
+    std::printf("%-3s lw %zu np %zu rw %zu %-16s comp %8.1f ms (p95 %8.1f)  decomp %8.1f ms (p95 %8.1f)  ratio %.3f%s\n",
+                c.engine.c_str(), c.lw, c.np, c.rw, c.opts.c_str(),
+                percentile(r.ms[0], 50), percentile(r.ms[0], 95), percentile(r.ms[1], 50), percentile(r.ms[1], 95),
+                inputBytes ? (double)r.outputBytes / inputBytes : 0.0, r.ok ? "" : "  FAILED");
+    results.push_back(r);
+  }
+
+  // CSV files: r,ct with ct the median in milliseconds (ct only for SEQ)
+  mkdir(outDir.c_str(), 0755);
+  std::map<std::string, std::vector<const Result *>> csvs[2];
+  for (auto &r : results)
+    for (int m = 0; m < 2; ++m)
+      if (r.ok)
+        csvs[m][csvName(corpusName, r.config, m)].push_back(&r);
+  bool regression = false;
+  for (int m = 0; m < 2; ++m)
+    for (auto &csv : csvs[m])
+    {
+      std::ofstream out(outDir + "/" + csv.first);
+      const bool seq = csv.second[0]->config.engine == "SEQ";
+      if (!seq)
+        out << "r,ct\n";
+      std::map<long, double> old;
+      if (baseline != nullptr)
+        old = readCsv(std::string(baseline) + "/" + csv.first);
+      for (auto *r : csv.second)
+      {
+        long rw = seq ? 1 : (long)r->config.rw;
+        double ct = percentile(r->ms[m], 50);
+        if (seq)
+          out << ct << "\n";
+        else
+          out << rw << "," << ct << "\n";
+        auto it = old.find(rw);
+        if (it != old.end() && ct > it->second * maxSlowdown)
+        {
+          std::printf("REGRESSION %s r=%ld: %.1f ms, was %.1f ms\n", csv.first.c_str(), rw, ct, it->second);
+          regression = true;
+        }
+      }
+    }
+
+  // Counters: a row for each stage of each configuration, the ratios are -1 without the counters
+  if (bench.counters)
+  {
+    std::ofstream out(outDir + "/counters.csv");
+    out << "engine,lw,np,rw,opts,mode,stage,mb,task_clock_ms,ipc,llc_misses_per_mb,branch_misses_per_mb,dtlb_misses_per_mb\n";
+    for (auto &r : results)
+      for (int m = 0; m < 2; ++m)
+        for (auto &stage : r.counters[m])
+        {
+          const std::vector<double> &v = stage.second;
+          auto ratio = [](double a, double b)
+          { return a >= 0 && b > 0 ? a / b : -1; };
+          out << r.config.engine << "," << r.config.lw << "," << r.config.np << "," << r.config.rw << ","
+              << r.config.opts << "," << (m == 0 ? "comp" : "decomp") << "," << stage.first << "," << v[0] << ","
+              << (v[1] >= 0 ? v[1] / 1e6 : -1) << "," << ratio(v[3], v[2]) << "," << ratio(v[4], v[0]) << ","
+              << ratio(v[5], v[0]) << "," << ratio(v[6], v[0]) << "\n";
+        }
+  }
+
+  // JSON: every sample
+  std::ofstream json(outDir + "/bench.json");
+  json << "{\"corpus\": {\"files\": " << nfiles << ", \"size_mb\": " << sizeMB << ", \"bytes\": " << inputBytes
+       << "}, \"warmup\": " << warmup << ", \"reps\": " << reps << ", \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const Result &r = results[i];
+    json << (i ? "," : "") << "\n  {\"engine\": \"" << r.config.engine << "\", \"lw\": " << r.config.lw
+         << ", \"np\": " << r.config.np << ", \"rw\": " << r.config.rw << ", \"opts\": \"" << r.config.opts
+         << "\", \"ok\": " << (r.ok ? "true" : "false") << ", \"compressed_bytes\": " << r.outputBytes;
+    for (int m = 0; m < 2; ++m)
+    {
+      json << ", \"" << (m == 0 ? "comp" : "decomp") << "\": {\"median_ms\": " << percentile(r.ms[m], 50)
+           << ", \"p95_ms\": " << percentile(r.ms[m], 95) << ", \"wall_median_ms\": " << percentile(r.wallMs[m], 50)
+           << ", \"samples_ms\": [";
+      for (size_t k = 0; k < r.ms[m].size(); ++k)
+        json << (k ? ", " : "") << r.ms[m][k];
+      json << "]}";
+    }
+    json << "}";
+  }
+  json << "\n]}\n";
+  std::printf("Results in %s\n", outDir.c_str());
+
+  for (auto &f : bench.files)
+    unlink((bench.corpus + f).c_str());
+  rmdir(bench.corpus.c_str());
+  rmdir(bench.work.c_str());
+  if (tmpDir)
+    rmdir(dir.c_str());
+
+  if (!success)
+  {
+    printf("Exiting with (some) Error(s)\n");
+    return -1;
+  }
+  return regression ? 1 : 0;
+}
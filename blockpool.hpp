@@ -0,0 +1,105 @@
+#if !defined _BLOCKPOOL_HPP
+#define _BLOCKPOOL_HPP
+
+#include <cstddef>
+#include <type_traits>
+
+#include <ff/mpmc/MPMCqueues.hpp>
+
+// Buffers of the compressed blocks ------------------------------------------------------------
+
+// The R_Workers take a buffer for each block they compress and the thread that writes the
+// file gives it back, so after the first files no block buffer is allocated anymore.
+// All the buffers have the same size, enough for the compressed form of any block.
+// The free list is a lock-free bounded queue: the buffers that do not fit are deleted,
+// so at most maxFree idle buffers are kept.
+class BlockPool
+{
+public:
+	~BlockPool()
+	{
+		if (blockSize == 0)
+			return;
+		void *ptr;
+		while (freeList.pop(&ptr))
+			delete[] (unsigned char *)ptr;
+	}
+
+	// must be called before starting the threads
+	void init(size_t size, size_t maxFree)
+	{
+		blockSize = size;
+		freeList.init(maxFree);
+	}
+
+	unsigned char *get()
+	{
+		void *ptr;
+		if (freeList.pop(&ptr))
+			return (unsigned char *)ptr;
+		return new unsigned char[blockSize];
+	}
+
+	void put(unsigned char *ptr)
+	{
+		if (ptr != nullptr && !freeList.push(ptr))
+			delete[] ptr;
+	}
+
+	size_t size() const { return blockSize; }
+
+private:
+	size_t blockSize = 0;
+	ff::MPMC_Ptr_Queue freeList;
+};
+
+// Descriptors of the blocks ------------------------------------------------------------------
+
+// Same free list for the task descriptors: one per block, created by the L_Workers and
+// released by the thread that collects the block. T must be trivially copyable, get
+// returns it with the default values.
+template <typename T>
+class TaskPool
+{
+	static_assert(std::is_trivially_copyable<T>::value, "the tasks are reset by copy");
+
+public:
+	~TaskPool()
+	{
+		if (!initialized)
+			return;
+		void *ptr;
+		while (freeList.pop(&ptr))
+			delete (T *)ptr;
+	}
+
+	// must be called before starting the threads
+	void init(size_t maxFree)
+	{
+		initialized = true;
+		freeList.init(maxFree);
+	}
+
+	T *get()
+	{
+		void *ptr;
+		if (freeList.pop(&ptr))
+		{
+			*(T *)ptr = T();
+			return (T *)ptr;
+		}
+		return new T();
+	}
+
+	void put(T *t)
+	{
+		if (t != nullptr && !freeList.push(t))
+			delete t;
+	}
+
+private:
+	bool initialized = false;
+	ff::MPMC_Ptr_Queue freeList;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#if !defined _CHUNKER_HPP
+#define _CHUNKER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Content-defined chunking (--cdc) -----------------------------------------------------------
+
+// With --cdc the blocks end where the content says so instead of every BIGFILE_LOW_THRESHOLD
+// bytes, so a byte inserted in a file moves only the block where it is, and the blocks after
+// it are found again by the deduplication. The blocks have different sizes, they are written
+// after the sizes of the compressed blocks and the number of blocks has CHUNKED_BLOCKS set:
+// [size][nblocks | CHUNKED_BLOCKS][nblocks compressed sizes][nblocks uncompressed sizes][data]
+static const size_t CHUNKED_BLOCKS = (size_t)1 << 63;
+
+static inline bool isChunked(size_t nblocksField) { return (nblocksField & CHUNKED_BLOCKS) != 0; }
+static inline size_t blockCount(size_t nblocksField) { return nblocksField & ~CHUNKED_BLOCKS; }
+
+// Bytes of the header of a .miniz
+static inline size_t headerBytes(size_t nblocksField)
+{
+	return sizeof(size_t) * (2 + blockCount(nblocksField) * (isChunked(nblocksField) ? 2 : 1));
+}
+
+// True if the .miniz (mapped in ptr) has variable size blocks, it cannot be used by the
+// decompressors that expect blocks of BIGFILE_LOW_THRESHOLD bytes
+static inline bool hasChunks(const unsigned char *ptr, size_t size)
+{
+	size_t nblocks = 0;
+	if (size >= 2 * sizeof(size_t))
+		memcpy(&nblocks, ptr + sizeof(size_t), sizeof(size_t));
+	return isChunked(nblocks);
+}
+
+// Where the blocks start in the uncompressed file, offsets[nblocks] is its size. The blocks
+// have blockSize bytes (the last one can be shorter) unless the header has their sizes.
+// False if the header does not fit in the file or the sizes do not add up.
+static inline bool blockOffsets(const unsigned char *ptr, size_t size, size_t blockSize, std::vector<size_t> &offsets)
+{
+	const size_t sizeOfT = sizeof(size_t);
+	size_t uncompressed = 0, nblocksField = 0;
+	if (size < 2 * sizeOfT)
+		return false;
+	memcpy(&uncompressed, ptr, sizeOfT);
+	memcpy(&nblocksField, ptr + sizeOfT, sizeOfT);
+	const size_t nblocks = blockCount(nblocksField);
+	if (nblocks > size / sizeOfT || headerBytes(nblocksField) > size)
+		return false;
+	offsets.resize(nblocks + 1);
+	offsets[0] = 0;
+	for (size_t i = 0; i < nblocks; ++i)
+	{
+		size_t length = std::min(blockSize, uncompressed - std::min(uncompressed, offsets[i]));
+		if (isChunked(nblocksField))
+			memcpy(&length, ptr + sizeOfT * (2 + nblocks + i), sizeOfT);
+		if (length > uncompressed - offsets[i])
+			return false;
+		offsets[i + 1] = offsets[i] + length;
+	}
+	return offsets[nblocks] == uncompressed;
+}
+
+// Gear rolling hash with the cut points of FastCDC: no cut before minSize, a harder mask up to
+// avgSize and an easier one after it (normalized chunking, the sizes stay close to avgSize),
+// a cut at maxSize anyway. Only the top bits of the hash are tested, they depend on the
+// last 64 bytes, and the hash starts 64 bytes before minSize so a cut depends only on the
+// 64 bytes up to it and not on where the chunk started.
+class Chunker
+{
+public:
+	Chunker(size_t minSize, size_t avgSize, size_t maxSize)
+		: minSize(minSize), avgSize(avgSize), maxSize(maxSize)
+	{
+		int bits = 0;
+		while (((size_t)2 << bits) <= avgSize)
+			++bits;
+		maskHard = topBits(bits + 2);
+		maskEasy = topBits(bits > 2 ? bits - 2 : 1);
+		// the same table in every run, the cut points must not change between runs
+		uint64_t x = 0x9E3779B97F4A7C15ULL;
+		for (auto &g : gear)
+		{
+			// splitmix64
+			uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			g = z ^ (z >> 31);
+		}
+	}
+
+	// Size of the chunk at the beginning of the n bytes in p
+	size_t cut(const unsigned char *p, size_t n) const
+	{
+		if (n <= minSize)
+			return n;
+		const size_t end = std::min(n, maxSize);
+		const size_t normal = std::min(end, avgSize);
+		size_t i = scan(p, minSize, normal, maskHard);
+		if (i == normal)
+			i = scan(p, normal, end, maskEasy);
+		return i == end ? end : i + 1;
+	}
+
+	// Offsets of the chunks of the n bytes in p, the last one is n
+	void split(const unsigned char *p, size_t n, std::vector<size_t> &offsets) const
+	{
+		offsets.assign(1, 0);
+		for (size_t pos = 0; pos < n;)
+		{
+			pos += cut(p + pos, n - pos);
+			offsets.push_back(pos);
+		}
+	}
+
+	const size_t minSize, avgSize, maxSize;
+
+private:
+	static uint64_t topBits(int bits) { return ~(uint64_t)0 << (64 - bits); }
+
+	// First i in [from, to) where the hash has none of the bits of mask, to if there is none
+	size_t scan(const unsigned char *p, size_t from, size_t to, uint64_t mask) const
+	{
+		uint64_t h = 0;
+		for (size_t i = from > 64 ? from - 64 : 0; i < from; ++i)
+			h = (h << 1) + gear[p[i]];
+		for (size_t i = from; i < to; ++i)
+		{
+			h = (h << 1) + gear[p[i]];
+			if (!(h & mask))
+				return i;
+		}
+		return to;
+	}
+
+	uint64_t maskHard, maskEasy;
+	uint64_t gear[256];
+};
+
+// Parses MIN:AVG:MAX in KiB (for instance 512:1024:2048), the sizes must be increasing
+static inline bool parseChunkSizes(const char *arg, size_t &minSize, size_t &avgSize, size_t &maxSize)
+{
+	char *end;
+	size_t v[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		v[k] = std::strtoul(arg, &end, 10) * 1024;
+		if (end == arg || *end != (k < 2 ? ':' : '\0'))
+			return false;
+		arg = end + 1;
+	}
+	if (v[0] == 0 || v[0] >= v[1] || v[1] >= v[2])
+		return false;
+	minSize = v[0];
+	avgSize = v[1];
+	maxSize = v[2];
+	return true;
+}
+
+#endif
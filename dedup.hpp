@@ -0,0 +1,312 @@
+#if !defined _DEDUP_HPP
+#define _DEDUP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <chunker.hpp>
+
+// Deduplication of the blocks (--dedup) ------------------------------------------------------
+
+// A block equal to a block already seen is not compressed: its entry in the header of the
+// .miniz is DEDUP_REF | source << 32 | index of the other block, and it has no data. The source
+// is 0 for a block of the same file, otherwise the other block is in the source-th .miniz of
+// the list after the data of the file (the sources):
+// [number of sources][for each one: length of the name][name, relative to the directory of
+// the file][for each block that refers to another file, in order: hash of its data (lo, hi)]
+// The other block is always a compressed one, the hash tells if its .miniz has been replaced.
+static const size_t DEDUP_REF = (size_t)1 << 63;
+static const int DEDUP_SOURCE_SHIFT = 32;
+static const size_t DEDUP_MAX_SOURCES = ((size_t)1 << (63 - DEDUP_SOURCE_SHIFT)) - 1;
+
+static inline bool isDedupRef(size_t entry) { return (entry & DEDUP_REF) != 0; }
+static inline size_t dedupRef(size_t source, size_t block) { return DEDUP_REF | source << DEDUP_SOURCE_SHIFT | block; }
+static inline size_t dedupSource(size_t entry) { return (entry & ~DEDUP_REF) >> DEDUP_SOURCE_SHIFT; }
+static inline size_t dedupTarget(size_t entry) { return entry & (((size_t)1 << DEDUP_SOURCE_SHIFT) - 1); }
+
+// True if the .miniz (mapped in ptr) has references, it cannot be used by the decompressors
+// that do not resolve them
+static inline bool hasDedupRefs(const unsigned char *ptr, size_t size)
+{
+	const size_t sizeOfT = sizeof(size_t);
+	size_t nblocks = 0;
+	if (size < 2 * sizeOfT)
+		return false;
+	memcpy(&nblocks, ptr + sizeOfT, sizeOfT);
+	for (size_t i = 0; i < nblocks && sizeOfT * (i + 3) <= size; ++i)
+	{
+		size_t entry;
+		memcpy(&entry, ptr + sizeOfT * (i + 2), sizeOfT);
+		if (isDedupRef(entry))
+			return true;
+	}
+	return false;
+}
+
+// Copies the blocks that are references to the same file from the blocks they refer to.
+// entries is the header of the .miniz, the block i is out[offsets[i], offsets[i + 1]).
+static inline bool resolveDedupRefs(unsigned char *out, const size_t *entries, size_t nblocks, const size_t *offsets)
+{
+	for (size_t i = 0; i < nblocks; ++i)
+	{
+		if (!isDedupRef(entries[i]) || dedupSource(entries[i]) != 0)
+			continue;
+		size_t j = dedupTarget(entries[i]);
+		size_t length = offsets[i + 1] - offsets[i];
+		if (j >= nblocks || isDedupRef(entries[j]) || offsets[j + 1] - offsets[j] != length)
+			return false;
+		memcpy(out + offsets[i], out + offsets[j], length);
+	}
+	return true;
+}
+
+// 128 bit hash of a block: four xxh64-like lanes over 32 byte stripes, folded in two halves
+struct Hash128
+{
+	uint64_t lo, hi;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xC2B2AE3D27D4EB4FULL;
+	h ^= h >> 29;
+	h *= 0x165667B19E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline Hash128 hash128(const unsigned char *p, size_t n)
+{
+	const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL;
+	const uint64_t P3 = 0x165667B19E3779F9ULL, P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+	uint64_t v[4] = {P1 + P2, P2, 0, (uint64_t)0 - P1};
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+		for (int k = 0; k < 4; ++k)
+		{
+			uint64_t x;
+			memcpy(&x, p + i + 8 * k, 8);
+			v[k] = rotl64(v[k] + x * P2, 31) * P1;
+		}
+	uint64_t t1 = n * P5, t2 = n * P3;
+	for (; i + 8 <= n; i += 8)
+	{
+		uint64_t x;
+		memcpy(&x, p + i, 8);
+		t1 = rotl64(t1 ^ (rotl64(x * P2, 31) * P1), 27) * P1 + P4;
+	}
+	for (; i < n; ++i)
+		t2 = rotl64(t2 ^ (p[i] * P5), 11) * P1;
+	Hash128 h;
+	h.lo = mix64((rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18)) ^ t1);
+	h.hi = mix64((v[0] ^ rotl64(v[1], 13) ^ rotl64(v[2], 29) ^ rotl64(v[3], 43)) + t2);
+	return h;
+}
+
+// Files and hashes of the references to other files of a .miniz
+struct DedupSources
+{
+	std::vector<std::string> names; // names[k - 1] is the source k
+	std::vector<Hash128> checks;	// one for each block that refers to another file
+};
+
+static inline void appendSize(std::vector<unsigned char> &out, size_t value)
+{
+	const unsigned char *p = (const unsigned char *)&value;
+	out.insert(out.end(), p, p + sizeof(size_t));
+}
+
+// The bytes written after the data of the file
+static inline std::vector<unsigned char> dedupTrailer(const DedupSources &sources)
+{
+	std::vector<unsigned char> out;
+	appendSize(out, sources.names.size());
+	for (const std::string &name : sources.names)
+	{
+		appendSize(out, name.size());
+		out.insert(out.end(), name.begin(), name.end());
+	}
+	for (const Hash128 &h : sources.checks)
+	{
+		appendSize(out, h.lo);
+		appendSize(out, h.hi);
+	}
+	return out;
+}
+
+// Reads the sources of the .miniz mapped in ptr. False if the header or the list are not
+// valid, or a reference has no source. A file without references to other files has none.
+static inline bool readDedupSources(const unsigned char *ptr, size_t size, DedupSources &sources)
+{
+	const size_t sizeOfT = sizeof(size_t);
+	size_t nblocksField = 0;
+	if (size < 2 * sizeOfT)
+		return false;
+	memcpy(&nblocksField, ptr + sizeOfT, sizeOfT);
+	const size_t nblocks = blockCount(nblocksField);
+	if (nblocks > size / sizeOfT || headerBytes(nblocksField) > size)
+		return false;
+	// the list starts after the data of the compressed blocks
+	size_t pos = headerBytes(nblocksField), crossRefs = 0, maxSource = 0;
+	for (size_t i = 0; i < nblocks; ++i)
+	{
+		size_t entry;
+		memcpy(&entry, ptr + sizeOfT * (i + 2), sizeOfT);
+		if (!isDedupRef(entry))
+		{
+			if (entry > size - pos)
+				return false;
+			pos += entry;
+		}
+		else if (dedupSource(entry) != 0)
+		{
+			crossRefs++;
+			maxSource = std::max(maxSource, dedupSource(entry));
+		}
+	}
+	sources.names.clear();
+	sources.checks.clear();
+	if (crossRefs == 0)
+		return true;
+	auto readSize = [&](size_t &value)
+	{
+		if (size - pos < sizeOfT)
+			return false;
+		memcpy(&value, ptr + pos, sizeOfT);
+		pos += sizeOfT;
+		return true;
+	};
+	size_t count;
+	if (!readSize(count) || count < maxSource || count > (size - pos) / sizeOfT)
+		return false;
+	for (size_t k = 0; k < count; ++k)
+	{
+		size_t length;
+		if (!readSize(length) || length > size - pos)
+			return false;
+		sources.names.emplace_back((const char *)ptr + pos, length);
+		pos += length;
+	}
+	sources.checks.resize(crossRefs);
+	for (Hash128 &h : sources.checks)
+		if (!readSize(h.lo) || !readSize(h.hi))
+			return false;
+	return true;
+}
+
+// Where the block j of the .miniz mapped in ptr is: its compressed data is
+// ptr[begin, begin + cmpSize), it is length bytes uncompressed. False if it is a reference.
+static inline bool sourceBlock(const unsigned char *ptr, size_t size, size_t blockSize, size_t j,
+							   size_t &begin, size_t &cmpSize, size_t &length)
+{
+	const size_t sizeOfT = sizeof(size_t);
+	std::vector<size_t> offsets;
+	if (!blockOffsets(ptr, size, blockSize, offsets) || j + 1 >= offsets.size())
+		return false;
+	size_t nblocksField;
+	memcpy(&nblocksField, ptr + sizeOfT, sizeOfT);
+	begin = headerBytes(nblocksField);
+	for (size_t i = 0; i <= j; ++i)
+	{
+		size_t entry;
+		memcpy(&entry, ptr + sizeOfT * (i + 2), sizeOfT);
+		if (i == j)
+		{
+			if (isDedupRef(entry) || entry > size - begin)
+				return false;
+			cmpSize = entry;
+		}
+		else if (!isDedupRef(entry))
+		{
+			if (entry > size - begin)
+				return false;
+			begin += entry;
+		}
+	}
+	length = offsets[j + 1] - offsets[j];
+	return true;
+}
+
+// The source of a reference, name is relative to the directory of fname
+static inline std::string sourcePath(const std::string &fname, const std::string &name)
+{
+	size_t slash = fname.rfind('/');
+	return slash == std::string::npos ? name : fname.substr(0, slash + 1) + name;
+}
+
+// A block of the file and the position of a block in FilesVector
+struct DedupBlock
+{
+	size_t file, block;
+};
+
+// Table of the blocks seen, shared by the R_Workers: open addressing on a fixed array, a slot
+// is taken with a CAS and then written, the readers wait for the (short) write to finish.
+// When it is full the blocks are not deduplicated anymore. With acrossFiles the blocks of
+// all the files are compared, otherwise only the blocks of the same file.
+class DedupTable
+{
+public:
+	// capacity: the blocks that can be inserted
+	void init(size_t capacity, bool acrossFiles)
+	{
+		size_t size = 16;
+		while (size < 2 * capacity)
+			size <<= 1;
+		slots = std::vector<Slot>(size);
+		mask = size - 1;
+		across = acrossFiles;
+	}
+
+	// Returns the first block inserted with the same hash, b if it is the first
+	DedupBlock insert(const Hash128 &h, DedupBlock b)
+	{
+		const size_t file = b.file, block = b.block;
+		for (size_t probes = 0, i = h.lo & mask; probes <= mask; ++probes, i = (i + 1) & mask)
+		{
+			Slot &s = slots[i];
+			uint32_t state = s.state.load(std::memory_order_acquire);
+			if (state == EMPTY && s.state.compare_exchange_strong(state, WRITING, std::memory_order_acq_rel))
+			{
+				s.file = file;
+				s.hash = h;
+				s.block = block;
+				s.state.store(READY, std::memory_order_release);
+				return b;
+			}
+			while (state == WRITING)
+				state = s.state.load(std::memory_order_acquire);
+			if ((across || s.file == file) && s.hash.lo == h.lo && s.hash.hi == h.hi)
+				return {s.file, s.block};
+		}
+		return b;
+	}
+
+private:
+	enum : uint32_t
+	{
+		EMPTY = 0,
+		WRITING = 1,
+		READY = 2
+	};
+	struct Slot
+	{
+		std::atomic<uint32_t> state{EMPTY};
+		size_t file = 0;
+		Hash128 hash = {0, 0};
+		size_t block = 0;
+	};
+	std::vector<Slot> slots;
+	size_t mask = 0;
+	bool across = false;
+};
+
+#endif
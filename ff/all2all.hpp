@@ -63,7 +63,7 @@ protected:
                 if (workers1[0]->isMultiInput()) { // NOTE: we suppose that all others are the same
                     for(size_t i=0;i<workers2.size(); ++i) {
                         for(size_t j=0;j<workers1.size();++j) {
-                            ff_node* t = new ff_buffernode(in_buffer_entries,false);
+                            ff_node* t = new ff_buffernode(feedback_queue_length(),false);
                             t->set_id(i);
                             internalSupportNodes.push_back(t);
                             workers2[i]->set_output_feedback(t);
@@ -77,7 +77,7 @@ protected:
                         return -1;
                     }
                     
-                    if (create_input_buffer(in_buffer_entries, false) <0) {
+                    if (create_input_buffer(feedback_queue_length(), false) <0) {
                         error("A2A, error creating input buffers\n");
                         return -1;
                     }
@@ -93,7 +93,7 @@ protected:
                     return -1;
                 }
                 if (!workers1[0]->isMultiInput()) {  // we suppose that all others are the same
-                    if (create_input_buffer(in_buffer_entries, false) <0) {
+                    if (create_input_buffer(feedback_queue_length(), false) <0) {
                         error("A2A, error creating input buffers\n");
                         return -1;
                     }
@@ -358,6 +358,7 @@ public:
         fixedsizeOUT         = p.fixedsizeOUT;
         in_buffer_entries    = p.in_buffer_entries;
         out_buffer_entries   = p.out_buffer_entries;
+        feedback_entries     = p.feedback_entries;
         wraparound           = p.wraparound;
         ondemand_chunk       = p.ondemand_chunk;
         outputNodes          = p.outputNodes;
@@ -683,6 +684,8 @@ public:
         out_buffer_entries = sz;
         fixedsizeOUT       = fixedsize;
     }
+    // length of the feedback channels (wrap_around), the input queue length if not set
+    void setFeedbackQueueLength(int sz) { feedback_entries = sz; }
     
     // time functions --------------------------------
 
@@ -766,6 +769,10 @@ protected:
     bool isMultiOutput() const { return true;}
     bool isAll2All()     const { return true; }    
 
+    int feedback_queue_length() const {
+        return feedback_entries > 0 ? feedback_entries : in_buffer_entries;
+    }
+
     int create_input_buffer(int nentries, bool fixedsize=FF_FIXED_SIZE) {
         size_t nworkers1 = workers1.size();
         for(size_t i=0;i<nworkers1; ++i)
@@ -837,6 +844,7 @@ protected:
     bool prepared, fixedsizeIN, fixedsizeOUT;
     bool wraparound=false;
     int in_buffer_entries, out_buffer_entries;
+    int feedback_entries=0;
     int ondemand_chunk=0;
     svector<ff_node*>  workers1;  // first set, nodes must be multi-output
     svector<ff_node*>  workers2;  // second set, nodes must be multi-input
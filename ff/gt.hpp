@@ -196,6 +196,7 @@ protected:
      */
     virtual ssize_t gather_task(void ** task) {
         unsigned int cnt;
+        unsigned long spins=0;
         do {
             cnt=0;
             do {
@@ -207,6 +208,7 @@ protected:
                 else if (++cnt == nattempts()) break;
             } while(1);
             if (blocking_in) {
+                if (blocking_spin(spins)) continue;
                 struct timespec tv;
                 timedwait_timeout(tv);
                 pthread_mutex_lock(cons_m);
@@ -308,6 +308,7 @@ protected:
                                                            std::deque<ff_node *>::iterator & start) {
         int cnt, nw= (int)(availworkers.end()-availworkers.begin());
         const std::deque<ff_node *>::iterator & ite(availworkers.end());
+        unsigned long spins=0;
         do {
             cnt=0;
             do {
@@ -351,6 +352,7 @@ protected:
                 }
             } while(1);
             if (blocking_in) {
+                if (blocking_spin(spins)) continue;
                 struct timespec tv;
                 timedwait_timeout(tv);
                 pthread_mutex_lock(cons_m);
@@ -207,7 +207,7 @@ public:
                     break;
 
                 // exponential delay with max value
-                for(volatile unsigned i=0;i<bk;++i) ;
+                for(volatile unsigned i=0;i<bk;) i = i + 1;
                 bk <<= 1;
                 bk &= BACKOFF_MAX;
             } else 
@@ -240,7 +240,7 @@ public:
                     break;
 
                 // exponential delay with max value
-                for(volatile unsigned i=0;i<bk;++i) ;
+                for(volatile unsigned i=0;i<bk;) i = i + 1;
                 bk <<= 1;
                 bk &= BACKOFF_MAX;
             } else { 
@@ -345,7 +345,7 @@ public:
                     break;
 
                 // exponential delay with max value
-                for(volatile unsigned i=0;i<bk;++i) ;
+                for(volatile unsigned i=0;i<bk;) i = i + 1;
                 bk <<= 1;
                 bk &= BACKOFF_MAX;
             } else 
@@ -379,7 +379,7 @@ public:
                     break;
 
                 // exponential delay with max value
-                for(volatile unsigned i=0;i<bk;++i) ;
+                for(volatile unsigned i=0;i<bk;) i = i + 1;
                 bk <<= 1;
                 bk &= BACKOFF_MAX;
             } else { 
@@ -493,7 +493,7 @@ public:
                     break;
                 
                 // exponential delay with max value
-                for(volatile unsigned i=0;i<bk;++i) ;
+                for(volatile unsigned i=0;i<bk;) i = i + 1;
                 bk <<= 1;
                 bk &= BACKOFF_MAX;
             } 
@@ -522,7 +522,7 @@ public:
                     break;
 
                 // exponential delay with max value
-                for(volatile unsigned i=0;i<bk;++i) ;
+                for(volatile unsigned i=0;i<bk;) i = i + 1;
                 bk <<= 1;
                 bk &= BACKOFF_MAX;
             }  
@@ -928,7 +928,7 @@ public:
             if (CAS((volatile atom_t *)&dequeue, (atom_t)(q+1), (atom_t)q) == (atom_t)q) break;
             //if(dequeue.compare_exchange_strong(<#long &__e#>, <#long __d#>)
             // exponential delay with max value
-            for(volatile unsigned i=0;i<bk;++i) ;
+            for(volatile unsigned i=0;i<bk;) i = i + 1;
             bk <<= 1;
             bk &= BACKOFF_MAX;
         } while(1);
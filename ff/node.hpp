@@ -586,9 +586,11 @@ protected:
     virtual inline bool Pop(void **ptr, unsigned long retry=((unsigned long)-1), unsigned long ticks=(TICKS2WAIT)) {
         if (blocking_in) {
             if (!in_active) { *ptr=NULL; return false; }
+            unsigned long spins=0;
         retry:
             bool r = in->pop(ptr);
             if (!r) { // EMPTY                
+                if (blocking_spin(spins)) goto retry;
                 struct timespec tv;
                 timedwait_timeout(tv);
                 pthread_mutex_lock(cons_m);
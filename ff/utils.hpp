@@ -222,6 +222,20 @@ static inline void timedwait_timeout(struct timespec&tv) {
     }
 }
 
+/* Used in blocking mode: how many times a consumer polls again an empty input
+ * (with a pause between the attempts) before waiting on the condition variable.
+ * 0 (the default) waits at once. To be set before starting the nodes.
+ */
+inline unsigned long blocking_spin_budget = 0;
+
+/* Returns true while the consumer can keep spinning, spins counts the attempts */
+static inline bool blocking_spin(unsigned long &spins) {
+    if (spins >= blocking_spin_budget) return false;
+    ++spins;
+    PAUSE();
+    return true;
+}
+
 static inline unsigned int nextMultipleOfIf(unsigned int x, unsigned int m) {
     unsigned r = x % m;
     return (r ? (x-r+m):x); 
@@ -1,43 +1,396 @@
-#include <iostream>
-#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdarg>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The file is made of CHUNK bytes chunks, each one generated from the seed and its index
+// only, so the content does not depend on the number of threads. A duplicate chunk is the
+// same as an earlier chunk, it is generated again from the index of that chunk.
+static const size_t CHUNK = 1 << 20;
 
 static inline void usage(const char *argv0)
 {
-  printf("--------------------\n");
-  printf("Usage: %s SizeOfFileInMB NameOfFile \n", argv0);
-  printf("--------------------\n");
+    printf("--------------------\n");
+    printf("Usage: %s SizeOfFileInMB NameOfFile [--model M] [--seed N] [--dup R] [--threads N]\n", argv0);
+    printf("\nModels:\n");
+    printf("mix       - Chunks of all the models below but letters (default)\n");
+    printf("text      - Sentences of words chained by a Markov model\n");
+    printf("log       - Log lines with timestamps, levels, request ids and latencies\n");
+    printf("json      - One JSON record for each line\n");
+    printf("telemetry - Binary records with timestamps, sensor ids and slowly changing values\n");
+    printf("random    - Incompressible bytes\n");
+    printf("letters   - Random lowercase letters (the old generateTxt)\n");
+    printf("\nOptions:\n");
+    printf("--seed N    - The same seed gives the same file (default: from the name of the file)\n");
+    printf("--dup R     - Fraction of the 1 MB chunks that repeat an earlier chunk (default 0)\n");
+    printf("--threads N - Threads generating the file (default: the CPUs)\n");
+    printf("--------------------\n");
+}
+
+// xoshiro256**, seeded with splitmix64
+struct Rng
+{
+    uint64_t s[4];
+
+    explicit Rng(uint64_t seed)
+    {
+        for (auto &x : s)
+        {
+            uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            x = z ^ (z >> 31);
+        }
+    }
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+    uint64_t next()
+    {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+    // in [0, n)
+    uint32_t below(uint32_t n) { return (uint32_t)(((next() >> 32) * n) >> 32); }
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+    // in [0, n), the small values much more often (about Zipf)
+    uint32_t skewed(uint32_t n)
+    {
+        double u = uniform();
+        return std::min<uint32_t>(n - 1, (uint32_t)(n * u * u * u));
+    }
+};
+
+static const char *const WORDS[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+    "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+    "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+    "more", "when", "will", "would", "who", "so", "no", "data", "file", "block", "worker", "node",
+    "system", "time", "process", "memory", "network", "request", "server", "client", "value", "queue",
+    "thread", "compression", "buffer", "stream", "result", "error", "message", "table", "index",
+    "record", "user", "service", "cluster", "storage", "page", "cache", "input", "output", "task",
+    "first", "new", "other", "some", "these", "into", "only", "than", "then", "its", "also", "after",
+    "two", "over", "between", "each", "where", "under", "very", "through", "because", "while",
+    "large", "small", "fast", "slow", "same", "different", "every", "most", "many", "long", "high",
+    "read", "write", "send", "receive", "split", "merge", "store", "load", "compute", "check", "wait"};
+static const uint32_t NWORDS = sizeof(WORDS) / sizeof(WORDS[0]);
+static const uint32_t SUCCESSORS = 12;
+
+// Chain of the text model: the words that can follow each word, the same in every run.
+// The words are padded to 16 bytes, they are copied with a single move.
+struct Markov
+{
+    uint16_t next[NWORDS][SUCCESSORS];
+    uint8_t length[NWORDS];
+    char padded[NWORDS][16];
+
+    Markov()
+    {
+        Rng rng(0x5EED);
+        for (uint32_t w = 0; w < NWORDS; ++w)
+        {
+            length[w] = (uint8_t)strlen(WORDS[w]);
+            memset(padded[w], ' ', sizeof(padded[w]));
+            memcpy(padded[w], WORDS[w], length[w]);
+            for (uint32_t k = 0; k < SUCCESSORS; ++k)
+                next[w][k] = (uint16_t)rng.skewed(NWORDS);
+        }
+    }
+};
+static const Markov markov;
+
+// Appends to the buffer until it is full, the last record is cut
+struct Writer
+{
+    unsigned char *p, *end;
+
+    bool full() const { return p >= end; }
+    void put(const char *s, size_t n)
+    {
+        n = std::min<size_t>(n, end - p);
+        memcpy(p, s, n);
+        p += n;
+    }
+    void put(const char *s) { put(s, strlen(s)); }
+    __attribute__((format(printf, 2, 3))) void putf(const char *fmt, ...)
+    {
+        char line[512];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        put(line, std::min<size_t>(std::max(n, 0), sizeof(line) - 1));
+    }
+};
+
+static void text(Rng &rng, Writer &out)
+{
+    uint32_t w = rng.below(NWORDS);
+    while (!out.full())
+    {
+        uint32_t words = 4 + rng.below(20);
+        for (uint32_t i = 0; i < words && !out.full(); ++i)
+        {
+            unsigned char *start = out.p;
+            if (out.end - out.p >= 16)
+            {
+                memcpy(out.p, markov.padded[w], 16);
+                out.p += markov.length[w];
+            }
+            else
+                out.put(markov.padded[w], markov.length[w]);
+            if (i == 0 && out.p > start)
+                *start = (unsigned char)toupper(*start);
+            if (i + 1 < words)
+                out.put(" ", 1);
+            else
+                out.put(rng.below(8) ? ". " : ".\n", 2);
+            w = markov.next[w][rng.skewed(SUCCESSORS)];
+        }
+    }
+}
+
+static const char *const LEVELS[] = {"INFO ", "INFO ", "INFO ", "DEBUG", "DEBUG", "WARN ", "ERROR"};
+static const char *const PATHS[] = {"/api/v1/items", "/api/v1/users", "/api/v1/orders", "/health", "/api/v2/search", "/static/app.js"};
+static const char *const METHODS[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+
+static void logLines(Rng &rng, Writer &out, uint64_t chunk)
+{
+    // the time goes on from a chunk to the next one
+    uint64_t ms = 1760000000000ULL + chunk * 60000;
+    while (!out.full())
+    {
+        ms += rng.below(40);
+        time_t sec = ms / 1000;
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        uint32_t status = rng.below(50) ? 200 : (rng.below(2) ? 404 : 500);
+        out.putf("%04d-%02d-%02dT%02d:%02d:%02d.%03" PRIu64 "Z %s [worker-%02u] %s %s/%u status=%u req=%08" PRIx64 " latency_ms=%u\n",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ms % 1000,
+                 LEVELS[rng.below(7)], rng.below(16), METHODS[rng.below(6)], PATHS[rng.skewed(6)], rng.skewed(100000),
+                 status, rng.next() & UINT64_C(0xffffffff), 1 + rng.skewed(2000));
+    }
+}
+
+static void jsonLines(Rng &rng, Writer &out, uint64_t chunk)
+{
+    uint64_t id = chunk * 10000;
+    while (!out.full())
+    {
+        out.putf("{\"id\":%" PRIu64 ",\"user\":\"%s_%u\",\"active\":%s,\"score\":%.2f,\"tags\":[\"%s\",\"%s\"],\"items\":%u}\n",
+                 id++, WORDS[rng.skewed(NWORDS)], rng.skewed(5000), rng.below(4) ? "true" : "false",
+                 rng.uniform() * 100, WORDS[rng.skewed(NWORDS)], WORDS[rng.skewed(NWORDS)], rng.skewed(50));
+    }
+}
+
+#pragma pack(push, 1)
+struct TelemetryRecord
+{
+    uint64_t timestamp;
+    uint32_t sensor;
+    uint16_t status;
+    uint8_t flags;
+    float value;
+};
+#pragma pack(pop)
+
+static void telemetry(Rng &rng, Writer &out, uint64_t chunk)
+{
+    TelemetryRecord r = {};
+    r.timestamp = 1760000000000000ULL + chunk * 1000000;
+    float values[64];
+    for (auto &v : values)
+        v = (float)(rng.uniform() * 100);
+    while (!out.full())
+    {
+        r.timestamp += 1000 + rng.below(16);
+        r.sensor = rng.below(64);
+        r.status = rng.below(100) ? 0 : 1 + rng.below(4);
+        r.flags = rng.below(10) ? 0 : 1;
+        values[r.sensor] += (float)(rng.uniform() - 0.5);
+        r.value = values[r.sensor];
+        out.put((const char *)&r, sizeof(r));
+    }
+}
+
+static void randomBytes(Rng &rng, Writer &out)
+{
+    while (!out.full())
+    {
+        uint64_t x = rng.next();
+        out.put((const char *)&x, sizeof(x));
+    }
+}
+
+static void letters(Rng &rng, Writer &out)
+{
+    for (; !out.full(); ++out.p)
+        *out.p = (unsigned char)('a' + rng.below(26));
+}
+
+enum Model
+{
+    TEXT,
+    LOG,
+    JSON,
+    TELEMETRY,
+    RANDOM,
+    LETTERS,
+    MIX
+};
+
+static void generateChunk(Model model, uint64_t seed, uint64_t chunk, unsigned char *buf, size_t size)
+{
+    Rng rng(seed ^ (chunk * 0xD1B54A32D192ED03ULL));
+    if (model == MIX)
+    {
+        // share of the chunks of each model, about our production mix
+        static const Model MODELS[] = {TEXT, TEXT, TEXT, LOG, LOG, LOG, JSON, JSON, TELEMETRY, RANDOM};
+        model = MODELS[rng.below(10)];
+    }
+    Writer out{buf, buf + size};
+    switch (model)
+    {
+    case TEXT:
+        text(rng, out);
+        break;
+    case LOG:
+        logLines(rng, out, chunk);
+        break;
+    case JSON:
+        jsonLines(rng, out, chunk);
+        break;
+    case TELEMETRY:
+        telemetry(rng, out, chunk);
+        break;
+    case RANDOM:
+        randomBytes(rng, out);
+        break;
+    default:
+        letters(rng, out);
+    }
+}
+
+static inline const char *getOption(char **begin, char **end, const std::string &option)
+{
+    char **itr = std::find(begin, end, option);
+    if (itr != end && ++itr != end)
+        return *itr;
+    return nullptr;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    // the options (with their value) can be before or after the size and the name
+    std::vector<const char *> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--", 2) == 0)
+            ++i;
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() != 2)
     {
         usage(argv[0]);
         return -1;
     }
 
-    size_t numberOfKB = std::stol(argv[1]) * 1024 * 1024;
-    
-    std::srand(static_cast<unsigned int>(std::time(0)));
-    std::string fileOut(argv[2]);
-    std::ofstream outFile(fileOut);
+    size_t numberOfBytes = std::stol(args[0]) * 1024 * 1024;
+    std::string fileOut(args[1]);
 
-    if (!outFile)
+    const char *modelName = getOption(argv + 1, argv + argc, "--model");
+    static const char *const NAMES[] = {"text", "log", "json", "telemetry", "random", "letters", "mix"};
+    Model model = MIX;
+    if (modelName != nullptr)
     {
-        std::cerr << "Error opening file!" << std::endl;
-        return -1;
+        size_t m = std::find_if(std::begin(NAMES), std::end(NAMES), [&](const char *n)
+                                { return strcmp(n, modelName) == 0; }) - std::begin(NAMES);
+        if (m == sizeof(NAMES) / sizeof(NAMES[0]))
+        {
+            std::cerr << "Unknown model " << modelName << std::endl;
+            usage(argv[0]);
+            return -1;
+        }
+        model = (Model)m;
     }
+    // by default from the name of the file (FNV-1a), the files of a corpus are different
+    uint64_t seed = 1469598103934665603ULL;
+    std::string base = fileOut.substr(fileOut.rfind('/') + 1);
+    for (unsigned char c : base)
+        seed = (seed ^ c) * 1099511628211ULL;
+    if (const char *s = getOption(argv + 1, argv + argc, "--seed"))
+        seed = std::strtoull(s, nullptr, 10);
+    const char *dup = getOption(argv + 1, argv + argc, "--dup");
+    const double dupRatio = dup != nullptr ? std::atof(dup) : 0;
+    const char *threadsArg = getOption(argv + 1, argv + argc, "--threads");
+    size_t threads = threadsArg != nullptr ? std::strtoul(threadsArg, nullptr, 10) : std::thread::hardware_concurrency();
 
-    for (int i = 0; i < numberOfKB; ++i)
+    int fd = open(fileOut.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
-        char randomLetter = 'a' + std::rand() % 26; 
-        outFile << randomLetter;
+        std::cerr << "Error opening file!" << std::endl;
+        return -1;
     }
 
+    // the chunks that repeat an earlier one, and which one
+    const size_t chunks = (numberOfBytes + CHUNK - 1) / CHUNK;
+    std::vector<uint64_t> source(chunks);
+    Rng rng(seed);
+    for (size_t i = 0; i < chunks; ++i)
+        source[i] = i > 0 && rng.uniform() < dupRatio ? source[rng.below((uint32_t)i)] : i;
+
+    threads = std::max<size_t>(1, std::min(threads, chunks));
+    std::vector<std::thread> workers;
+    std::vector<int> errors(threads, 0);
+    for (size_t t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]()
+                             {
+            std::vector<unsigned char> buf(CHUNK);
+            for (size_t i = t; i < chunks && !errors[t]; i += threads)
+            {
+                size_t size = std::min(CHUNK, numberOfBytes - i * CHUNK);
+                generateChunk(model, seed, source[i], buf.data(), size);
+                for (size_t done = 0; done < size;)
+                {
+                    ssize_t n = pwrite(fd, buf.data() + done, size - done, i * CHUNK + done);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                    {
+                        errors[t] = errno;
+                        break;
+                    }
+                    done += n;
+                }
+            } });
+    for (auto &w : workers)
+        w.join();
+
     // Close the file
-    outFile.close();
+    bool ok = std::all_of(errors.begin(), errors.end(), [](int e)
+                          { return e == 0; });
+    if (close(fd) != 0 || !ok)
+    {
+        std::cerr << "Error writing file!" << std::endl;
+        return -1;
+    }
 
     return 0;
 }
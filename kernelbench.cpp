@@ -0,0 +1,460 @@
+#include <spawn.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <miniz.h>
+#include <utility.hpp>
+
+extern char **environ;
+
+// Microbenchmark of the compression kernels of minizip, without the files, the queues and the
+// threads of the engines: the blocks of a generated file of each data model are compressed
+// and decompressed in memory, one after the other in this thread, with each block size and
+// level of the sweep. The kernels are the ones of the engines (mz_compress2 and mz_uncompress,
+// that allocate a compressor for each block) and the tdefl/tinfl calls under them (tdefl with
+// a compressor reused for all the blocks), and the checksums of the blocks with each SIMD
+// level of miniz the CPU has (adler32_scalar, adler32_avx2, ...), that must give the same
+// results as the portable code; --simd limits the level used by the other kernels. For each
+// configuration the passes over the file are repeated for --time seconds and at least --reps
+// times, and the median is printed as MB/s of uncompressed data, cycles/byte (of the TSC) and
+// ratio. With --baseline the results are
+// compared with the CSV of a previous run, and a slower kernel or a worse ratio is an error.
+
+static inline void usage(const char *argv0)
+{
+  printf("--------------------\n");
+  printf("Usage: %s [options]\n", argv0);
+  printf("\nCorpus:\n");
+  printf("--models LIST     - Data models of generateTxt, a file each (default text,log,json,telemetry,random,mix)\n");
+  printf("--size MB         - Size of each file (default 4)\n");
+  printf("--gen CMD         - Generator of the files, run as CMD --model M MB FILE (default ./generateTxt)\n");
+  printf("\nSweep:\n");
+  printf("--blocks LIST     - Block sizes in KB (default 256,1024,2048)\n");
+  printf("--levels LIST     - Compression levels (default 1,6,9)\n");
+  printf("--kernels LIST    - Among mz_compress,tdefl,mz_uncompress,tinfl,adler32,crc32 (default all)\n");
+  printf("--simd LEVEL      - Highest SIMD level of the checksums in the other kernels: 0 portable, 1 SSSE3/PCLMULQDQ,\n");
+  printf("                    2 AVX2, 3 AVX-512 (default the best the CPU has)\n");
+  printf("--time SECONDS    - Minimum time of each configuration (default 0.2)\n");
+  printf("--reps N          - Minimum passes over the file of each configuration (default 3)\n");
+  printf("\nResults:\n");
+  printf("--out FILE        - CSV of the results (default kernelbench.csv)\n");
+  printf("--baseline FILE   - CSV of a previous run, a kernel slower than it is an error\n");
+  printf("--max-slowdown X  - Slowdown of the MB/s allowed with --baseline (default 1.10)\n");
+  printf("--max-ratio X     - Growth of the ratio allowed with --baseline (default 1.01)\n");
+  printf("--------------------\n");
+}
+
+static inline std::vector<std::string> splitList(const std::string &s, char sep)
+{
+  std::vector<std::string> items;
+  std::string item;
+  std::istringstream in(s);
+  while (std::getline(in, item, sep))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Runs the generator, its output goes to /dev/null
+static inline bool generate(const std::string &gen, const std::string &model, size_t sizeMB, const std::string &file)
+{
+  std::vector<std::string> args;
+  std::istringstream in(gen);
+  std::string w;
+  while (in >> w)
+    args.push_back(w);
+  args.insert(args.end(), {"--model", model, std::to_string(sizeMB), file});
+  std::vector<char *> argv;
+  for (auto &a : args)
+    argv.push_back(const_cast<char *>(a.c_str()));
+  argv.push_back(nullptr);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  pid_t pid;
+  int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0)
+  {
+    std::fprintf(stderr, "Cannot run %s: %s\n", argv[0], strerror(err));
+    return false;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The blocks of a file: the input, the compressed blocks of a level and the room to decompress
+struct Blocks
+{
+  const unsigned char *data;
+  size_t size, block;
+  std::vector<std::vector<unsigned char>> packed;
+  std::vector<unsigned char> out;
+  std::vector<mz_ulong> sums; // checksums of the blocks
+  size_t count() const { return (size + block - 1) / block; }
+  size_t length(size_t i) const { return std::min(block, size - i * block); }
+};
+
+// One pass of a kernel over the blocks, false if a block fails
+typedef bool (*Kernel)(Blocks &b, int level);
+
+static tdefl_compressor compressor; // reused by tdefl, about 300 KB
+
+static inline bool passCompress(Blocks &b, int level)
+{
+  for (size_t i = 0; i < b.count(); ++i)
+  {
+    mz_ulong len = b.packed[i].size();
+    if (mz_compress2(b.packed[i].data(), &len, b.data + i * b.block, b.length(i), level) != MZ_OK)
+      return false;
+    b.packed[i].resize(len);
+  }
+  return true;
+}
+
+static inline bool passTdefl(Blocks &b, int level)
+{
+  const mz_uint flags = tdefl_create_comp_flags_from_zip_params(level, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+  for (size_t i = 0; i < b.count(); ++i)
+  {
+    size_t in = b.length(i), len = b.packed[i].size();
+    if (tdefl_init(&compressor, nullptr, nullptr, flags) != TDEFL_STATUS_OKAY ||
+        tdefl_compress(&compressor, b.data + i * b.block, &in, b.packed[i].data(), &len, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+      return false;
+    b.packed[i].resize(len);
+  }
+  return true;
+}
+
+static inline bool passUncompress(Blocks &b, int)
+{
+  for (size_t i = 0; i < b.count(); ++i)
+  {
+    mz_ulong len = b.length(i);
+    if (mz_uncompress(b.out.data() + i * b.block, &len, b.packed[i].data(), b.packed[i].size()) != MZ_OK || len != b.length(i))
+      return false;
+  }
+  return true;
+}
+
+static inline bool passTinfl(Blocks &b, int)
+{
+  for (size_t i = 0; i < b.count(); ++i)
+  {
+    size_t len = tinfl_decompress_mem_to_mem(b.out.data() + i * b.block, b.length(i), b.packed[i].data(), b.packed[i].size(),
+                                             TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32);
+    if (len != b.length(i))
+      return false;
+  }
+  return true;
+}
+
+static inline bool passAdler32(Blocks &b, int)
+{
+  for (size_t i = 0; i < b.count(); ++i)
+    b.sums[i] = mz_adler32(MZ_ADLER32_INIT, b.data + i * b.block, b.length(i));
+  return true;
+}
+
+static inline bool passCrc32(Blocks &b, int)
+{
+  for (size_t i = 0; i < b.count(); ++i)
+    b.sums[i] = mz_crc32(MZ_CRC32_INIT, b.data + i * b.block, b.length(i));
+  return true;
+}
+
+enum KernelKind
+{
+  COMPRESS,
+  DECOMPRESS,
+  CHECKSUM
+};
+
+struct KernelInfo
+{
+  const char *name;
+  Kernel pass;
+  KernelKind kind;
+};
+static const KernelInfo kernels[] = {{"mz_compress", passCompress, COMPRESS},
+                                     {"tdefl", passTdefl, COMPRESS},
+                                     {"mz_uncompress", passUncompress, DECOMPRESS},
+                                     {"tinfl", passTinfl, DECOMPRESS},
+                                     {"adler32", passAdler32, CHECKSUM},
+                                     {"crc32", passCrc32, CHECKSUM}};
+
+// A kernel of the sweep, the checksums once for each SIMD level
+struct KernelRun
+{
+  std::string name;
+  const KernelInfo *info;
+  int simd; // -1 for the level of --simd
+};
+static const char *const simdNames[] = {"scalar", "sse", "avx2", "avx512"};
+
+struct Result
+{
+  std::string model, kernel;
+  long blockKB, level;
+  double mbs, cyclesPerByte, ratio;
+};
+
+static inline std::string key(const std::string &model, long blockKB, long level, const std::string &kernel)
+{
+  return model + "," + std::to_string(blockKB) + "," + std::to_string(level) + "," + kernel;
+}
+
+// The CSV of a previous run, by model,block_kb,level,kernel: MB/s and ratio
+static inline std::map<std::string, std::pair<double, double>> readCsv(const std::string &path)
+{
+  std::map<std::string, std::pair<double, double>> rows;
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line); // header
+  while (std::getline(in, line))
+  {
+    std::vector<std::string> f = splitList(line, ',');
+    if (f.size() >= 7)
+      rows[f[0] + "," + f[1] + "," + f[2] + "," + f[3]] = {std::atof(f[4].c_str()), std::atof(f[6].c_str())};
+  }
+  return rows;
+}
+
+int main(int argc, char *argv[])
+{
+  if (hasOption(argv + 1, argv + argc, "-h") || hasOption(argv + 1, argv + argc, "--help"))
+  {
+    usage(argv[0]);
+    return 0;
+  }
+  auto option = [&](const char *name, const char *def)
+  {
+    const char *v = getOption(argv + 1, argv + argc, name);
+    return std::string(v != nullptr ? v : def);
+  };
+  auto numbers = [&](const char *name, const char *def)
+  {
+    std::vector<long> n;
+    for (auto &item : splitList(option(name, def), ','))
+    {
+      long v;
+      if (!isNumber(item.c_str(), v) || v < 0)
+      {
+        std::fprintf(stderr, "Invalid number %s in %s\n", item.c_str(), name);
+        exit(-1);
+      }
+      n.push_back(v);
+    }
+    return n;
+  };
+  const std::vector<std::string> models = splitList(option("--models", "text,log,json,telemetry,random,mix"), ',');
+  const size_t sizeMB = numbers("--size", "4").at(0);
+  const std::vector<long> blocks = numbers("--blocks", "256,1024,2048");
+  const std::vector<long> levels = numbers("--levels", "1,6,9");
+  const std::vector<std::string> kernelNames = splitList(option("--kernels", "mz_compress,tdefl,mz_uncompress,tinfl,adler32,crc32"), ',');
+  const int cpuSimd = mz_simd_level(-1);
+  const int simd = mz_simd_level(std::atoi(option("--simd", std::to_string(cpuSimd).c_str()).c_str()));
+  const double minTime = std::atof(option("--time", "0.2").c_str());
+  const size_t reps = std::max<long>(numbers("--reps", "3").at(0), 1);
+  const std::string outPath = option("--out", "kernelbench.csv");
+  const char *baseline = getOption(argv + 1, argv + argc, "--baseline");
+  const double maxSlowdown = std::atof(option("--max-slowdown", "1.10").c_str());
+  const double maxRatio = std::atof(option("--max-ratio", "1.01").c_str());
+  std::string self(argv[0]);
+  const std::string exeDir = self.find('/') == std::string::npos ? "./" : self.substr(0, self.rfind('/') + 1);
+  const std::string gen = option("--gen", (exeDir + "generateTxt").c_str());
+
+  std::vector<KernelRun> selected;
+  for (auto &name : kernelNames)
+  {
+    auto it = std::find_if(std::begin(kernels), std::end(kernels), [&](const KernelInfo &k)
+                           { return name == k.name; });
+    if (it == std::end(kernels))
+    {
+      std::fprintf(stderr, "Unknown kernel %s\n\n", name.c_str());
+      usage(argv[0]);
+      return -1;
+    }
+    if (it->kind != CHECKSUM)
+      selected.push_back({it->name, &*it, -1});
+    else
+      for (int level = MZ_SIMD_NONE; level <= cpuSimd; ++level)
+        // CRC-32 has no AVX2 code
+        if (!(it->pass == passCrc32 && level == MZ_SIMD_AVX2))
+          selected.push_back({std::string(it->name) + "_" + simdNames[level], &*it, level});
+  }
+  if (sizeMB == 0 || std::find(blocks.begin(), blocks.end(), 0) != blocks.end())
+  {
+    std::fprintf(stderr, "The size and the blocks must be greater than 0\n");
+    return -1;
+  }
+
+  std::string dir = "/tmp/minizip_kernelbench.";
+  if (!createTmpDir(dir))
+    return -1;
+
+  // ticks per second, for the cycles/byte
+  const auto t0 = std::chrono::steady_clock::now();
+  const uint64_t k0 = ticks();
+  std::vector<Result> results;
+  bool success = true;
+  std::printf("SIMD level of the checksums: %s (the CPU has %s)\n", simdNames[simd], simdNames[cpuSimd]);
+  std::printf("%-10s %8s %5s %-16s %10s %12s %8s\n", "model", "block_kb", "level", "kernel", "MB/s", "cycles/byte", "ratio");
+  for (auto &model : models)
+  {
+    const std::string file = dir + "/" + model;
+    if (!generate(gen, model, sizeMB, file))
+    {
+      std::fprintf(stderr, "Cannot generate the %s file with %s\n", model.c_str(), gen.c_str());
+      success = false;
+      continue;
+    }
+    size_t size = 0;
+    unsigned char *data = nullptr;
+    if (!mapFile(file.c_str(), size, data))
+    {
+      success = false;
+      continue;
+    }
+    for (long blockKB : blocks)
+      for (long level : levels)
+      {
+        Blocks b;
+        b.data = data;
+        b.size = size;
+        b.block = blockKB * 1024;
+        b.out.resize(size);
+        b.packed.resize(b.count());
+        // the compressed blocks of the decompression kernels, and the round trip of them
+        for (size_t i = 0; i < b.count(); ++i)
+          b.packed[i].resize(compressBound(b.length(i)));
+        if (!passTdefl(b, level) || !passTinfl(b, level) || memcmp(b.out.data(), data, size) != 0)
+        {
+          std::fprintf(stderr, "The blocks of %s do not come back equal (block %ld KB, level %ld)\n", model.c_str(), blockKB, level);
+          success = false;
+          continue;
+        }
+        const std::vector<std::vector<unsigned char>> packed = b.packed;
+        // the checksums of the portable code, the SIMD ones must be the same
+        std::vector<mz_ulong> adler32(b.count()), crc32(b.count());
+        mz_simd_level(MZ_SIMD_NONE);
+        b.sums.resize(b.count());
+        passAdler32(b, level);
+        adler32.swap(b.sums);
+        b.sums.resize(b.count());
+        passCrc32(b, level);
+        crc32.swap(b.sums);
+        b.sums.resize(b.count());
+        for (auto &run : selected)
+        {
+          const KernelInfo *k = run.info;
+          // the checksums do not depend on the level
+          if (k->kind == CHECKSUM && level != levels[0])
+            continue;
+          mz_simd_level(run.simd >= 0 ? run.simd : simd);
+          std::vector<double> seconds;
+          std::vector<uint64_t> cycles;
+          double total = 0;
+          bool ok = true;
+          while (ok && (seconds.size() < reps || total < minTime))
+          {
+            if (k->kind == COMPRESS)
+              for (size_t i = 0; i < b.count(); ++i)
+                b.packed[i].resize(compressBound(b.length(i)));
+            const auto start = std::chrono::steady_clock::now();
+            const uint64_t begin = ticks();
+            ok = k->pass(b, level);
+            cycles.push_back(ticks() - begin);
+            seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            total += seconds.back();
+          }
+          mz_simd_level(simd);
+          // the output of the compressors must be decompressed back by tinfl
+          if (ok && k->kind == COMPRESS)
+            ok = passTinfl(b, level) && memcmp(b.out.data(), data, size) == 0;
+          if (ok && k->kind == DECOMPRESS)
+            ok = memcmp(b.out.data(), data, size) == 0;
+          if (ok && k->kind == CHECKSUM)
+            ok = b.sums == (k->pass == passAdler32 ? adler32 : crc32);
+          size_t packedBytes = 0;
+          for (auto &p : b.packed)
+            packedBytes += p.size();
+          b.packed = packed;
+          if (!ok)
+          {
+            std::fprintf(stderr, "%s failed on %s (block %ld KB, level %ld)\n", run.name.c_str(), model.c_str(), blockKB, level);
+            success = false;
+            continue;
+          }
+          std::sort(seconds.begin(), seconds.end());
+          std::sort(cycles.begin(), cycles.end());
+          Result r{model, run.name, blockKB, k->kind == CHECKSUM ? 0 : level, 0, 0, 0};
+          r.mbs = size / (1024.0 * 1024.0) / seconds[seconds.size() / 2];
+          r.cyclesPerByte = (double)cycles[cycles.size() / 2] / size;
+          r.ratio = k->kind == CHECKSUM ? 0 : (double)packedBytes / size;
+          std::printf("%-10s %8ld %5ld %-16s %10.1f %12.2f %8.4f\n", model.c_str(), blockKB, r.level, r.kernel.c_str(), r.mbs, r.cyclesPerByte, r.ratio);
+          results.push_back(r);
+        }
+      }
+    unmapFile(data, size);
+    unlink(file.c_str());
+  }
+  rmdir(dir.c_str());
+  const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::printf("TSC: %.0f MHz\n", (ticks() - k0) / elapsed / 1e6);
+
+  // CSV, and the comparison with the baseline
+  std::ofstream out(outPath);
+  out << "model,block_kb,level,kernel,mb_s,cycles_per_byte,ratio\n";
+  std::map<std::string, std::pair<double, double>> old;
+  if (baseline != nullptr)
+    old = readCsv(baseline);
+  bool regression = false;
+  for (auto &r : results)
+  {
+    const std::string k = key(r.model, r.blockKB, r.level, r.kernel);
+    out << k << "," << r.mbs << "," << r.cyclesPerByte << "," << r.ratio << "\n";
+    auto it = old.find(k);
+    if (it == old.end())
+      continue;
+    if (r.mbs * maxSlowdown < it->second.first)
+    {
+      std::printf("REGRESSION %s: %.1f MB/s, was %.1f MB/s\n", k.c_str(), r.mbs, it->second.first);
+      regression = true;
+    }
+    if (r.ratio > it->second.second * maxRatio)
+    {
+      std::printf("REGRESSION %s: ratio %.4f, was %.4f\n", k.c_str(), r.ratio, it->second.second);
+      regression = true;
+    }
+  }
+  std::printf("Results in %s\n", outPath.c_str());
+
+  if (!success)
+  {
+    printf("Exiting with (some) Error(s)\n");
+    return -1;
+  }
+  return regression ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+#if !defined _MANIFEST_HPP
+#define _MANIFEST_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <miniz/miniz.h>
+
+// Incremental compression (-i) ---------------------------------------------------------------
+
+// The manifest is written in the compressed directory and lists the files compressed by the
+// previous runs. A file whose size, mtime and inode are the same (or whose content hash is
+// the same, if only the size is) and whose compressed file is still there is not compressed
+// again. The file is used as it is mapped in memory:
+// [header][count records sorted by (pathHash, path)][paths]
+static const char MANIFEST_NAME[] = ".miniz_manifest";
+static const char MANIFEST_MAGIC[8] = {'M', 'Z', 'M', 'A', 'N', 'I', 'F', '1'};
+
+struct ManifestHeader
+{
+	char magic[8];
+	uint64_t count;
+	uint64_t pathBytes;
+};
+
+struct ManifestRecord
+{
+	uint64_t pathHash;
+	uint64_t pathOffset; // in the paths, after the records
+	uint64_t pathLength;
+	uint64_t size;		 // of the file
+	int64_t mtime;		 // of the file, in nanoseconds
+	uint64_t inode;
+	uint64_t hash;		 // of the content of the file
+	uint64_t outSize;	 // of the compressed file
+};
+
+static inline uint64_t pathHash(const std::string &path)
+{
+	// FNV-1a
+	uint64_t h = 1469598103934665603ULL;
+	for (unsigned char c : path)
+		h = (h ^ c) * 1099511628211ULL;
+	return h;
+}
+
+static inline int64_t mtimeOf(const struct stat &st)
+{
+	return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// The hash of the content is crc32 << 32 | adler32. The engines hash each block while they
+// compress it and combine the hashes of the blocks in their order, as zlib does.
+static const uint64_t CONTENT_HASH_INIT = (uint64_t)MZ_CRC32_INIT << 32 | MZ_ADLER32_INIT;
+
+static inline uint64_t contentHashBlock(const unsigned char *ptr, size_t size)
+{
+	const uint64_t crc = mz_crc32(MZ_CRC32_INIT, ptr, size);
+	const uint64_t adler = mz_adler32(MZ_ADLER32_INIT, ptr, size);
+	return (crc << 32) | (adler & 0xffffffffULL);
+}
+
+// a * b modulo the polynomial of crc32 (reflected)
+static inline uint32_t crc32MultModP(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320U : b >> 1;
+	}
+	return p;
+}
+
+static inline uint32_t crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	// x^(8 len2): the crc of the first part is shifted by the bytes of the second one
+	uint32_t x2n = 1U << 30, p = 1U << 31; // x^1, x^0
+	for (uint64_t n = len2 * 8; n != 0; n >>= 1)
+	{
+		if (n & 1)
+			p = crc32MultModP(x2n, p);
+		x2n = crc32MultModP(x2n, x2n);
+	}
+	return crc32MultModP(p, crc1) ^ crc2;
+}
+
+static inline uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, uint64_t len2)
+{
+	const uint32_t BASE = 65521;
+	const uint32_t rem = len2 % BASE;
+	uint32_t sum1 = adler1 & 0xffff;
+	uint32_t sum2 = (uint64_t)rem * sum1 % BASE;
+	sum1 += (adler2 & 0xffff) + BASE - 1;
+	sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + BASE - rem;
+	if (sum1 >= BASE)
+		sum1 -= BASE;
+	if (sum1 >= BASE)
+		sum1 -= BASE;
+	if (sum2 >= (BASE << 1))
+		sum2 -= (BASE << 1);
+	if (sum2 >= BASE)
+		sum2 -= BASE;
+	return sum1 | (sum2 << 16);
+}
+
+// The hash of the content of a followed by b, of len2 bytes
+static inline uint64_t contentHashCombine(uint64_t a, uint64_t b, uint64_t len2)
+{
+	const uint64_t crc = crc32Combine(a >> 32, b >> 32, len2);
+	const uint64_t adler = adler32Combine(a & 0xffffffffULL, b & 0xffffffffULL, len2);
+	return (crc << 32) | adler;
+}
+
+// crc32 and adler32 of the content of the file, 0 if it cannot be read
+static inline uint64_t contentHash(const std::string &path, size_t size)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	uint64_t crc = MZ_CRC32_INIT, adler = MZ_ADLER32_INIT;
+	if (size > 0)
+	{
+		void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED)
+		{
+			close(fd);
+			return 0;
+		}
+		madvise(ptr, size, MADV_SEQUENTIAL);
+		crc = mz_crc32(crc, (const unsigned char *)ptr, size);
+		adler = mz_adler32(adler, (const unsigned char *)ptr, size);
+		munmap(ptr, size);
+	}
+	close(fd);
+	return (crc << 32) | (adler & 0xffffffffULL);
+}
+
+class Manifest
+{
+public:
+	// dir is the directory compressed, the keys of the files are relative to it
+	Manifest(const char dir[], const std::string &outSuffix) : outSuffix(outSuffix)
+	{
+		char *real = realpath(dir, nullptr);
+		root = std::string(real != nullptr ? real : dir) + "/";
+		free(real);
+	}
+	~Manifest()
+	{
+		if (base != nullptr)
+			munmap(base, mappedSize);
+	}
+
+	// Maps the manifest of a previous run, if there is one
+	bool load()
+	{
+		const std::string path = root + MANIFEST_NAME;
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return errno == ENOENT;
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ManifestHeader);
+		if (ok)
+		{
+			void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			ok = ptr != MAP_FAILED;
+			if (ok)
+			{
+				base = (unsigned char *)ptr;
+				mappedSize = st.st_size;
+			}
+		}
+		close(fd);
+		if (!ok)
+			return false;
+		const ManifestHeader *h = (const ManifestHeader *)base;
+		if (memcmp(h->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0 ||
+			h->count > mappedSize / sizeof(ManifestRecord) || h->pathBytes > mappedSize ||
+			sizeof(ManifestHeader) + h->count * sizeof(ManifestRecord) + h->pathBytes != mappedSize)
+		{
+			std::fprintf(stderr, "Ignoring the invalid manifest %s\n", path.c_str());
+			return true;
+		}
+		records = (const ManifestRecord *)(base + sizeof(ManifestHeader));
+		count = h->count;
+		paths = (const char *)(records + count);
+		pathBytes = h->pathBytes;
+		return true;
+	}
+
+	// True if the file (key in the manifest, found at path from the current directory) does
+	// not need to be compressed again. In that case it is kept in the next manifest.
+	bool unchanged(const std::string &key, const std::string &path, const struct stat &st)
+	{
+		const ManifestRecord *r = find(key);
+		if (r == nullptr || r->size != (uint64_t)st.st_size)
+			return false;
+		struct stat out;
+		if (stat((path + outSuffix).c_str(), &out) != 0 || (uint64_t)out.st_size != r->outSize)
+			return false;
+		Entry e{key, *r};
+		if (r->mtime != mtimeOf(st) || r->inode != (uint64_t)st.st_ino)
+		{
+			// touched or copied: the content decides
+			if (contentHash(path, st.st_size) != r->hash)
+				return false;
+			e.record.mtime = mtimeOf(st);
+			e.record.inode = st.st_ino;
+		}
+		next.push_back(e);
+		return true;
+	}
+
+	// The file is going to be compressed
+	void add(const std::string &key, const struct stat &st)
+	{
+		ManifestRecord r = {};
+		r.size = st.st_size;
+		r.mtime = mtimeOf(st);
+		r.inode = st.st_ino;
+		addedAt[key] = next.size();
+		next.push_back(Entry{key, r, true});
+	}
+
+	// The engine has written and closed the compressed file of key, hash is the content that
+	// it has compressed. After the walk it can be called by several threads, for different files.
+	void done(const std::string &key, uint64_t hash)
+	{
+		auto it = addedAt.find(key);
+		if (it == addedAt.end())
+			return;
+		next[it->second].record.hash = hash;
+		next[it->second].done = true;
+	}
+
+	// Writes the manifest of this run. The files added that the engine has not confirmed with
+	// done are left out (their old record too), so they will be compressed by the next run.
+	bool save()
+	{
+		const std::string path = root + MANIFEST_NAME;
+		std::vector<Entry> entries;
+		entries.reserve(next.size());
+		for (auto &e : next)
+		{
+			if (e.added)
+			{
+				struct stat out;
+				if (!e.done || stat((root + e.path + outSuffix).c_str(), &out) != 0)
+					continue;
+				e.record.outSize = out.st_size;
+			}
+			e.record.pathHash = pathHash(e.path);
+			entries.push_back(e);
+		}
+		std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+				  { return a.record.pathHash != b.record.pathHash ? a.record.pathHash < b.record.pathHash : a.path < b.path; });
+
+		ManifestHeader h;
+		memcpy(h.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+		h.count = entries.size();
+		h.pathBytes = 0;
+		for (auto &e : entries)
+		{
+			e.record.pathOffset = h.pathBytes;
+			e.record.pathLength = e.path.size();
+			h.pathBytes += e.path.size();
+		}
+
+		// written aside and renamed, so an interrupted run leaves the old manifest
+		std::string tmp = path + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (f == nullptr)
+		{
+			perror("fopen");
+			std::fprintf(stderr, "Failed opening the manifest %s\n", tmp.c_str());
+			return false;
+		}
+		bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+		for (size_t i = 0; ok && i < entries.size(); ++i)
+			ok = fwrite(&entries[i].record, sizeof(ManifestRecord), 1, f) == 1;
+		for (size_t i = 0; ok && i < entries.size(); ++i)
+			ok = fwrite(entries[i].path.data(), 1, entries[i].path.size(), f) == entries[i].path.size();
+		ok &= fclose(f) == 0;
+		if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+		{
+			perror("manifest");
+			std::fprintf(stderr, "Failed writing the manifest %s\n", path.c_str());
+			unlink(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	size_t kept() const { return next.size() - added(); }
+	size_t added() const
+	{
+		return std::count_if(next.begin(), next.end(), [](const Entry &e)
+							 { return e.added; });
+	}
+
+private:
+	struct Entry
+	{
+		std::string path;
+		ManifestRecord record;
+		bool added = false;
+		bool done = false; // added, and written by the engine
+	};
+
+	const ManifestRecord *find(const std::string &key) const
+	{
+		uint64_t h = pathHash(key);
+		const ManifestRecord *r = std::lower_bound(records, records + count, h, [](const ManifestRecord &a, uint64_t h)
+												   { return a.pathHash < h; });
+		for (; r != records + count && r->pathHash == h; ++r)
+			if (r->pathLength == key.size() && r->pathOffset + r->pathLength <= pathBytes && memcmp(paths + r->pathOffset, key.data(), key.size()) == 0)
+				return r;
+		return nullptr;
+	}
+
+	unsigned char *base = nullptr;
+	size_t mappedSize = 0;
+	const ManifestRecord *records = nullptr;
+	size_t count = 0;
+	const char *paths = nullptr;
+	size_t pathBytes = 0;
+	std::string root;			 // absolute path of the directory, with the final '/'
+	const std::string outSuffix; // of the compressed files
+	std::vector<Entry> next;
+	std::unordered_map<std::string, size_t> addedAt; // index in next of the files added
+};
+
+#endif
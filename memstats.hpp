@@ -0,0 +1,315 @@
+#if !defined _MEMSTATS_HPP
+#define _MEMSTATS_HPP
+
+#include <malloc.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <perfcounters.hpp>
+
+// Memory of the stages and of the files (--memory [MS]) --------------------------------------
+
+// With -DMINIZIP_MEMSTATS (make memstats) operator new and delete are replaced by ones that put
+// the size and the stage of the thread (MemoryStage) in front of each allocation, so the bytes
+// alive, their peak and the bytes
+// allocated are counted for the stage that allocated them, also when another thread frees
+// them (the blocks compressed by the R_Workers and written by the L_Workers). The mappings
+// and the buffers held for a file are counted by the engines with memoryFile, the peak of
+// each file is the memory a job needs for it. A thread samples the resident memory of the
+// process (anonymous and file pages, the latter are the mapped inputs) and the bytes in use
+// by malloc, which include the compressors of miniz, every MS milliseconds. Without --memory
+// an allocation costs the test of memoryEnabled and 16 bytes. The default builds keep the
+// allocator of the system and ignore --memory.
+// The replacements cannot be inline: a second translation unit with them does not link.
+
+static const int MEMORY_STAGES = STAGES + 1; // and "other": main, setup, the threads of the runtime
+static const char *const memoryStageNames[MEMORY_STAGES] = {"split", "compress", "decompress", "write", "other"};
+
+struct alignas(64) MemoryCounter
+{
+	std::atomic<int64_t> live{0}, peak{0}, allocated{0}, allocations{0};
+};
+
+struct MemoryFile
+{
+	std::atomic<int64_t> live{0}, peak{0}, mapped{0};
+};
+
+static bool memoryEnabled = false;
+static MemoryCounter memoryStages[MEMORY_STAGES];
+static MemoryCounter memoryHeap;   // all the stages
+static MemoryCounter memoryMapped; // the mappings of the files
+static std::unique_ptr<MemoryFile[]> memoryFileTable;
+static size_t memoryFileCount = 0;
+static thread_local int memoryStage = STAGES;
+
+// Peaks of the process, sampled (rss, anon, file, malloc) or exact, in bytes
+static std::atomic<int64_t> memoryRss{0}, memoryRssAnon{0}, memoryRssFile{0}, memoryMalloc{0};
+static std::atomic<bool> memoryStopping{false};
+static std::thread memorySampler;
+
+static inline void memoryPeak(std::atomic<int64_t> &peak, int64_t value)
+{
+	int64_t old = peak.load(std::memory_order_relaxed);
+	while (value > old && !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+		;
+}
+
+static inline void memoryCount(MemoryCounter &c, int64_t bytes)
+{
+	memoryPeak(c.peak, c.live.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	if (bytes > 0)
+	{
+		c.allocated.fetch_add(bytes, std::memory_order_relaxed);
+		c.allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+// The stage of the allocations of the calling thread, from its construction to the end of the scope
+class MemoryStage
+{
+public:
+	MemoryStage(Stage stage) : previous(memoryStage) { memoryStage = stage; }
+	~MemoryStage() { memoryStage = previous; }
+	MemoryStage(const MemoryStage &) = delete;
+	MemoryStage &operator=(const MemoryStage &) = delete;
+
+private:
+	int previous;
+};
+
+// --memory needs the replacements of new and delete, warns (if verbose) when they are not there
+static inline bool memoryAvailable(const char *program, bool verbose = true)
+{
+#if defined(MINIZIP_MEMSTATS)
+	(void)program;
+	(void)verbose;
+	return true;
+#else
+	if (verbose)
+		std::fprintf(stderr, "--memory is not available in this build, use make %s_memstats\n", program);
+	return false;
+#endif
+}
+
+#if defined(MINIZIP_MEMSTATS)
+// Header in front of each allocation: its size and the stage that counted it (MEMORY_STAGES
+// if it was allocated without --memory and is not counted)
+struct MemoryHeader
+{
+	uint64_t size;
+	uint32_t stage;
+	uint32_t unused;
+};
+static_assert(sizeof(MemoryHeader) == 16, "the allocations keep the alignment of malloc");
+
+static inline void *memoryAlloc(size_t size, size_t align)
+{
+	const size_t offset = std::max(align, sizeof(MemoryHeader));
+	void *base = align <= sizeof(MemoryHeader) ? malloc(size + offset) : aligned_alloc(align, (size + offset + align - 1) / align * align);
+	if (base == nullptr)
+		return nullptr;
+	MemoryHeader *h = (MemoryHeader *)((char *)base + offset) - 1;
+	h->size = size;
+	h->stage = MEMORY_STAGES;
+	if (memoryEnabled)
+	{
+		h->stage = memoryStage;
+		memoryCount(memoryStages[memoryStage], size);
+		memoryCount(memoryHeap, size);
+	}
+	return (char *)base + offset;
+}
+
+static inline void memoryFree(void *ptr, size_t align)
+{
+	if (ptr == nullptr)
+		return;
+	const MemoryHeader *h = (const MemoryHeader *)ptr - 1;
+	if (h->stage < MEMORY_STAGES)
+	{
+		memoryCount(memoryStages[h->stage], -(int64_t)h->size);
+		memoryCount(memoryHeap, -(int64_t)h->size);
+	}
+	free((char *)ptr - std::max(align, sizeof(MemoryHeader)));
+}
+
+static inline void *memoryNew(size_t size, size_t align)
+{
+	void *ptr = memoryAlloc(size, align);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new(size_t size) { return memoryNew(size, 0); }
+void *operator new[](size_t size) { return memoryNew(size, 0); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return memoryAlloc(size, 0); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return memoryAlloc(size, 0); }
+void *operator new(size_t size, std::align_val_t align) { return memoryNew(size, (size_t)align); }
+void *operator new[](size_t size, std::align_val_t align) { return memoryNew(size, (size_t)align); }
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return memoryAlloc(size, (size_t)align); }
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return memoryAlloc(size, (size_t)align); }
+void operator delete(void *ptr) noexcept { memoryFree(ptr, 0); }
+void operator delete[](void *ptr) noexcept { memoryFree(ptr, 0); }
+void operator delete(void *ptr, size_t) noexcept { memoryFree(ptr, 0); }
+void operator delete[](void *ptr, size_t) noexcept { memoryFree(ptr, 0); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { memoryFree(ptr, 0); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { memoryFree(ptr, 0); }
+void operator delete(void *ptr, std::align_val_t align) noexcept { memoryFree(ptr, (size_t)align); }
+void operator delete[](void *ptr, std::align_val_t align) noexcept { memoryFree(ptr, (size_t)align); }
+void operator delete(void *ptr, size_t, std::align_val_t align) noexcept { memoryFree(ptr, (size_t)align); }
+void operator delete[](void *ptr, size_t, std::align_val_t align) noexcept { memoryFree(ptr, (size_t)align); }
+void operator delete(void *ptr, std::align_val_t align, const std::nothrow_t &) noexcept { memoryFree(ptr, (size_t)align); }
+void operator delete[](void *ptr, std::align_val_t align, const std::nothrow_t &) noexcept { memoryFree(ptr, (size_t)align); }
+#endif
+
+// Bytes held for the file id (mapped if they are its mapping), negative when they are released
+static inline void memoryFile(size_t id, int64_t bytes, bool mapped = false)
+{
+	if (!memoryEnabled || id >= memoryFileCount)
+		return;
+	MemoryFile &f = memoryFileTable[id];
+	memoryPeak(f.peak, f.live.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	if (mapped)
+	{
+		memoryPeak(f.mapped, bytes);
+		memoryCount(memoryMapped, bytes);
+	}
+}
+
+// Reads the resident memory of the process and the bytes in use by malloc
+static inline void memorySample()
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f != nullptr)
+	{
+		char line[256];
+		long long kb;
+		while (fgets(line, sizeof(line), f) != nullptr)
+		{
+			if (sscanf(line, "VmRSS: %lld", &kb) == 1)
+				memoryPeak(memoryRss, kb * 1024);
+			else if (sscanf(line, "RssAnon: %lld", &kb) == 1)
+				memoryPeak(memoryRssAnon, kb * 1024);
+			else if (sscanf(line, "RssFile: %lld", &kb) == 1)
+				memoryPeak(memoryRssFile, kb * 1024);
+		}
+		fclose(f);
+	}
+	const struct mallinfo2 m = mallinfo2();
+	memoryPeak(memoryMalloc, m.uordblks + m.hblkhd);
+}
+
+// Starts counting, with files the number of files of memoryFile and a sample every interval
+// milliseconds. Must be called before starting the threads.
+static inline void memoryStart(size_t files, double interval)
+{
+	memoryFileTable.reset(new MemoryFile[files]);
+	memoryFileCount = files;
+	memoryEnabled = true;
+	memoryStopping = false;
+	memorySampler = std::thread([interval]()
+								{
+		while (!memoryStopping)
+		{
+			memorySample();
+			std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(interval));
+		} });
+}
+
+static inline void memoryStop()
+{
+	if (!memorySampler.joinable())
+		return;
+	memoryStopping = true;
+	memorySampler.join();
+	memorySample();
+}
+
+// What --memory prints for a process, in bytes (doubles, so the MPI ranks can send them)
+struct MemoryPeaks
+{
+	double rssHighWater, rss, rssAnon, rssFile, malloc, heap, mapped;
+	double stagePeak[MEMORY_STAGES], stageAllocated[MEMORY_STAGES], stageAllocations[MEMORY_STAGES];
+};
+
+static inline MemoryPeaks memoryPeaks()
+{
+	MemoryPeaks p = {};
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f != nullptr)
+	{
+		char line[256];
+		long long kb;
+		while (fgets(line, sizeof(line), f) != nullptr)
+			if (sscanf(line, "VmHWM: %lld", &kb) == 1)
+				p.rssHighWater = kb * 1024.0;
+		fclose(f);
+	}
+	p.rss = memoryRss;
+	p.rssAnon = memoryRssAnon;
+	p.rssFile = memoryRssFile;
+	p.malloc = memoryMalloc;
+	p.heap = memoryHeap.peak;
+	p.mapped = memoryMapped.peak;
+	for (int s = 0; s < MEMORY_STAGES; ++s)
+	{
+		p.stagePeak[s] = memoryStages[s].peak;
+		p.stageAllocated[s] = memoryStages[s].allocated;
+		p.stageAllocations[s] = memoryStages[s].allocations;
+	}
+	return p;
+}
+
+// The peaks of the process and a line for each stage that has allocated, label is the rank:
+// Memory: rss high-water 512.00 MB, sampled rss 500.00 MB (anon 300.00 MB, file 200.00 MB), malloc ..., new ..., mapped ...
+// Memory compress: peak 48.00 MB, allocated 512.00 MB in 256 allocations
+static inline void printMemoryPeaks(const MemoryPeaks &p, const std::string &label = "")
+{
+	const double MB = 1024.0 * 1024.0;
+	const std::string tag = label.empty() ? "" : " [" + label + "]";
+	std::printf("Memory%s: rss high-water %.2f MB, sampled rss %.2f MB (anon %.2f MB, file %.2f MB), malloc %.2f MB, new %.2f MB, mapped %.2f MB\n",
+				tag.c_str(), p.rssHighWater / MB, p.rss / MB, p.rssAnon / MB, p.rssFile / MB, p.malloc / MB, p.heap / MB, p.mapped / MB);
+	for (int s = 0; s < MEMORY_STAGES; ++s)
+		if (p.stageAllocations[s] > 0)
+			std::printf("Memory%s %s: peak %.2f MB, allocated %.2f MB in %.0f allocations\n", tag.c_str(), memoryStageNames[s],
+						p.stagePeak[s] / MB, p.stageAllocated[s] / MB, p.stageAllocations[s]);
+}
+
+// The memory of the files of memoryFile: the largest and the mean, and the 10 largest files
+// Memory files: 6, largest 26.00 MB (big.txt), mean 20.00 MB
+// Memory file big.txt: peak 26.00 MB (mapped 12.00 MB)
+static inline void printMemoryFiles(const std::vector<std::string> &names)
+{
+	const double MB = 1024.0 * 1024.0;
+	std::vector<size_t> files;
+	double total = 0;
+	for (size_t i = 0; i < std::min(memoryFileCount, names.size()); ++i)
+		if (memoryFileTable[i].peak > 0)
+		{
+			files.push_back(i);
+			total += memoryFileTable[i].peak;
+		}
+	if (files.empty())
+		return;
+	std::sort(files.begin(), files.end(), [](size_t a, size_t b)
+			  { return memoryFileTable[a].peak > memoryFileTable[b].peak; });
+	std::printf("Memory files: %zu, largest %.2f MB (%s), mean %.2f MB\n", files.size(), memoryFileTable[files[0]].peak / MB,
+				names[files[0]].c_str(), total / files.size() / MB);
+	for (size_t k = 0; k < std::min<size_t>(files.size(), 10); ++k)
+		std::printf("Memory file %s: peak %.2f MB (mapped %.2f MB)\n", names[files[k]].c_str(), memoryFileTable[files[k]].peak / MB,
+					memoryFileTable[files[k]].mapped / MB);
+}
+
+#endif
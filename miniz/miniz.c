@@ -36,12 +36,10 @@ extern "C" {
 
 /* ------------------- zlib-style API's */
 
-mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+static mz_uint32 mz_adler32_scalar(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
 {
-    mz_uint32 i, s1 = (mz_uint32)(adler & 0xffff), s2 = (mz_uint32)(adler >> 16);
+    mz_uint32 i, s1 = adler & 0xffff, s2 = adler >> 16;
     size_t block_len = buf_len % 5552;
-    if (!ptr)
-        return MZ_ADLER32_INIT;
     while (buf_len)
     {
         for (i = 0; i + 7 < block_len; i += 8, ptr += 8)
@@ -66,13 +64,11 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
 
 /* Karl Malbrain's compact CRC-32. See "A compact CCITT crc16 and crc32 C implementation that balances processor cache usage against speed": http://www.geocities.com/malbrain/ */
 #if 0
-    mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
+    static mz_uint32 mz_crc32_scalar(mz_uint32 crc, const mz_uint8 *ptr, size_t buf_len)
     {
         static const mz_uint32 s_crc32[16] = { 0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
                                                0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
-        mz_uint32 crcu32 = (mz_uint32)crc;
-        if (!ptr)
-            return MZ_CRC32_INIT;
+        mz_uint32 crcu32 = crc;
         crcu32 = ~crcu32;
         while (buf_len--)
         {
@@ -85,7 +81,7 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
 #else
 /* Faster, but larger CPU cache footprint.
  */
-mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
+static mz_uint32 mz_crc32_scalar(mz_uint32 crc, const mz_uint8 *ptr, size_t buf_len)
 {
     static const mz_uint32 s_crc_table[256] =
         {
@@ -128,7 +124,7 @@ mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
           0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
         };
 
-    mz_uint32 crc32 = (mz_uint32)crc ^ 0xFFFFFFFF;
+    mz_uint32 crc32 = crc ^ 0xFFFFFFFF;
     const mz_uint8 *pByte_buf = (const mz_uint8 *)ptr;
 
     while (buf_len >= 4)
@@ -152,6 +148,283 @@ mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
 }
 #endif
 
+/* SIMD checksums: SSSE3, AVX2 and AVX-512BW Adler-32 (the sums of 32 or 64 bytes at a time
+   with psadbw and pmaddubsw, as in zlib-ng and Chromium), and CRC-32 by folding with carry-less
+   multiplications (PCLMULQDQ on 4 x 128 bits, VPCLMULQDQ on 4 x 512 bits, "Fast CRC Computation
+   for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009). Each function has its own
+   target, the one to use is chosen with CPUID at the first call. The results are the same as
+   the portable code. */
+#if !defined(MINIZ_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MINIZ_X86_SIMD 1
+#include <immintrin.h>
+
+#define MZ_TARGET(t) __attribute__((target(t)))
+
+/* Adler-32 of the 32 (or 64) byte blocks, the rest by the portable code. Over a block,
+   s1 grows by the sum of the bytes and s2 by 32 * s1 plus the bytes weighted 32, 31, ..., 1:
+   v_ps sums the s1 before each block, v_s2 the weighted bytes. 5552 / 32 blocks keep the sums
+   within 32 bits as in the portable code. */
+static const signed char s_adler32_taps[64] = { 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                            48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33,
+                                            32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                            16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+
+static MZ_FORCEINLINE mz_uint32 mz_hsum128(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (mz_uint32)_mm_cvtsi128_si32(v);
+}
+
+MZ_TARGET("ssse3") static mz_uint32 mz_adler32_ssse3(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
+{
+    const __m128i tap1 = _mm_loadu_si128((const __m128i *)(s_adler32_taps + 32));
+    const __m128i tap2 = _mm_loadu_si128((const __m128i *)(s_adler32_taps + 48));
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+    mz_uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+    size_t blocks = buf_len / 32;
+    buf_len -= blocks * 32;
+    while (blocks)
+    {
+        size_t n = MZ_MIN(blocks, 5552 / 32);
+        __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n)), v_s2 = _mm_cvtsi32_si128((int)s2), v_s1 = zero;
+        blocks -= n;
+        do
+        {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i *)ptr);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(ptr + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            ptr += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+        s1 = (s1 + mz_hsum128(v_s1)) % 65521U;
+        s2 = mz_hsum128(v_s2) % 65521U;
+    }
+    return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+
+MZ_TARGET("avx2") static mz_uint32 mz_adler32_avx2(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
+{
+    const __m256i tap = _mm256_loadu_si256((const __m256i *)(s_adler32_taps + 32));
+    const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+    mz_uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+    size_t blocks = buf_len / 32;
+    buf_len -= blocks * 32;
+    while (blocks)
+    {
+        size_t n = MZ_MIN(blocks, 5552 / 32);
+        __m256i v_ps = _mm256_zextsi128_si256(_mm_cvtsi32_si128((int)(s1 * n)));
+        __m256i v_s2 = _mm256_zextsi128_si256(_mm_cvtsi32_si128((int)s2)), v_s1 = zero;
+        blocks -= n;
+        do
+        {
+            const __m256i bytes = _mm256_loadu_si256((const __m256i *)ptr);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+            ptr += 32;
+        } while (--n);
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+        s1 = (s1 + mz_hsum128(_mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1)))) % 65521U;
+        s2 = mz_hsum128(_mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1))) % 65521U;
+    }
+    return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+
+/* 64 bytes per block: the weights up to 64 still fit pmaddubsw (255 * (64 + 63) < 32768) */
+MZ_TARGET("avx512f,avx512bw") static mz_uint32 mz_adler32_avx512(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
+{
+    const __m512i tap = _mm512_loadu_si512((const void *)s_adler32_taps);
+    const __m512i zero = _mm512_setzero_si512(), ones = _mm512_set1_epi16(1);
+    mz_uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+    size_t blocks = buf_len / 64;
+    buf_len -= blocks * 64;
+    while (blocks)
+    {
+        size_t n = MZ_MIN(blocks, 5552 / 64);
+        __m512i v_ps = _mm512_zextsi128_si512(_mm_cvtsi32_si128((int)(s1 * n)));
+        __m512i v_s2 = _mm512_zextsi128_si512(_mm_cvtsi32_si128((int)s2)), v_s1 = zero;
+        blocks -= n;
+        do
+        {
+            const __m512i bytes = _mm512_loadu_si512((const void *)ptr);
+            v_ps = _mm512_add_epi32(v_ps, v_s1);
+            v_s1 = _mm512_add_epi32(v_s1, _mm512_sad_epu8(bytes, zero));
+            v_s2 = _mm512_add_epi32(v_s2, _mm512_madd_epi16(_mm512_maddubs_epi16(bytes, tap), ones));
+            ptr += 64;
+        } while (--n);
+        v_s2 = _mm512_add_epi32(v_s2, _mm512_slli_epi32(v_ps, 6));
+        s1 = (s1 + (mz_uint32)_mm512_reduce_add_epi32(v_s1)) % 65521U;
+        s2 = (mz_uint32)_mm512_reduce_add_epi32(v_s2) % 65521U;
+    }
+    return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+
+/* CRC-32 of the 16 byte blocks, crc and the result without the final xor. The folding
+   constants are x^(D+32) and x^(D-32) mod P, bit reflected and shifted left by one, for a
+   distance D of 2048 (4 x 512 bits), 512 (4 x 128 bits) and 128 bits; then x^64 mod P to
+   reduce 128 to 64 bits, P and floor(x^64 / P) for the Barrett reduction to 32 bits. */
+static const mz_uint64 s_crc32_k2048[2] = { 0x11542778aULL, 0x1322d1430ULL };
+static const mz_uint64 s_crc32_k512[2] = { 0x154442bd4ULL, 0x1c6e41596ULL };
+static const mz_uint64 s_crc32_k128[2] = { 0x1751997d0ULL, 0x0ccaa009eULL };
+static const mz_uint64 s_crc32_k64[2] = { 0x163cd6124ULL, 0 };
+static const mz_uint64 s_crc32_poly[2] = { 0x1db710641ULL, 0x1f7011641ULL };
+
+/* Folds x by the distance of k and adds y */
+#define MZ_CRC32_FOLD128(x, k, y) _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), y)
+
+/* The 4 x 128 bits of x1..x4 folded into 128, the rest of the 16 byte blocks added, and the CRC */
+MZ_TARGET("pclmul,sse4.1") static MZ_FORCEINLINE mz_uint32 mz_crc32_reduce(__m128i x1, __m128i x2, __m128i x3, __m128i x4, const mz_uint8 *buf, size_t len)
+{
+    __m128i k = _mm_loadu_si128((const __m128i *)s_crc32_k128), mask = _mm_setr_epi32(~0, 0, ~0, 0), t;
+    x1 = MZ_CRC32_FOLD128(x1, k, x2);
+    x1 = MZ_CRC32_FOLD128(x1, k, x3);
+    x1 = MZ_CRC32_FOLD128(x1, k, x4);
+    for (; len >= 16; buf += 16, len -= 16)
+        x1 = MZ_CRC32_FOLD128(x1, k, _mm_loadu_si128((const __m128i *)buf));
+
+    /* 128 to 64 bits */
+    t = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+    k = _mm_loadl_epi64((const __m128i *)s_crc32_k64);
+    t = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00), t);
+
+    /* Barrett reduction to 32 bits */
+    k = _mm_loadu_si128((const __m128i *)s_crc32_poly);
+    t = _mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10), mask);
+    x1 = _mm_xor_si128(x1, _mm_clmulepi64_si128(t, k, 0x00));
+    return (mz_uint32)_mm_extract_epi32(x1, 1);
+}
+
+/* buf_len >= 64 and a multiple of 16 */
+MZ_TARGET("pclmul,sse4.1") static mz_uint32 mz_crc32_pclmul(mz_uint32 crc, const mz_uint8 *buf, size_t len)
+{
+    const __m128i k = _mm_loadu_si128((const __m128i *)s_crc32_k512);
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf), _mm_cvtsi32_si128((int)crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64)
+    {
+        x1 = MZ_CRC32_FOLD128(x1, k, _mm_loadu_si128((const __m128i *)buf));
+        x2 = MZ_CRC32_FOLD128(x2, k, _mm_loadu_si128((const __m128i *)(buf + 16)));
+        x3 = MZ_CRC32_FOLD128(x3, k, _mm_loadu_si128((const __m128i *)(buf + 32)));
+        x4 = MZ_CRC32_FOLD128(x4, k, _mm_loadu_si128((const __m128i *)(buf + 48)));
+    }
+    return mz_crc32_reduce(x1, x2, x3, x4, buf, len);
+}
+
+/* Folds the 4 lanes of x by the distance of k and adds y */
+#define MZ_CRC32_FOLD512(x, k, y) _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11), y, 0x96)
+
+/* buf_len >= 256 and a multiple of 16 */
+MZ_TARGET("avx512f,vpclmulqdq,pclmul,sse4.1") static mz_uint32 mz_crc32_vpclmul(mz_uint32 crc, const mz_uint8 *buf, size_t len)
+{
+    __m512i k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)s_crc32_k2048));
+    __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512((const void *)buf), _mm512_zextsi128_si512(_mm_cvtsi32_si128((int)crc)));
+    __m512i x1 = _mm512_loadu_si512((const void *)(buf + 64));
+    __m512i x2 = _mm512_loadu_si512((const void *)(buf + 128));
+    __m512i x3 = _mm512_loadu_si512((const void *)(buf + 192));
+    for (buf += 256, len -= 256; len >= 256; buf += 256, len -= 256)
+    {
+        x0 = MZ_CRC32_FOLD512(x0, k, _mm512_loadu_si512((const void *)buf));
+        x1 = MZ_CRC32_FOLD512(x1, k, _mm512_loadu_si512((const void *)(buf + 64)));
+        x2 = MZ_CRC32_FOLD512(x2, k, _mm512_loadu_si512((const void *)(buf + 128)));
+        x3 = MZ_CRC32_FOLD512(x3, k, _mm512_loadu_si512((const void *)(buf + 192)));
+    }
+    /* 4 x 512 into 512 bits, then the rest of the 64 byte blocks */
+    k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)s_crc32_k512));
+    x0 = MZ_CRC32_FOLD512(x0, k, x1);
+    x0 = MZ_CRC32_FOLD512(x0, k, x2);
+    x0 = MZ_CRC32_FOLD512(x0, k, x3);
+    for (; len >= 64; buf += 64, len -= 64)
+        x0 = MZ_CRC32_FOLD512(x0, k, _mm512_loadu_si512((const void *)buf));
+    return mz_crc32_reduce(_mm512_extracti32x4_epi32(x0, 0), _mm512_extracti32x4_epi32(x0, 1), _mm512_extracti32x4_epi32(x0, 2),
+                           _mm512_extracti32x4_epi32(x0, 3), buf, len);
+}
+
+/* What the CPU has for each checksum, -1 until the first call (all the threads find the same) */
+static int s_simd_adler32 = -1, s_simd_crc32 = -1, s_simd_max = MZ_SIMD_AVX512;
+
+static void mz_simd_detect(void)
+{
+    __builtin_cpu_init();
+    s_simd_adler32 = __builtin_cpu_supports("avx512bw") ? MZ_SIMD_AVX512 : __builtin_cpu_supports("avx2") ? MZ_SIMD_AVX2 : __builtin_cpu_supports("ssse3") ? MZ_SIMD_SSE : MZ_SIMD_NONE;
+    s_simd_crc32 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq") ? MZ_SIMD_AVX512 : __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1") ? MZ_SIMD_SSE : MZ_SIMD_NONE;
+}
+#endif /* MINIZ_X86_SIMD */
+
+int mz_simd_level(int level)
+{
+#ifdef MINIZ_X86_SIMD
+    if (s_simd_adler32 < 0)
+        mz_simd_detect();
+    if (level >= 0)
+        s_simd_max = level;
+    return MZ_MIN(s_simd_max, MZ_MAX(s_simd_adler32, s_simd_crc32));
+#else
+    (void)level;
+    return MZ_SIMD_NONE;
+#endif
+}
+
+mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+{
+    if (!ptr)
+        return MZ_ADLER32_INIT;
+#ifdef MINIZ_X86_SIMD
+    if (buf_len >= 64)
+    {
+        if (s_simd_adler32 < 0)
+            mz_simd_detect();
+        switch (MZ_MIN(s_simd_adler32, s_simd_max))
+        {
+        case MZ_SIMD_AVX512:
+            return mz_adler32_avx512((mz_uint32)adler, ptr, buf_len);
+        case MZ_SIMD_AVX2:
+            return mz_adler32_avx2((mz_uint32)adler, ptr, buf_len);
+        case MZ_SIMD_SSE:
+            return mz_adler32_ssse3((mz_uint32)adler, ptr, buf_len);
+        }
+    }
+#endif
+    return mz_adler32_scalar((mz_uint32)adler, ptr, buf_len);
+}
+
+mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
+{
+    if (!ptr)
+        return MZ_CRC32_INIT;
+#ifdef MINIZ_X86_SIMD
+    if (buf_len >= 64)
+    {
+        size_t len = buf_len & ~(size_t)15;
+        if (s_simd_crc32 < 0)
+            mz_simd_detect();
+        switch (MZ_MIN(s_simd_crc32, s_simd_max))
+        {
+        case MZ_SIMD_AVX512:
+        case MZ_SIMD_AVX2:
+            if (len >= 256 && s_simd_crc32 == MZ_SIMD_AVX512 && s_simd_max == MZ_SIMD_AVX512)
+            {
+                crc = ~mz_crc32_vpclmul(~(mz_uint32)crc, ptr, len);
+                return mz_crc32_scalar((mz_uint32)crc, ptr + len, buf_len - len);
+            }
+            /* fall through */
+        case MZ_SIMD_SSE:
+            crc = ~mz_crc32_pclmul(~(mz_uint32)crc, ptr, len);
+            return mz_crc32_scalar((mz_uint32)crc, ptr + len, buf_len - len);
+        }
+    }
+#endif
+    return mz_crc32_scalar((mz_uint32)crc, ptr, buf_len);
+}
+
 void mz_free(void *p)
 {
     MZ_FREE(p);
@@ -1382,11 +1655,49 @@ static mz_uint16 TDEFL_READ_UNALIGNED_WORD2(const mz_uint16* p)
 #define TDEFL_READ_UNALIGNED_WORD(p) *(const mz_uint16 *)(p)
 #define TDEFL_READ_UNALIGNED_WORD2(p) *(const mz_uint16 *)(p)
 #endif
+#if MINIZ_LITTLE_ENDIAN && MINIZ_HAS_64BIT_REGISTERS && (defined(__GNUC__) || defined(__clang__) || (defined(_MSC_VER) && defined(_M_X64)))
+#define TDEFL_MATCH_LEN_WORD64 1
+#ifdef MINIZ_UNALIGNED_USE_MEMCPY
+static mz_uint64 TDEFL_READ_UNALIGNED_WORD64(const mz_uint8* p)
+{
+	mz_uint64 ret;
+	memcpy(&ret, p, sizeof(mz_uint64));
+	return ret;
+}
+#else
+#define TDEFL_READ_UNALIGNED_WORD64(p) *(const mz_uint64 *)(p)
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static MZ_FORCEINLINE mz_uint tdefl_ctz64(mz_uint64 x)
+{
+    unsigned long r;
+    _BitScanForward64(&r, x);
+    return (mz_uint)r;
+}
+#else
+#define tdefl_ctz64(x) ((mz_uint)__builtin_ctzll(x))
+#endif
+/* Length of the match at s and q whose first 2 bytes are known to be equal, up to TDEFL_MAX_MATCH_LEN: 8 bytes at a time, */
+/* on little endian the first different byte is the lowest non zero byte of the xor of the two words. */
+/* It reads the same bytes as the 16-bit loop (2..257 past s and q), so the lengths and the output do not change. */
+static MZ_FORCEINLINE mz_uint tdefl_match_len(const mz_uint8 *s, const mz_uint8 *q)
+{
+    mz_uint len;
+    for (len = 2; len < TDEFL_MAX_MATCH_LEN; len += 8)
+    {
+        mz_uint64 x = TDEFL_READ_UNALIGNED_WORD64(s + len) ^ TDEFL_READ_UNALIGNED_WORD64(q + len);
+        if (x)
+            return len + (tdefl_ctz64(x) >> 3);
+    }
+    return TDEFL_MAX_MATCH_LEN;
+}
+#endif
 static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahead_pos, mz_uint max_dist, mz_uint max_match_len, mz_uint *pMatch_dist, mz_uint *pMatch_len)
 {
     mz_uint dist, pos = lookahead_pos & TDEFL_LZ_DICT_SIZE_MASK, match_len = *pMatch_len, probe_pos = pos, next_probe_pos, probe_len;
     mz_uint num_probes_left = d->m_max_probes[match_len >= 32];
-    const mz_uint16 *s = (const mz_uint16 *)(d->m_dict + pos), *p, *q;
+    const mz_uint16 *s = (const mz_uint16 *)(d->m_dict + pos), *q;
     mz_uint16 c01 = TDEFL_READ_UNALIGNED_WORD(&d->m_dict[pos + match_len - 1]), s01 = TDEFL_READ_UNALIGNED_WORD2(s);
     MZ_ASSERT(max_match_len <= TDEFL_MAX_MATCH_LEN);
     if (max_match_len <= match_len)
@@ -1413,19 +1724,26 @@ static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahe
         q = (const mz_uint16 *)(d->m_dict + probe_pos);
         if (TDEFL_READ_UNALIGNED_WORD2(q) != s01)
             continue;
-        p = s;
-        probe_len = 32;
-        do
+#ifdef TDEFL_MATCH_LEN_WORD64
+        probe_len = tdefl_match_len((const mz_uint8 *)s, (const mz_uint8 *)q);
+#else
         {
-        } while ((TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) &&
-                 (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (--probe_len > 0));
-        if (!probe_len)
+            const mz_uint16 *p = s;
+            probe_len = 32;
+            do
+            {
+            } while ((TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) &&
+                     (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (--probe_len > 0));
+            probe_len = probe_len ? ((mz_uint)(p - s) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q) : TDEFL_MAX_MATCH_LEN;
+        }
+#endif
+        if (probe_len == TDEFL_MAX_MATCH_LEN)
         {
             *pMatch_dist = dist;
             *pMatch_len = MZ_MIN(max_match_len, (mz_uint)TDEFL_MAX_MATCH_LEN);
             break;
         }
-        else if ((probe_len = ((mz_uint)(p - s) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q)) > match_len)
+        else if (probe_len > match_len)
         {
             *pMatch_dist = dist;
             if ((*pMatch_len = match_len = MZ_MIN(max_match_len, probe_len)) == max_match_len)
@@ -1532,6 +1850,11 @@ static mz_bool tdefl_compress_fast(tdefl_compressor *d)
 
             if (((cur_match_dist = (mz_uint16)(lookahead_pos - probe_pos)) <= dict_size) && ((TDEFL_READ_UNALIGNED_WORD32(d->m_dict + (probe_pos &= TDEFL_LZ_DICT_SIZE_MASK)) & 0xFFFFFF) == first_trigram))
             {
+#ifdef TDEFL_MATCH_LEN_WORD64
+                cur_match_len = tdefl_match_len(pCur_dict, d->m_dict + probe_pos);
+                if (cur_match_len == TDEFL_MAX_MATCH_LEN)
+                    cur_match_len = cur_match_dist ? TDEFL_MAX_MATCH_LEN : 0;
+#else
                 const mz_uint16 *p = (const mz_uint16 *)pCur_dict;
                 const mz_uint16 *q = (const mz_uint16 *)(d->m_dict + probe_pos);
                 mz_uint32 probe_len = 32;
@@ -1542,6 +1865,7 @@ static mz_bool tdefl_compress_fast(tdefl_compressor *d)
                 cur_match_len = ((mz_uint)(p - (const mz_uint16 *)pCur_dict) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q);
                 if (!probe_len)
                     cur_match_len = cur_match_dist ? TDEFL_MAX_MATCH_LEN : 0;
+#endif
 
                 if ((cur_match_len < TDEFL_MIN_MATCH_LEN) || ((cur_match_len == TDEFL_MIN_MATCH_LEN) && (cur_match_dist >= 8U * 1024U)))
                 {
@@ -2820,30 +3144,8 @@ common_exit:
     *pOut_buf_size = pOut_buf_cur - pOut_buf_next;
     if ((decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32)) && (status >= 0))
     {
-        const mz_uint8 *ptr = pOut_buf_next;
-        size_t buf_len = *pOut_buf_size;
-        mz_uint32 i, s1 = r->m_check_adler32 & 0xffff, s2 = r->m_check_adler32 >> 16;
-        size_t block_len = buf_len % 5552;
-        while (buf_len)
-        {
-            for (i = 0; i + 7 < block_len; i += 8, ptr += 8)
-            {
-                s1 += ptr[0], s2 += s1;
-                s1 += ptr[1], s2 += s1;
-                s1 += ptr[2], s2 += s1;
-                s1 += ptr[3], s2 += s1;
-                s1 += ptr[4], s2 += s1;
-                s1 += ptr[5], s2 += s1;
-                s1 += ptr[6], s2 += s1;
-                s1 += ptr[7], s2 += s1;
-            }
-            for (; i < block_len; ++i)
-                s1 += *ptr++, s2 += s1;
-            s1 %= 65521U, s2 %= 65521U;
-            buf_len -= block_len;
-            block_len = 5552;
-        }
-        r->m_check_adler32 = (s2 << 16) + s1;
+        if (*pOut_buf_size)
+            r->m_check_adler32 = (mz_uint32)mz_adler32(r->m_check_adler32, pOut_buf_next, *pOut_buf_size);
         if ((status == TINFL_STATUS_DONE) && (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) && (r->m_check_adler32 != r->m_z_adler32))
             status = TINFL_STATUS_ADLER32_MISMATCH;
     }
@@ -208,6 +208,17 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len);
 /* mz_crc32() returns the initial CRC-32 value to use when called with ptr==NULL. */
 mz_ulong mz_crc32(mz_ulong crc, const unsigned char *ptr, size_t buf_len);
 
+/* mz_adler32() and mz_crc32() (and the Adler-32 check of tinfl) use SSSE3, AVX2, AVX-512 and PCLMULQDQ when the CPU has them, chosen with CPUID at the first call. Define MINIZ_NO_SIMD to build only the portable code. */
+enum
+{
+    MZ_SIMD_NONE = 0,  /* portable code */
+    MZ_SIMD_SSE = 1,   /* SSSE3 Adler-32, PCLMULQDQ CRC-32 */
+    MZ_SIMD_AVX2 = 2,  /* AVX2 Adler-32 */
+    MZ_SIMD_AVX512 = 3 /* AVX-512BW Adler-32, VPCLMULQDQ CRC-32 */
+};
+/* mz_simd_level() limits the instructions of the checksums to level (for benchmarks and tests) and returns the level they use: the lower of level and the best the CPU has. A negative level only returns it. */
+int mz_simd_level(int level);
+
 /* Compression strategies. */
 enum
 {
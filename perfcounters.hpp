@@ -0,0 +1,175 @@
+#if !defined _PERFCOUNTERS_HPP
+#define _PERFCOUNTERS_HPP
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hardware counters of the stages (--counters) -----------------------------------------------
+
+// Each thread opens its own counters with perf_event_open (only the thread, user space), and
+// a stage reads them when it starts and when it ends and adds the difference to the totals of
+// the thread for that stage: no sharing between the threads while the farm runs. The counters
+// that the kernel or the machine do not have (a VM, perf_event_paranoid) are reported as -1.
+// Without --counters a stage costs only the test of countersEnabled.
+
+enum Stage
+{
+	STAGE_SPLIT,	  // mapping the files and cutting the blocks (L_Worker)
+	STAGE_COMPRESS,	  // R_Worker
+	STAGE_DECOMPRESS, // R_Worker
+	STAGE_WRITE,	  // writing the files
+	STAGES
+};
+static const char *const stageNames[STAGES] = {"split", "compress", "decompress", "write"};
+
+static const int COUNTERS = 6;
+static const char *const counterNames[COUNTERS] = {"task-clock", "cycles", "instructions", "llc-misses", "branch-misses", "dtlb-misses"};
+
+struct CounterTotals
+{
+	uint64_t bytes = 0;
+	uint64_t value[COUNTERS] = {};
+};
+
+struct ThreadCounters
+{
+	int fd[COUNTERS];
+	CounterTotals stage[STAGES];
+};
+
+static bool countersEnabled = false;
+static std::mutex countersMutex; // only to add the threads
+static std::vector<std::unique_ptr<ThreadCounters>> countersThreads;
+static thread_local ThreadCounters *countersLocal = nullptr;
+
+static inline int openCounter(int k)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	switch (k)
+	{
+	case 0:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_TASK_CLOCK;
+		break;
+	case 1:
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case 2:
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case 3:
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case 4:
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	default:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+	}
+	// pid 0 and cpu -1: the calling thread on any CPU
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Opens the counters of the calling thread, must be called by the thread before its stages
+static inline void countersThread()
+{
+	if (!countersEnabled || countersLocal != nullptr)
+		return;
+	std::unique_ptr<ThreadCounters> t(new ThreadCounters);
+	for (int k = 0; k < COUNTERS; ++k)
+		t->fd[k] = openCounter(k);
+	std::lock_guard<std::mutex> lock(countersMutex);
+	countersLocal = t.get();
+	countersThreads.push_back(std::move(t));
+}
+
+static inline void readCounters(const ThreadCounters &t, uint64_t *values)
+{
+	for (int k = 0; k < COUNTERS; ++k)
+		if (t.fd[k] < 0 || read(t.fd[k], &values[k], sizeof(uint64_t)) != sizeof(uint64_t))
+			values[k] = 0;
+}
+
+// A stage from its construction to the end of the scope, bytes are the bytes it works on
+class StageCounters
+{
+public:
+	StageCounters(Stage stage, size_t bytes) : stage(stage), bytes(bytes)
+	{
+		if (!countersEnabled)
+			return;
+		countersThread();
+		readCounters(*countersLocal, begin);
+	}
+	~StageCounters()
+	{
+		if (!countersEnabled)
+			return;
+		uint64_t end[COUNTERS];
+		readCounters(*countersLocal, end);
+		CounterTotals &totals = countersLocal->stage[stage];
+		totals.bytes += bytes;
+		for (int k = 0; k < COUNTERS; ++k)
+			totals.value[k] += end[k] - begin[k];
+	}
+	StageCounters(const StageCounters &) = delete;
+	StageCounters &operator=(const StageCounters &) = delete;
+
+private:
+	Stage stage;
+	size_t bytes;
+	uint64_t begin[COUNTERS];
+};
+
+// Totals of the stages over all the threads, must be called when they have finished.
+// available[k] is false if no thread could open the counter k.
+static inline void countersTotals(CounterTotals *totals, bool *available)
+{
+	for (int k = 0; k < COUNTERS; ++k)
+		available[k] = false;
+	for (auto &t : countersThreads)
+	{
+		for (int k = 0; k < COUNTERS; ++k)
+			available[k] |= t->fd[k] >= 0;
+		for (int s = 0; s < STAGES; ++s)
+		{
+			totals[s].bytes += t->stage[s].bytes;
+			for (int k = 0; k < COUNTERS; ++k)
+				totals[s].value[k] += t->stage[s].value[k];
+		}
+	}
+}
+
+// One line for each stage that has run, the counters not available are -1:
+// Counters compress: MB 64.00 task-clock 123 cycles 456 ... IPC 1.23 llc-misses/MB 45.6
+static inline void printCounters(const CounterTotals *totals, const bool *available)
+{
+	for (int s = 0; s < STAGES; ++s)
+	{
+		if (totals[s].bytes == 0)
+			continue;
+		const double mb = totals[s].bytes / (1024.0 * 1024.0);
+		std::printf("Counters %s: MB %.2f", stageNames[s], mb);
+		for (int k = 0; k < COUNTERS; ++k)
+			std::printf(" %s %lld", counterNames[k], available[k] ? (long long)totals[s].value[k] : -1LL);
+		const double cycles = totals[s].value[1], instructions = totals[s].value[2];
+		std::printf(" IPC %.3f llc-misses/MB %.1f\n", available[1] && available[2] && cycles > 0 ? instructions / cycles : -1.0,
+					available[3] ? totals[s].value[3] / mb : -1.0);
+	}
+}
+
+#endif
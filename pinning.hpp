@@ -0,0 +1,198 @@
+#if !defined _PINNING_HPP
+#define _PINNING_HPP
+
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <ff/mapping_utils.hpp>
+
+// Placement of the threads of the farms (--pin and --numa) ------------------------------------
+
+// Parses a list of cpus like "0-3,8,10-11", the format of sysfs and of FF_MAPPING_STRING
+static inline std::vector<int> parseCpuList(const std::string &list)
+{
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while (pos < list.size())
+	{
+		size_t end = list.find_first_of(", \n", pos);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string item = list.substr(pos, end - pos);
+		pos = end + 1;
+		if (item.empty())
+			continue;
+		size_t dash = item.find('-');
+		int first = std::atoi(item.c_str());
+		int last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+		for (int c = first; c <= last; ++c)
+			cpus.push_back(c);
+	}
+	return cpus;
+}
+
+static inline bool readLine(const std::string &path, std::string &line)
+{
+	std::ifstream in(path);
+	return (bool)std::getline(in, line);
+}
+
+// CPUs that the process can use, grouped by NUMA node (numa) or by socket.
+// With FF_MAPPING_STRING in the environment only its CPUs are used, in that order.
+static inline std::vector<std::vector<int>> cpuGroups(bool numa)
+{
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		for (int c = 0; c < ff_numCores() && c < CPU_SETSIZE; ++c)
+			CPU_SET(c, &allowed);
+
+	std::vector<int> order;
+	const char *mapping = getenv("FF_MAPPING_STRING");
+	if (mapping != nullptr)
+		order = parseCpuList(mapping);
+	else
+		for (int c = 0; c < CPU_SETSIZE; ++c)
+			order.push_back(c);
+
+	// group id of each CPU
+	std::map<int, int> groupOf;
+	std::string line;
+	if (numa)
+	{
+		for (int node = 0; node < CPU_SETSIZE; ++node)
+		{
+			if (!readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", line))
+				continue;
+			for (int c : parseCpuList(line))
+				groupOf[c] = node;
+		}
+	}
+	else
+	{
+		for (int c : order)
+		{
+			if (c >= 0 && c < CPU_SETSIZE && CPU_ISSET(c, &allowed) &&
+				readLine("/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/physical_package_id", line))
+				groupOf[c] = std::atoi(line.c_str());
+		}
+	}
+
+	std::map<int, std::vector<int>> groups;
+	for (int c : order)
+	{
+		if (c < 0 || c >= CPU_SETSIZE || !CPU_ISSET(c, &allowed))
+			continue;
+		auto it = groupOf.find(c);
+		groups[it == groupOf.end() ? 0 : it->second].push_back(c);
+	}
+	std::vector<std::vector<int>> result;
+	for (auto &g : groups)
+		result.push_back(g.second);
+	return result;
+}
+
+// Where the threads of a farm run. The L_Workers and the R_Workers are spread evenly over
+// the groups (sockets, or NUMA nodes with --numa), each one on its own CPU of the group
+// while there are enough of them.
+struct Placement
+{
+	Placement(bool numa) : numa(numa), groups(cpuGroups(numa)) {}
+
+	// The processes on a node share its CPUs: part of parts gets one NUMA node (shared with
+	// other processes if there are more processes than nodes) or a contiguous part of the CPUs
+	void share(size_t part, size_t parts)
+	{
+		if (parts <= 1 || groups.empty())
+			return;
+		if (numa)
+		{
+			size_t g = part % groups.size();
+			size_t sharing = (parts - g + groups.size() - 1) / groups.size();
+			size_t k = part / groups.size();
+			std::vector<int> &cpus = groups[g];
+			size_t begin = cpus.size() * k / sharing, end = cpus.size() * (k + 1) / sharing;
+			groups = {std::vector<int>(cpus.begin() + begin, cpus.begin() + std::max(end, begin + 1))};
+			return;
+		}
+		std::vector<std::pair<int, int>> all; // (group, cpu)
+		for (size_t g = 0; g < groups.size(); ++g)
+			for (int c : groups[g])
+				all.emplace_back(g, c);
+		size_t begin = all.size() * part / parts, end = std::max(all.size() * (part + 1) / parts, begin + 1);
+		std::map<int, std::vector<int>> mine;
+		for (size_t i = begin; i < end && i < all.size(); ++i)
+			mine[all[i].first].push_back(all[i].second);
+		groups.clear();
+		for (auto &g : mine)
+			groups.push_back(g.second);
+	}
+
+	void plan(size_t Lw, size_t Rw)
+	{
+		groupL.assign(Lw, 0);
+		groupR.assign(Rw, 0);
+		feederR.assign(Rw, 0);
+		cpuL.assign(Lw, -1);
+		cpuR.assign(Rw, -1);
+		if (groups.empty())
+			return;
+		std::vector<size_t> next(groups.size(), 0);
+		for (size_t i = 0; i < Lw; ++i)
+		{
+			size_t g = groupL[i] = i * groups.size() / Lw;
+			cpuL[i] = groups[g][next[g]++ % groups[g].size()];
+		}
+		for (size_t j = 0; j < Rw; ++j)
+		{
+			size_t g = groupR[j] = j * groups.size() / Rw;
+			cpuR[j] = groups[g][next[g]++ % groups[g].size()];
+		}
+		// With fewer L_Workers than groups some groups have only R_Workers: they are fed by
+		// the groups with L_Workers, in turn, instead of waiting for blocks that never come
+		std::vector<bool> hasL(groups.size(), false);
+		std::vector<size_t> fed;
+		for (size_t g : groupL)
+			if (!hasL[g])
+			{
+				hasL[g] = true;
+				fed.push_back(g);
+			}
+		size_t orphans = 0;
+		for (size_t j = 0; j < Rw; ++j)
+			feederR[j] = hasL[groupR[j]] || fed.empty() ? groupR[j] : fed[orphans++ % fed.size()];
+	}
+
+	// R_Workers fed by the group of the L_Worker i (all of them if there are none)
+	std::vector<int> localWorkers(size_t i) const
+	{
+		std::vector<int> local;
+		for (size_t j = 0; j < feederR.size(); ++j)
+			if (feederR[j] == groupL[i])
+				local.push_back(j);
+		if (local.empty())
+			for (size_t j = 0; j < groupR.size(); ++j)
+				local.push_back(j);
+		return local;
+	}
+
+	bool numa;
+	std::vector<std::vector<int>> groups;
+	std::vector<size_t> groupL, groupR;
+	std::vector<size_t> feederR; // group of the L_Workers that send blocks to the R_Worker j
+	std::vector<int> cpuL, cpuR;
+};
+
+// Called by the thread itself (svc_init), so it works also when FastFlow has no default mapping
+static inline void pinThread(int cpu)
+{
+	if (cpu >= 0 && ff_mapThreadToCpu(cpu) != 0)
+		std::fprintf(stderr, "Cannot pin the thread to CPU %d\n", cpu);
+}
+
+#endif
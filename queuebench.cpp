@@ -0,0 +1,442 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ff/buffer.hpp>
+#include <ff/ubuffer.hpp>
+#include <ff/allocator.hpp>
+#include <ff/mpmc/MPMCqueues.hpp>
+#include <utility.hpp>
+#include <pinning.hpp>
+#include <blockpool.hpp>
+
+// Microbenchmarks of the FastFlow queues and allocators under the farms of minizip: the
+// SPSC buffers of the channels between the nodes (bounded and unbounded, with the capacity
+// 512 of the build among the others), the MPMC queue of the free lists of BlockPool and
+// TaskPool, and the allocation of the task descriptors and of the block buffers. Each
+// benchmark is run --reps times and the median is printed, in the layout of google-benchmark.
+// At the end the rates are compared with the blocks per second that the R_Workers of minizip
+// can produce, measured by compressing a block here.
+
+static inline void usage(const char *argv0)
+{
+  printf("--------------------\n");
+  printf("Usage: %s [--filter TEXT] [--items N] [--reps N] [--pin] [--threads LIST]\n", argv0);
+  printf("\nOptions:\n");
+  printf("--filter TEXT  - Runs only the benchmarks with TEXT in the name\n");
+  printf("--items N      - Items pushed (or allocations) in each run (default 1000000)\n");
+  printf("--reps N       - Runs of each benchmark, the median is printed (default 5)\n");
+  printf("--pin          - Pins the threads on different CPUs (the producer on the first one)\n");
+  printf("--threads LIST - Producers (= consumers) of the MPMC benchmarks (default 1,2,4)\n");
+  printf("--------------------\n");
+}
+
+struct Options
+{
+  std::string filter;
+  size_t items = 1000000;
+  size_t reps = 5;
+  bool pin = false;
+  std::vector<int> cpus; // with --pin, the CPUs of the threads
+};
+static Options options;
+
+// Waiting on a full or empty queue: spins a little, then yields the CPU so that the other
+// thread can run when they share a CPU
+struct Backoff
+{
+  unsigned spins = 0;
+  void wait()
+  {
+    if (++spins > 64)
+    {
+      std::this_thread::yield();
+      spins = 0;
+    }
+  }
+};
+
+static inline void pinTo(size_t k)
+{
+  if (options.pin && !options.cpus.empty())
+    pinThread(options.cpus[k % options.cpus.size()]);
+}
+
+// One result line
+struct Result
+{
+  std::string name;
+  double nsPerItem = 0;
+  double itemsPerSecond = 0;
+};
+static std::vector<Result> results;
+
+// Runs body (that returns the seconds of one run over items) reps times, prints the median
+static inline void run(const std::string &name, const std::function<double(size_t)> &body)
+{
+  if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+    return;
+  std::vector<double> seconds;
+  for (size_t r = 0; r < options.reps; ++r)
+    seconds.push_back(body(options.items));
+  std::sort(seconds.begin(), seconds.end());
+  const double s = seconds[seconds.size() / 2];
+  Result res = {name, s * 1e9 / options.items, options.items / s};
+  std::printf("%-44s %12.1f ns %14.0f items/s\n", name.c_str(), res.nsPerItem, res.itemsPerSecond);
+  std::fflush(stdout);
+  results.push_back(res);
+}
+
+static inline double secondsSince(std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+// The items are never null, the queues use null as "no item"
+static inline void *item(size_t i) { return (void *)(i + 1); }
+
+// SPSC ---------------------------------------------------------------------------------------
+
+// One producer pushes items, one consumer pops them
+template <typename Queue>
+static inline double spscThroughput(Queue &q, size_t items)
+{
+  std::atomic<bool> go{false};
+  std::thread consumer([&]()
+                       {
+    pinTo(1);
+    while (!go.load())
+      std::this_thread::yield();
+    Backoff b;
+    void *p;
+    for (size_t i = 0; i < items; ++i)
+      while (!q.pop(&p))
+        b.wait(); });
+  pinTo(0);
+  auto t = std::chrono::steady_clock::now();
+  go = true;
+  Backoff b;
+  for (size_t i = 0; i < items; ++i)
+    while (!q.push(item(i)))
+      b.wait();
+  consumer.join();
+  return secondsSince(t);
+}
+
+// An item goes to the other thread and back, the time of a round trip is two handoffs
+template <typename Queue>
+static inline double spscPingPong(Queue &there, Queue &back, size_t items)
+{
+  std::thread echo([&]()
+                   {
+    pinTo(1);
+    Backoff b;
+    void *p;
+    for (size_t i = 0; i < items; ++i)
+    {
+      while (!there.pop(&p))
+        b.wait();
+      while (!back.push(p))
+        b.wait();
+    } });
+  pinTo(0);
+  auto t = std::chrono::steady_clock::now();
+  Backoff b;
+  void *p;
+  for (size_t i = 0; i < items; ++i)
+  {
+    while (!there.push(item(i)))
+      b.wait();
+    while (!back.pop(&p))
+      b.wait();
+  }
+  echo.join();
+  return secondsSince(t) / 2;
+}
+
+static inline void spscBenchmarks()
+{
+  const size_t capacities[] = {64, 512, 4096};
+  for (size_t c : capacities)
+  {
+    const std::string cap = "/" + std::to_string(c);
+    run("SPSC_bounded_throughput" + cap, [c](size_t items)
+        {
+      ff::SWSR_Ptr_Buffer q(c);
+      q.init();
+      return spscThroughput(q, items); });
+    run("SPSC_unbounded_throughput" + cap, [c](size_t items)
+        {
+      ff::uSWSR_Ptr_Buffer q(c);
+      q.init();
+      return spscThroughput(q, items); });
+    run("SPSC_bounded_latency" + cap, [c](size_t items)
+        {
+      ff::SWSR_Ptr_Buffer there(c), back(c);
+      there.init();
+      back.init();
+      return spscPingPong(there, back, items / 10 + 1) * 10; });
+    run("SPSC_unbounded_latency" + cap, [c](size_t items)
+        {
+      ff::uSWSR_Ptr_Buffer there(c), back(c);
+      there.init();
+      back.init();
+      return spscPingPong(there, back, items / 10 + 1) * 10; });
+  }
+}
+
+// MPMC ---------------------------------------------------------------------------------------
+
+// threads producers and threads consumers on one queue, as the free lists of the pools
+static inline double mpmcThroughput(size_t capacity, size_t threads, size_t items)
+{
+  ff::MPMC_Ptr_Queue q;
+  q.init(capacity);
+  std::atomic<bool> go{false};
+  std::vector<std::thread> all;
+  const size_t each = items / threads;
+  for (size_t k = 0; k < 2 * threads; ++k)
+    all.emplace_back([&, k]()
+                     {
+      pinTo(k);
+      while (!go.load())
+        std::this_thread::yield();
+      Backoff b;
+      void *p;
+      for (size_t i = 0; i < each; ++i)
+        if (k < threads)
+          while (!q.push(item(i)))
+            b.wait();
+        else
+          while (!q.pop(&p))
+            b.wait(); });
+  auto t = std::chrono::steady_clock::now();
+  go = true;
+  for (auto &th : all)
+    th.join();
+  return secondsSince(t) * items / (each * threads);
+}
+
+static inline void mpmcBenchmarks(const std::vector<long> &threads)
+{
+  const size_t capacities[] = {64, 512, 4096};
+  for (size_t c : capacities)
+    for (long n : threads)
+      run("MPMC_throughput/" + std::to_string(c) + "/threads:" + std::to_string(n), [c, n](size_t items)
+          { return mpmcThroughput(c, n, items); });
+}
+
+// Allocators ---------------------------------------------------------------------------------
+
+// Size of the task descriptor of FF_minizip
+static const size_t TASK_SIZE = 9 * sizeof(size_t);
+
+// A thread allocates, another one frees, as the L_Workers create the tasks and the thread
+// that collects the blocks releases them. The pointers go through an SPSC buffer.
+static inline double crossThread(size_t items, const std::function<void *()> &get, const std::function<void(void *)> &put)
+{
+  ff::SWSR_Ptr_Buffer q(512);
+  q.init();
+  std::thread consumer([&]()
+                       {
+    pinTo(1);
+    Backoff b;
+    void *p;
+    for (size_t i = 0; i < items; ++i)
+    {
+      while (!q.pop(&p))
+        b.wait();
+      put(p);
+    } });
+  pinTo(0);
+  auto t = std::chrono::steady_clock::now();
+  Backoff b;
+  for (size_t i = 0; i < items; ++i)
+  {
+    void *p = get();
+    ((volatile unsigned char *)p)[0] = 1;
+    while (!q.push(p))
+      b.wait();
+  }
+  consumer.join();
+  return secondsSince(t);
+}
+
+// Allocation and release in the same thread
+static inline double sameThread(size_t items, const std::function<void *()> &get, const std::function<void(void *)> &put)
+{
+  auto t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < items; ++i)
+  {
+    void *p = get();
+    ((volatile unsigned char *)p)[0] = 1;
+    put(p);
+  }
+  return secondsSince(t);
+}
+
+struct Task
+{
+  size_t fields[TASK_SIZE / sizeof(size_t)];
+};
+
+static inline void allocatorBenchmarks()
+{
+  typedef std::function<double(size_t, const std::function<void *()> &, const std::function<void(void *)> &)> Pattern;
+  const std::pair<const char *, Pattern> patterns[] = {{"same_thread", sameThread}, {"cross_thread", crossThread}};
+  for (auto &pattern : patterns)
+  {
+    const std::string suffix = std::string("/") + pattern.first;
+    const Pattern &body = pattern.second;
+    run("Task_new_delete" + suffix, [&](size_t items)
+        { return body(items, []()
+                      { return (void *)new Task; }, [](void *p)
+                      { delete (Task *)p; }); });
+    run("Task_TaskPool" + suffix, [&](size_t items)
+        {
+      TaskPool<Task> pool;
+      pool.init(4096);
+      return body(items, [&]()
+                  { return (void *)pool.get(); }, [&](void *p)
+                  { pool.put((Task *)p); }); });
+    run("Task_ff_malloc" + suffix, [&](size_t items)
+        { return body(items, []()
+                      { return ff::ff_malloc(TASK_SIZE); }, [](void *p)
+                      { ff::ff_free(p); }); });
+    // the buffers of the compressed blocks, compressBound of a block
+    const size_t blockSize = compressBound(BIGFILE_LOW_THRESHOLD);
+    run("Block_new_delete" + suffix, [&, blockSize](size_t items)
+        { return body(items / 100 + 1, [blockSize]()
+                      { return (void *)new unsigned char[blockSize]; }, [](void *p)
+                      { delete[] (unsigned char *)p; }) * 100; });
+    run("Block_BlockPool" + suffix, [&, blockSize](size_t items)
+        {
+      BlockPool pool;
+      pool.init(blockSize, 64);
+      return body(items / 100 + 1, [&]()
+                  { return (void *)pool.get(); }, [&](void *p)
+                  { pool.put((unsigned char *)p); }) * 100; });
+  }
+}
+
+// Summary ------------------------------------------------------------------------------------
+
+// Blocks per second that one R_Worker compresses, on a block of text like the tests
+static inline double blocksPerSecond()
+{
+  std::vector<unsigned char> in(BIGFILE_LOW_THRESHOLD), out(compressBound(BIGFILE_LOW_THRESHOLD));
+  const char *words[] = {"lorem ", "ipsum ", "dolor ", "sit ", "amet, ", "consectetur ", "adipiscing ", "elit. "};
+  uint64_t x = 88172645463325252ULL;
+  for (size_t i = 0; i < in.size();)
+  {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    for (const char *w = words[x % 8]; *w && i < in.size(); ++w)
+      in[i++] = *w;
+  }
+  auto t = std::chrono::steady_clock::now();
+  size_t n = 0;
+  do
+  {
+    mz_ulong size = out.size();
+    compress(out.data(), &size, in.data(), in.size());
+    ++n;
+  } while (secondsSince(t) < 0.5);
+  return n / secondsSince(t);
+}
+
+static inline const Result *best(const std::string &prefix, bool fastest)
+{
+  const Result *b = nullptr;
+  for (auto &r : results)
+    if (r.name.compare(0, prefix.size(), prefix) == 0 && (b == nullptr || (fastest ? r.itemsPerSecond > b->itemsPerSecond : r.nsPerItem < b->nsPerItem)))
+      b = &r;
+  return b;
+}
+
+static inline void summary()
+{
+  const double perWorker = blocksPerSecond();
+  const double cpus = std::max(1u, std::thread::hardware_concurrency());
+  std::printf("\nminizip: an R_Worker compresses %.0f blocks/s of %zu KB, %.0f blocks/s with %.0f CPUs\n",
+              perWorker, BIGFILE_LOW_THRESHOLD / 1024, perWorker * cpus, cpus);
+  const std::pair<const char *, bool> picks[] = {{"SPSC_bounded_throughput", true}, {"SPSC_unbounded_throughput", true},
+                                                 {"SPSC_bounded_latency", false}, {"SPSC_unbounded_latency", false},
+                                                 {"MPMC_throughput", true}};
+  for (auto &pick : picks)
+  {
+    const Result *r = best(pick.first, pick.second);
+    if (r != nullptr)
+      std::printf("best %-26s %-44s %.0fx the block rate of all the CPUs\n", pick.first, r->name.c_str(),
+                  r->itemsPerSecond / (perWorker * cpus));
+  }
+  // The smallest capacity of the channels that loses less than 10% on the best, a bigger one
+  // only keeps more blocks in flight
+  const Result *fastest = best("SPSC_bounded_throughput", true);
+  for (auto &r : results)
+    if (fastest != nullptr && r.name.compare(0, 23, "SPSC_bounded_throughput") == 0 && r.itemsPerSecond >= 0.9 * fastest->itemsPerSecond)
+    {
+      std::printf("recommended channel: %s, the smallest capacity within 10%% of the best\n", r.name.c_str());
+      break;
+    }
+  // The tasks are blocks of a file, so even the slowest queue is far from being the limit:
+  // the capacity matters only for the blocks in flight (memory) and the backpressure.
+  const Result *slowest = nullptr;
+  for (auto &r : results)
+    if (r.name.find("throughput") != std::string::npos && (slowest == nullptr || r.itemsPerSecond < slowest->itemsPerSecond))
+      slowest = &r;
+  if (slowest != nullptr)
+    std::printf("slowest queue %s: %.0fx the block rate, the queues are %s for minizip\n", slowest->name.c_str(),
+                slowest->itemsPerSecond / (perWorker * cpus), slowest->itemsPerSecond > 100 * perWorker * cpus ? "not a limit" : "a possible limit");
+}
+
+int main(int argc, char *argv[])
+{
+  if (hasOption(argv + 1, argv + argc, "-h") || hasOption(argv + 1, argv + argc, "--help"))
+  {
+    usage(argv[0]);
+    return 0;
+  }
+  const char *filter = getOption(argv + 1, argv + argc, "--filter");
+  const char *items = getOption(argv + 1, argv + argc, "--items");
+  const char *reps = getOption(argv + 1, argv + argc, "--reps");
+  const char *threadList = getOption(argv + 1, argv + argc, "--threads");
+  options.filter = filter != nullptr ? filter : "";
+  if (items != nullptr)
+    options.items = std::max(1ul, std::strtoul(items, nullptr, 10));
+  if (reps != nullptr)
+    options.reps = std::max(1ul, std::strtoul(reps, nullptr, 10));
+  options.pin = hasOption(argv + 1, argv + argc, "--pin");
+  if (options.pin)
+    for (auto &group : cpuGroups(false))
+      options.cpus.insert(options.cpus.end(), group.begin(), group.end());
+  std::vector<long> threads = {1, 2, 4};
+  if (threadList != nullptr)
+  {
+    threads.clear();
+    for (const char *p = threadList; *p;)
+    {
+      char *end;
+      long n = std::strtol(p, &end, 10);
+      if (end == p || n <= 0)
+      {
+        std::fprintf(stderr, "Invalid --threads %s\n", threadList);
+        return -1;
+      }
+      threads.push_back(n);
+      p = *end == ',' ? end + 1 : end;
+    }
+  }
+
+  std::printf("%-44s %15s %22s\n", "Benchmark", "Time", "Rate");
+  std::printf("%s\n", std::string(83, '-').c_str());
+  spscBenchmarks();
+  mpmcBenchmarks(threads);
+  allocatorBenchmarks();
+  summary();
+  return 0;
+}
@@ -0,0 +1,321 @@
+#if !defined _TELEMETRY_HPP
+#define _TELEMETRY_HPP
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <perfcounters.hpp>
+
+// Progress of a run (--progress and --metrics) -----------------------------------------------
+
+// Each thread counts the bytes and the blocks of its stages on its own cache line, with
+// relaxed stores and no read-modify-write: there is only one writer, the reporter thread
+// reads all the lines. Every few seconds the reporter prints the totals and the rates on
+// stderr (--progress) and/or writes them in the Prometheus text format (--metrics) in a file,
+// replaced at each report, or to the clients of a Unix socket ("unix:PATH").
+
+struct alignas(64) StageMeter
+{
+	std::atomic<uint64_t> bytesIn{0}, bytesOut{0}, blocks{0};
+
+	// only the owner of the meter calls it
+	void add(uint64_t in, uint64_t out, uint64_t n)
+	{
+		bytesIn.store(bytesIn.load(std::memory_order_relaxed) + in, std::memory_order_relaxed);
+		bytesOut.store(bytesOut.load(std::memory_order_relaxed) + out, std::memory_order_relaxed);
+		blocks.store(blocks.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+};
+
+static bool telemetryEnabled = false;
+static std::mutex telemetryMutex; // only to add the meters
+static std::vector<std::unique_ptr<StageMeter[]>> telemetryMeters; // STAGES meters for each thread
+static thread_local StageMeter *telemetryLocal = nullptr;
+// MPI master: the bytes sent to each worker rank (in) and received from it (out)
+static std::unique_ptr<StageMeter[]> telemetryRanks;
+static size_t telemetryNumRanks = 0;
+
+// bytes in and out of a stage of the calling thread, and the blocks done
+static inline void telemetryAdd(Stage stage, uint64_t in, uint64_t out, uint64_t blocks = 1)
+{
+	if (!telemetryEnabled)
+		return;
+	if (telemetryLocal == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(telemetryMutex);
+		telemetryMeters.emplace_back(new StageMeter[STAGES]);
+		telemetryLocal = telemetryMeters.back().get();
+	}
+	telemetryLocal[stage].add(in, out, blocks);
+}
+
+// Only one thread sends to the ranks and receives from them
+static inline void telemetryRankAdd(int rank, uint64_t in, uint64_t out, uint64_t blocks = 0)
+{
+	if (telemetryEnabled && (size_t)rank < telemetryNumRanks)
+		telemetryRanks[rank].add(in, out, blocks);
+}
+
+// FILE or unix:PATH of --metrics made absolute (the walk of the directories changes the
+// current directory), with suffix after the name (the rank with MPI)
+static inline std::string metricsPath(const std::string &arg, const std::string &suffix = "")
+{
+	const bool socket = arg.compare(0, 5, "unix:") == 0;
+	const std::string path = std::filesystem::absolute(socket ? arg.substr(5) : arg).string() + suffix;
+	return socket ? "unix:" + path : path;
+}
+
+class TelemetryReporter
+{
+public:
+	// Reports every interval seconds on stderr if progress, in metrics if it is not empty.
+	// label is added to the lines and to the metrics (the rank with MPI), numRanks are the
+	// ranks counted with telemetryRankAdd.
+	TelemetryReporter(double interval, bool progress, const std::string &metrics, const std::string &label, size_t numRanks = 0)
+		: interval(interval), progress(progress), metrics(metrics), label(label)
+	{
+		telemetryNumRanks = numRanks;
+		telemetryRanks.reset(new StageMeter[numRanks + 1]);
+		lastBytes.assign(STAGES + numRanks, 0);
+	}
+
+	~TelemetryReporter() { stop(); }
+
+	bool start()
+	{
+		if (metrics.compare(0, 5, "unix:") == 0 && !listenOn(metrics.substr(5)))
+			return false;
+		telemetryEnabled = true;
+		begin = last = std::chrono::steady_clock::now();
+		thread = std::thread([this]()
+							 { loop(); });
+		return true;
+	}
+
+	// Stops the reporter after a last report
+	void stop()
+	{
+		if (!thread.joinable())
+			return;
+		stopping = true;
+		thread.join();
+		report();
+		if (listenFd >= 0)
+		{
+			close(listenFd);
+			unlink(metrics.c_str() + 5);
+		}
+	}
+
+private:
+	bool listenOn(const std::string &path)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+		{
+			std::fprintf(stderr, "Socket path too long: %s\n", path.c_str());
+			return false;
+		}
+		memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+		unlink(path.c_str());
+		listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 8) != 0)
+		{
+			perror("socket");
+			std::fprintf(stderr, "Cannot listen on %s\n", path.c_str());
+			if (listenFd >= 0)
+				close(listenFd);
+			listenFd = -1;
+			return false;
+		}
+		return true;
+	}
+
+	void loop()
+	{
+		auto next = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+		while (!stopping)
+		{
+			// wakes up at least every 100 ms to see if it must stop
+			pollfd p = {listenFd, POLLIN, 0};
+			if (poll(&p, listenFd >= 0 ? 1 : 0, 100) > 0 && (p.revents & POLLIN))
+			{
+				int client = accept(listenFd, nullptr, nullptr);
+				if (client >= 0)
+				{
+					const std::string text = prometheus(std::chrono::steady_clock::now());
+					for (size_t sent = 0; sent < text.size();)
+					{
+						ssize_t n = write(client, text.data() + sent, text.size() - sent);
+						if (n <= 0)
+							break;
+						sent += n;
+					}
+					close(client);
+				}
+			}
+			if (std::chrono::steady_clock::now() >= next)
+			{
+				report();
+				next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+			}
+		}
+	}
+
+	struct Sums
+	{
+		uint64_t in[STAGES] = {}, out[STAGES] = {}, blocks[STAGES] = {};
+	};
+
+	// Totals of the stages over the threads
+	Sums sum()
+	{
+		Sums s;
+		std::lock_guard<std::mutex> lock(telemetryMutex);
+		for (auto &m : telemetryMeters)
+			for (int k = 0; k < STAGES; ++k)
+			{
+				s.in[k] += m[k].bytesIn.load(std::memory_order_relaxed);
+				s.out[k] += m[k].bytesOut.load(std::memory_order_relaxed);
+				s.blocks[k] += m[k].blocks.load(std::memory_order_relaxed);
+			}
+		return s;
+	}
+
+	// Blocks sent to the R_Workers and not done yet, done and not gathered by the writer yet
+	static void queues(const Sums &s, long long &workers, long long &writer)
+	{
+		const long long done = s.blocks[STAGE_COMPRESS] + s.blocks[STAGE_DECOMPRESS];
+		workers = (long long)s.blocks[STAGE_SPLIT] - done;
+		writer = done - (long long)s.blocks[STAGE_WRITE];
+	}
+
+	void report()
+	{
+		const auto now = std::chrono::steady_clock::now();
+		if (progress)
+			printProgress(now);
+		if (!metrics.empty() && listenFd < 0)
+		{
+			// written in a new file and renamed, the readers never see half a report
+			const std::string tmp = metrics + ".tmp";
+			FILE *f = fopen(tmp.c_str(), "w");
+			if (f != nullptr)
+			{
+				const std::string text = prometheus(now);
+				bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+				if (fclose(f) == 0 && ok)
+					rename(tmp.c_str(), metrics.c_str());
+			}
+		}
+		last = now;
+	}
+
+	void printProgress(std::chrono::steady_clock::time_point now)
+	{
+		const Sums s = sum();
+		const double elapsed = std::chrono::duration<double>(now - begin).count();
+		const double dt = std::max(std::chrono::duration<double>(now - last).count(), 1e-9);
+		const double MB = 1024.0 * 1024.0;
+		std::vector<std::string> parts;
+		for (int k = 0; k < STAGES; ++k)
+		{
+			if (s.blocks[k] == 0 && s.in[k] == 0)
+				continue;
+			std::string part = format("%s %.1f MB", stageNames[k], s.in[k] / MB);
+			if (k == STAGE_COMPRESS || k == STAGE_DECOMPRESS)
+				part += format(" -> %.1f MB", s.out[k] / MB);
+			parts.push_back(part + format(" (%.1f MB/s)", (s.in[k] - lastBytes[k]) / MB / dt));
+			lastBytes[k] = s.in[k];
+		}
+		long long workers, writer;
+		queues(s, workers, writer);
+		parts.push_back(format("queued %lld blocks, %lld to write", workers, writer));
+		for (size_t r = 1; r < telemetryNumRanks; ++r)
+		{
+			const uint64_t out = telemetryRanks[r].bytesOut.load(std::memory_order_relaxed);
+			parts.push_back(format("rank %zu %.1f MB/s", r, (out - lastBytes[STAGES + r]) / MB / dt));
+			lastBytes[STAGES + r] = out;
+		}
+		std::string line = "Progress" + (label.empty() ? "" : " " + label) + format(" %.1f s: ", elapsed);
+		for (size_t i = 0; i < parts.size(); ++i)
+			line += (i ? ", " : "") + parts[i];
+		std::fprintf(stderr, "%s\n", line.c_str());
+	}
+
+	std::string prometheus(std::chrono::steady_clock::time_point now)
+	{
+		const Sums s = sum();
+		const std::string l = label.empty() ? "" : "," + labelName() + "=\"" + labelValue() + "\"";
+		const std::string only = label.empty() ? "" : "{" + labelName() + "=\"" + labelValue() + "\"}";
+		std::string text;
+		text += "# TYPE minizip_elapsed_seconds gauge\n";
+		text += format("minizip_elapsed_seconds%s %.3f\n", only.c_str(), std::chrono::duration<double>(now - begin).count());
+		const char *names[3] = {"minizip_bytes_in_total", "minizip_bytes_out_total", "minizip_blocks_total"};
+		const uint64_t *values[3] = {s.in, s.out, s.blocks};
+		for (int v = 0; v < 3; ++v)
+		{
+			text += format("# TYPE %s counter\n", names[v]);
+			for (int k = 0; k < STAGES; ++k)
+				text += format("%s{stage=\"%s\"%s} %llu\n", names[v], stageNames[k], l.c_str(), (unsigned long long)values[v][k]);
+		}
+		long long workers, writer;
+		queues(s, workers, writer);
+		text += "# TYPE minizip_queued_blocks gauge\n";
+		text += format("minizip_queued_blocks{queue=\"workers\"%s} %lld\n", l.c_str(), workers);
+		text += format("minizip_queued_blocks{queue=\"writer\"%s} %lld\n", l.c_str(), writer);
+		if (telemetryNumRanks > 1)
+		{
+			text += "# TYPE minizip_rank_bytes_total counter\n";
+			for (size_t r = 1; r < telemetryNumRanks; ++r)
+			{
+				text += format("minizip_rank_bytes_total{rank=\"%zu\",direction=\"sent\"} %llu\n", r,
+							   (unsigned long long)telemetryRanks[r].bytesIn.load(std::memory_order_relaxed));
+				text += format("minizip_rank_bytes_total{rank=\"%zu\",direction=\"received\"} %llu\n", r,
+							   (unsigned long long)telemetryRanks[r].bytesOut.load(std::memory_order_relaxed));
+			}
+		}
+		return text;
+	}
+
+	// label is "name value", for instance "rank 3"
+	std::string labelName() const { return label.substr(0, label.find(' ')); }
+	std::string labelValue() const { return label.find(' ') == std::string::npos ? "" : label.substr(label.find(' ') + 1); }
+
+	__attribute__((format(printf, 1, 2))) static std::string format(const char *fmt, ...)
+	{
+		char buf[256];
+		va_list args;
+		va_start(args, fmt);
+		vsnprintf(buf, sizeof(buf), fmt, args);
+		va_end(args);
+		return buf;
+	}
+
+	const double interval;
+	const bool progress;
+	const std::string metrics, label;
+	int listenFd = -1;
+	std::atomic<bool> stopping{false};
+	std::thread thread;
+	std::chrono::steady_clock::time_point begin, last;
+	std::vector<uint64_t> lastBytes; // at the previous report, for the rates
+};
+
+#endif
@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <pinning.hpp>
+
+// Checks of Placement::plan on made-up layouts (make check): with --numa every R_Worker must get
+// blocks from some L_Worker, and from the L_Workers of its own group when there are any.
+
+static bool failed = false;
+
+static void check(bool ok, const std::string &what)
+{
+  if (!ok)
+  {
+    std::fprintf(stderr, "FAIL: %s\n", what.c_str());
+    failed = true;
+  }
+}
+
+// groups of cpusPerGroup CPUs, numbered from 0
+static Placement layout(size_t nGroups, size_t cpusPerGroup)
+{
+  Placement placement(true);
+  placement.groups.assign(nGroups, std::vector<int>());
+  for (size_t g = 0; g < nGroups; ++g)
+    for (size_t c = 0; c < cpusPerGroup; ++c)
+      placement.groups[g].push_back(g * cpusPerGroup + c);
+  return placement;
+}
+
+static void checkPlan(size_t nGroups, size_t Lw, size_t Rw)
+{
+  Placement placement = layout(nGroups, 16);
+  placement.plan(Lw, Rw);
+  const std::string name = std::to_string(nGroups) + " groups, " + std::to_string(Lw) + " " + std::to_string(Rw) + ": ";
+
+  std::vector<size_t> feeders(Rw, 0);
+  std::vector<bool> hasL(nGroups, false);
+  for (size_t i = 0; i < Lw; ++i)
+  {
+    hasL[placement.groupL[i]] = true;
+    for (int j : placement.localWorkers(i))
+      feeders[j]++;
+  }
+  for (size_t j = 0; j < Rw; ++j)
+  {
+    const size_t g = placement.groupR[j];
+    check(feeders[j] > 0, name + "R_Worker " + std::to_string(j) + " gets no block");
+    check(placement.cpuR[j] / 16 == (int)g, name + "R_Worker " + std::to_string(j) + " is not on a CPU of its group");
+    if (hasL[g])
+      check(placement.feederR[j] == g, name + "R_Worker " + std::to_string(j) + " is fed by another group");
+  }
+}
+
+int main()
+{
+  // 1 L_Worker on 2 NUMA nodes: the 16 R_Workers of the node 1 are fed by the node 0
+  Placement placement = layout(2, 16);
+  placement.plan(1, 32);
+  check(placement.localWorkers(0).size() == 32, "1 32 on 2 groups: the L_Worker does not feed all the R_Workers");
+  check(placement.groupR[31] == 1, "1 32 on 2 groups: the R_Workers are not spread on both groups");
+
+  for (size_t nGroups = 1; nGroups <= 4; ++nGroups)
+    for (size_t Lw = 1; Lw <= 6; ++Lw)
+      for (size_t Rw = 1; Rw <= 12; ++Rw)
+        checkPlan(nGroups, Lw, Rw);
+
+  if (failed)
+    return 1;
+  std::printf("Placement: ok\n");
+  return 0;
+}
@@ -0,0 +1,156 @@
+#if !defined _TRACE_HPP
+#define _TRACE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Tracing of the stages (--trace FILE) -------------------------------------------------------
+
+// Each thread records its spans (begin and end in ticks of the TSC, a name and the bytes it
+// worked on) in its own ring buffer: no lock and no allocation while the farm runs, and when
+// the buffer is full the oldest spans are overwritten. Without --trace a span costs only the
+// test of traceEnabled. At the end the buffers are written as a Chrome trace (JSON), that
+// chrome://tracing and ui.perfetto.dev show with a row per thread and a process per MPI rank.
+
+struct TraceEvent
+{
+	uint64_t begin, end;
+	const char *name; // a string literal
+	size_t bytes;
+};
+
+struct TraceBuffer
+{
+	std::string thread;
+	std::vector<TraceEvent> events;
+	size_t recorded = 0; // the last events.size() are in events, the next one goes in recorded % size
+};
+
+static bool traceEnabled = false;
+static size_t traceCapacity = 0;
+static std::mutex traceMutex; // only to add the buffers
+static std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+static thread_local TraceBuffer *traceLocal = nullptr;
+// Time 0 of the trace, in ticks and in steady_clock time to convert the ticks in microseconds
+static uint64_t traceOriginTicks = 0;
+static std::chrono::steady_clock::time_point traceOriginTime;
+
+static inline uint64_t traceTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Starts tracing, each thread keeps its last eventsPerThread spans. With MPI the ranks call it
+// right after a barrier, so the same time is 0 in all of them.
+static inline void traceStart(size_t eventsPerThread = 1 << 16)
+{
+	traceCapacity = eventsPerThread;
+	traceOriginTime = std::chrono::steady_clock::now();
+	traceOriginTicks = traceTicks();
+	traceEnabled = true;
+}
+
+// Name of the calling thread in the trace, the threads that do not call it are "thread"
+static inline void traceThread(const std::string &name)
+{
+	if (!traceEnabled)
+		return;
+	std::lock_guard<std::mutex> lock(traceMutex);
+	if (traceLocal == nullptr)
+	{
+		traceBuffers.emplace_back(new TraceBuffer);
+		traceLocal = traceBuffers.back().get();
+		traceLocal->events.resize(traceCapacity);
+	}
+	traceLocal->thread = name;
+}
+
+static inline void traceRecord(const char *name, uint64_t begin, size_t bytes)
+{
+	if (traceLocal == nullptr)
+		traceThread("thread");
+	TraceBuffer &b = *traceLocal;
+	b.events[b.recorded++ % b.events.size()] = {begin, traceTicks(), name, bytes};
+}
+
+// A span from its construction to the end of the scope
+class TraceSpan
+{
+public:
+	TraceSpan(const char *name, size_t bytes = 0) : name(name), bytes(bytes)
+	{
+		if (traceEnabled)
+			begin = traceTicks();
+	}
+	~TraceSpan()
+	{
+		if (traceEnabled)
+			traceRecord(name, begin, bytes);
+	}
+	TraceSpan(const TraceSpan &) = delete;
+	TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+	const char *name;
+	size_t bytes;
+	uint64_t begin = 0;
+};
+
+// The events of all the threads, as the elements of the traceEvents array of a Chrome trace
+// separated by commas. pid is the process of the trace (the rank with MPI). Must be called
+// when the traced threads have finished.
+static inline std::string traceEvents(int pid, const std::string &process)
+{
+	// ticks per microsecond, from the time elapsed since traceStart
+	const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - traceOriginTime).count();
+	const uint64_t ticks = traceTicks() - traceOriginTicks;
+	const double perUs = us > 0 && ticks > 0 ? ticks / us : 1e3;
+	std::string out;
+	char line[512];
+	snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, process.c_str());
+	out += line;
+	for (size_t tid = 0; tid < traceBuffers.size(); ++tid)
+	{
+		const TraceBuffer &b = *traceBuffers[tid];
+		snprintf(line, sizeof(line), ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+				 pid, tid, b.thread.c_str());
+		out += line;
+		const size_t size = b.events.size();
+		for (size_t k = b.recorded > size ? b.recorded - size : 0; k < b.recorded; ++k)
+		{
+			const TraceEvent &e = b.events[k % size];
+			snprintf(line, sizeof(line), ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%zu}}",
+					 e.name, pid, tid, (int64_t)(e.begin - traceOriginTicks) / perUs, (e.end - e.begin) / perUs, e.bytes);
+			out += line;
+		}
+	}
+	return out;
+}
+
+// Writes the events (one or more traceEvents joined by commas) as a Chrome trace in path
+static inline bool traceWrite(const std::string &path, const std::string &events)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == nullptr)
+	{
+		perror("fopen");
+		std::fprintf(stderr, "Failed opening trace file %s\n", path.c_str());
+		return false;
+	}
+	bool ok = fprintf(f, "{\"traceEvents\":[%s],\"displayTimeUnit\":\"ms\"}\n", events.c_str()) >= 0;
+	return fclose(f) == 0 && ok;
+}
+
+#endif
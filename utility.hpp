@@ -15,9 +15,13 @@
 
 #include <algorithm>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
 #include <miniz/miniz.h>
+#include <manifest.hpp>
+#include <dedup.hpp>
+#include <chunker.hpp>
 
 #include <iostream>
 #include <chrono>
@@ -120,6 +124,7 @@ static inline bool writeFile(const std::string &filename, unsigned char *ptr, si
 			perror("fwrite");
 			std::fprintf(stderr, "Failed writing to output file %s\n", filename.c_str());
 		}
+		fclose(pOutfile);
 		return false;
 	}
 	if (fclose(pOutfile) != 0)
@@ -177,6 +182,11 @@ static inline char *getOption(char **begin, char **end, const std::string &optio
 		return *itr;
 	return nullptr;
 }
+// check if a flag is in the command line
+static inline bool hasOption(char **begin, char **end, const std::string &option)
+{
+	return std::find(begin, end, option) != end;
+}
 // create a tempory "unique" directory name
 static inline bool createTmpDir(std::string &tmpdir)
 {
@@ -241,8 +251,9 @@ static inline bool removeDir(const std::string &tmpdir, bool force = false)
 
 // --------------------------------------------------------------------------
 
+// hash: if not null, the content hash of the input (see contentHash), taken while compressing
 static inline int compressFile(const char fname[], size_t infile_size,
-							   const bool removeOrigin = REMOVE_ORIGIN)
+							   const bool removeOrigin = REMOVE_ORIGIN, uint64_t *hash = nullptr)
 {
 	// define the output file name
 	const std::string infilename(fname);
@@ -294,6 +305,7 @@ static inline int compressFile(const char fname[], size_t infile_size,
 
 	// Total bytes written after the header
 	size_t tot = headerSize;
+	uint64_t content = CONTENT_HASH_INIT;
 
 	for (size_t i = 0; i < fullblocks; ++i)
 	{
@@ -308,6 +320,8 @@ static inline int compressFile(const char fname[], size_t infile_size,
 			return -1;
 		}
 		tot += cmp_len;
+		if (hash != nullptr)
+			content = contentHashCombine(content, contentHashBlock(ptr + BIGFILE_LOW_THRESHOLD * i, BIGFILE_LOW_THRESHOLD), BIGFILE_LOW_THRESHOLD);
 		// Putting on the header the compressed dimension of the block
 		memcpy(ptrOut + sizeOfT * (i + 2), &cmp_len, sizeof(size_t));
 
@@ -329,6 +343,8 @@ static inline int compressFile(const char fname[], size_t infile_size,
 		}
 
 		tot += cmp_len;
+		if (hash != nullptr)
+			content = contentHashCombine(content, contentHashBlock(ptr + BIGFILE_LOW_THRESHOLD * fullblocks, partialblock), partialblock);
 
 		//size_t blocksize;
 		//std::fprintf(stderr, "len chunk : %zu \n", cmp_len);
@@ -357,6 +373,10 @@ static inline int compressFile(const char fname[], size_t infile_size,
 	}
 	unmapFile(ptr, infile_size);
 	delete[] ptrOut;
+	if (!success)
+		return -1;
+	if (hash != nullptr)
+		*hash = content;
 	return 0;
 }
 
@@ -408,6 +428,51 @@ inline bool existsFile (const std::string& name) {
   struct stat buffer;   
   return (stat (name.c_str(), &buffer) == 0); 
 }
+// Decompresses the blocks of the .miniz fname (mapped in ptr) that refer to blocks of other
+// .miniz files, from the blocks of those files
+static inline bool resolveSourceRefs(const char fname[], const unsigned char *ptr, size_t size, unsigned char *out,
+									 const size_t *entries, size_t nblocks, const size_t *offsets)
+{
+	DedupSources sources;
+	if (!readDedupSources(ptr, size, sources))
+		return false;
+	std::vector<unsigned char *> mapped(sources.names.size(), nullptr);
+	std::vector<size_t> mappedSize(sources.names.size(), 0);
+	bool ok = true;
+	size_t check = 0;
+	for (size_t i = 0; i < nblocks && ok; ++i)
+	{
+		if (!isDedupRef(entries[i]) || dedupSource(entries[i]) == 0)
+			continue;
+		const size_t k = dedupSource(entries[i]) - 1;
+		if (mapped[k] == nullptr)
+		{
+			const std::string source = sourcePath(fname, sources.names[k]);
+			if (!mapFile(source.c_str(), mappedSize[k], mapped[k]))
+			{
+				if (QUITE_MODE >= 1)
+					std::fprintf(stderr, "%s refers to %s that cannot be read\n", fname, source.c_str());
+				ok = false;
+				break;
+			}
+		}
+		size_t begin, cmpSize, length;
+		unsigned long outLength = offsets[i + 1] - offsets[i];
+		ok = sourceBlock(mapped[k], mappedSize[k], BIGFILE_LOW_THRESHOLD, dedupTarget(entries[i]), begin, cmpSize, length) &&
+			 length == outLength && uncompress(out + offsets[i], &outLength, mapped[k] + begin, cmpSize) == MZ_OK;
+		if (ok)
+		{
+			const Hash128 h = hash128(out + offsets[i], length);
+			ok = h.lo == sources.checks[check].lo && h.hi == sources.checks[check].hi;
+		}
+		check++;
+	}
+	for (size_t k = 0; k < mapped.size(); ++k)
+		if (mapped[k] != nullptr)
+			unmapFile(mapped[k], mappedSize[k]);
+	return ok;
+}
+
 static inline int decompressFile(const char fname[], size_t infile_size,
 								 const bool removeOrigin = REMOVE_ORIGIN)
 {
@@ -448,20 +513,40 @@ static inline int decompressFile(const char fname[], size_t infile_size,
 	size_t numberOfBlocks;
 	memcpy(&numberOfBlocks, ptr + sizeOfT, sizeof(size_t));
 
+	// Where each block goes in the uncompressed file (the blocks can have different sizes)
+	std::vector<size_t> offsets;
+	if (!blockOffsets(ptr, infile_size, BIGFILE_LOW_THRESHOLD, offsets))
+	{
+		if (QUITE_MODE >= 1)
+			std::fprintf(stderr, "Invalid header in %s\n", fname);
+		unmapFile(ptr, infile_size);
+		return -1;
+	}
+	size_t headerSize = headerBytes(numberOfBlocks);
+	numberOfBlocks = blockCount(numberOfBlocks);
+
 	unsigned char *ptrOut = new unsigned char[uncompressedFileSize];
 
-	size_t headerSize = sizeOfT * (numberOfBlocks + 2);
 	// Total bytes written
 	size_t tot = 0;
 	// Total of bytes read after the header
 	size_t readBytes = headerSize;
+	bool references = false;
 	for (size_t i = 0; i < numberOfBlocks; ++i)
 	{
 		size_t sizeUncompBlock;
 		//Get the size of the block from the header of the file
 		memcpy(&sizeUncompBlock, ptr + sizeOfT * (i + 2), sizeof(size_t));
 
-		unsigned long cmp_len = BIGFILE_LOW_THRESHOLD + BIGFILE_LOW_THRESHOLD;
+		// deduplicated block, copied from the block it refers to after the loop
+		if (isDedupRef(sizeUncompBlock))
+		{
+			references = true;
+			tot += offsets[i + 1] - offsets[i];
+			continue;
+		}
+
+		unsigned long cmp_len = offsets[i + 1] - offsets[i];
 		if (uncompress((ptrOut + tot), &cmp_len, (const unsigned char *)(ptr + readBytes), sizeUncompBlock) != MZ_OK)
 		{
 			if (QUITE_MODE >= 1)
@@ -474,6 +559,20 @@ static inline int decompressFile(const char fname[], size_t infile_size,
 		readBytes += sizeUncompBlock;
 		tot += cmp_len;
 	}
+	if (references)
+	{
+		std::vector<size_t> entries(numberOfBlocks);
+		memcpy(entries.data(), ptr + sizeOfT * 2, sizeOfT * numberOfBlocks);
+		if (!resolveDedupRefs(ptrOut, entries.data(), numberOfBlocks, offsets.data()) ||
+			!resolveSourceRefs(fname, ptr, infile_size, ptrOut, entries.data(), numberOfBlocks, offsets.data()))
+		{
+			if (QUITE_MODE >= 1)
+				std::fprintf(stderr, "Invalid block reference in %s\n", fname);
+			unmapFile(ptr, infile_size);
+			delete[] ptrOut;
+			return -1;
+		}
+	}
 
 	// write the compressed data into disk
 	bool success = writeFile(outfilename, ptrOut, tot);
@@ -489,11 +588,12 @@ static inline int decompressFile(const char fname[], size_t infile_size,
 // --------------------------------------------------------------------------
 
 // returns false in case of error
-static inline bool doWork(const char fname[], size_t size, const bool comp)
+// hash: see compressFile
+static inline bool doWork(const char fname[], size_t size, const bool comp, uint64_t *hash = nullptr)
 {
 	if (comp)
 	{
-		if (compressFile(fname, size, REMOVE_ORIGIN) < 0)
+		if (compressFile(fname, size, REMOVE_ORIGIN, hash) < 0)
 			return false;
 	}
 	else
@@ -504,8 +604,7 @@ static inline bool doWork(const char fname[], size_t size, const bool comp)
 	return true;
 }
 
-// returns false in case of error
-static inline bool walkDir(const char dname[], const bool comp)
+static inline bool enterDir(const char dname[])
 {
 	if (chdir(dname) == -1)
 	{
@@ -516,13 +615,22 @@ static inline bool walkDir(const char dname[], const bool comp)
 		}
 		return false;
 	}
+	return true;
+}
+
+// returns false in case of error
+// Walks the tree of the current directory, see walkFiles. Whatever happens in a subdirectory,
+// the current directory is the same at the end.
+template <typename OnFile>
+static inline bool walkCurrentDir(const bool comp, OnFile &onFile, Manifest *manifest, const std::string &prefix)
+{
 	DIR *dir;
 	if ((dir = opendir(".")) == NULL)
 	{
 		if (QUITE_MODE >= 1)
 		{
 			perror("opendir");
-			std::fprintf(stderr, "Error: opendir %s\n", dname);
+			std::fprintf(stderr, "Error: opendir %s\n", prefix.empty() ? "." : prefix.c_str());
 		}
 		return false;
 	}
@@ -538,28 +646,42 @@ static inline bool walkDir(const char dname[], const bool comp)
 				perror("stat");
 				std::fprintf(stderr, "Error: stat %s\n", file->d_name);
 			}
+			closedir(dir);
 			return false;
 		}
 		if (S_ISDIR(statbuf.st_mode))
 		{
 			if (!isdot(file->d_name))
 			{
-				if (walkDir(file->d_name, comp))
+				if (!enterDir(file->d_name))
 				{
-					if (!chdir(".."))
-					{
-						perror("chdir");
-						std::fprintf(stderr, "Error: chdir ..\n");
-						error = true;
-					}
+					error = true;
+					continue;
 				}
-				else
+				if (!walkCurrentDir(comp, onFile, manifest, prefix + file->d_name + "/"))
 					error = true;
+				if (chdir("..") != 0)
+				{
+					perror("chdir");
+					std::fprintf(stderr, "Error: chdir ..\n");
+					closedir(dir);
+					return false;
+				}
 			}
 		}
 		else
 		{
-			if (!doWork(file->d_name, statbuf.st_size, comp))
+			const std::string name = prefix + file->d_name;
+			if (manifest != nullptr && comp)
+			{
+				// the compressed files and the manifest are not compressed again
+				if (discardIt(file->d_name, comp) || strcmp(file->d_name, MANIFEST_NAME) == 0)
+					continue;
+				if (manifest->unchanged(name, file->d_name, statbuf))
+					continue;
+				manifest->add(name, statbuf);
+			}
+			if (!onFile(name, file->d_name, statbuf))
 				error = true;
 		}
 	}
@@ -573,4 +695,34 @@ static inline bool walkDir(const char dname[], const bool comp)
 	return !error;
 }
 
+// returns false in case of error
+// Walks the tree of dname calling onFile(name, fname, statbuf) for each file: fname is the name
+// in the current directory, name its path in dname (prefix is the path of dname). At the end the
+// current directory is dname. With a manifest (incremental compression) the files that have not
+// changed since the previous run are skipped.
+template <typename OnFile>
+static inline bool walkFiles(const char dname[], const bool comp, OnFile &&onFile, Manifest *manifest = nullptr,
+							 const std::string &prefix = "")
+{
+	if (!enterDir(dname))
+		return false;
+	return walkCurrentDir(comp, onFile, manifest, prefix);
+}
+
+// returns false in case of error
+// Compresses/decompresses the files of the tree of dname one at a time
+static inline bool walkDir(const char dname[], const bool comp, Manifest *manifest = nullptr)
+{
+	return walkFiles(dname, comp, [comp, manifest](const std::string &name, const char *fname, const struct stat &statbuf)
+					 {
+		if (manifest == nullptr || !comp)
+			return doWork(fname, statbuf.st_size, comp);
+		// the file goes in the manifest only once its .miniz is written
+		uint64_t hash;
+		if (!doWork(fname, statbuf.st_size, comp, &hash))
+			return false;
+		manifest->done(name, hash);
+		return true; }, manifest);
+}
+
 #endif